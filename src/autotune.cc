@@ -0,0 +1,249 @@
+#include "autotune.h"
+
+#include <algorithm>
+#include <chrono>
+#include <complex>
+#include <fstream>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "logger.h"
+
+namespace
+{
+  // Representative views: a thumbnail, the whole set, the boundary, and a view
+  // where most of the time is spent in long orbits
+  const struct
+  {
+    std::complex<double> min_c;
+    std::complex<double> max_c;
+    int width;
+    int height;
+    int max_iter;
+  } views[] =
+  {
+    { { -2.0,  -1.5   }, { 1.0,   1.5   },  256, 256,   64 },
+    { { -2.0,  -1.125 }, { 1.0,   1.125 }, 1024, 768,  256 },
+    { { -0.8,   0.0   }, { -0.7,  0.1   },  800, 800, 1024 },
+    { { -0.76,  0.09  }, { -0.74, 0.11  },  512, 512, 5000 },
+  };
+
+  // Each view is computed this many times and the fastest time is used
+  constexpr int NUM_RUNS = 3;
+
+  // Band heights that are tried
+  const int band_heights[] = { 1, 2, 4, 8, 16, 32 };
+
+  // Gets the total time in seconds to compute the views with the given settings
+  double measure(const Autotune::Settings& settings)
+  {
+    Autotune::apply(settings);
+    auto total = 0.0;
+    for (const auto& view : views)
+    {
+      auto best = std::numeric_limits<double>::max();
+      for (auto run = 0; run < NUM_RUNS; run++)
+      {
+        const auto start = std::chrono::steady_clock::now();
+        Mandelbrot::compute(view.min_c, view.max_c, view.width, view.height, view.max_iter);
+        const auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+      }
+      total += best;
+    }
+    return total;
+  }
+
+  bool parse_int(const std::string& str, int* value)
+  {
+    try
+    {
+      std::size_t pos = 0;
+      *value = std::stoi(str, &pos);
+      return pos == str.size();
+    }
+    catch (const std::exception&)
+    {
+      return false;
+    }
+  }
+}
+
+namespace Autotune
+{
+
+Settings current()
+{
+  Settings settings;
+  settings.kernel              = Mandelbrot::get_kernel();
+  settings.specialized_kernels = Mandelbrot::get_specialized_kernels();
+  settings.num_threads         = Mandelbrot::get_num_threads();
+  settings.band_height         = Mandelbrot::get_band_height();
+  return settings;
+}
+
+void apply(const Settings& settings)
+{
+  Mandelbrot::set_kernel(settings.kernel);
+  Mandelbrot::set_specialized_kernels(settings.specialized_kernels);
+  Mandelbrot::set_num_threads(settings.num_threads);
+  Mandelbrot::set_band_height(settings.band_height);
+}
+
+Settings run()
+{
+  auto best = current();
+  auto best_time = std::numeric_limits<double>::max();
+  const auto consider = [&best, &best_time](const Settings& candidate)
+  {
+    const auto time = measure(candidate);
+    LOG_INFO("kernel: %s, specialized kernels: %s, threads: %d, band height: %d: %.1f ms",
+             Mandelbrot::kernel_to_str(candidate.kernel),
+             candidate.specialized_kernels ? "yes" : "no",
+             candidate.num_threads,
+             candidate.band_height,
+             time * 1000.0);
+    if (time < best_time)
+    {
+      best = candidate;
+      best_time = time;
+    }
+  };
+
+  for (const auto kernel : { Mandelbrot::Kernel::SCALAR,
+                             Mandelbrot::Kernel::SSE2,
+                             Mandelbrot::Kernel::AVX2,
+                             Mandelbrot::Kernel::AVX512 })
+  {
+    if (Mandelbrot::is_supported(kernel))
+    {
+      auto candidate = best;
+      candidate.kernel = kernel;
+      consider(candidate);
+    }
+  }
+
+  {
+    auto candidate = best;
+    candidate.specialized_kernels = !best.specialized_kernels;
+    consider(candidate);
+  }
+
+  // Powers of two below the number of hardware threads, and that number
+  const auto hardware_threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+  std::vector<int> thread_counts;
+  for (auto num_threads = 1; num_threads < hardware_threads; num_threads *= 2)
+  {
+    thread_counts.push_back(num_threads);
+  }
+  thread_counts.push_back(hardware_threads);
+
+  const auto tried_threads = best.num_threads;
+  for (const auto num_threads : thread_counts)
+  {
+    if (num_threads != tried_threads)
+    {
+      auto candidate = best;
+      candidate.num_threads = num_threads;
+      consider(candidate);
+    }
+  }
+
+  const auto tried_band_height = best.band_height;
+  for (const auto band_height : band_heights)
+  {
+    if (band_height != tried_band_height)
+    {
+      auto candidate = best;
+      candidate.band_height = band_height;
+      consider(candidate);
+    }
+  }
+
+  apply(best);
+  return best;
+}
+
+bool load(const std::string& path, Settings* settings)
+{
+  std::ifstream file(path);
+  if (!file)
+  {
+    return false;
+  }
+
+  auto loaded = *settings;
+  std::string line;
+  auto line_number = 0;
+  while (std::getline(file, line))
+  {
+    line_number += 1;
+    if (line.empty() || line[0] == '#')
+    {
+      continue;
+    }
+
+    const auto sep = line.find('=');
+    const auto key = line.substr(0, sep);
+    const auto value = sep == std::string::npos ? std::string() : line.substr(sep + 1);
+    auto valid = sep != std::string::npos;
+    if (key == "kernel")
+    {
+      valid = valid && Mandelbrot::kernel_from_str(value, &loaded.kernel);
+    }
+    else if (key == "specialized_kernels")
+    {
+      valid = valid && (value == "0" || value == "1");
+      loaded.specialized_kernels = value == "1";
+    }
+    else if (key == "threads")
+    {
+      valid = valid && parse_int(value, &loaded.num_threads) && loaded.num_threads > 0;
+    }
+    else if (key == "band_height")
+    {
+      valid = valid && parse_int(value, &loaded.band_height) && loaded.band_height > 0;
+    }
+    else
+    {
+      valid = false;
+    }
+
+    if (!valid)
+    {
+      LOG_ERROR("%s:%d: invalid setting: \"%s\"", path.c_str(), line_number, line.c_str());
+      return false;
+    }
+  }
+
+  if (!Mandelbrot::is_supported(loaded.kernel))
+  {
+    LOG_ERROR("%s: kernel %s is not supported by this CPU, run --autotune again",
+              path.c_str(),
+              Mandelbrot::kernel_to_str(loaded.kernel));
+    return false;
+  }
+
+  *settings = loaded;
+  return true;
+}
+
+bool save(const std::string& path, const Settings& settings)
+{
+  std::ofstream file(path, std::ios::trunc);
+  file << "# Written by pmp_server --autotune, remove this file to use the defaults\n"
+       << "kernel=" << Mandelbrot::kernel_to_str(settings.kernel) << "\n"
+       << "specialized_kernels=" << (settings.specialized_kernels ? 1 : 0) << "\n"
+       << "threads=" << settings.num_threads << "\n"
+       << "band_height=" << settings.band_height << "\n";
+  file.close();
+  if (!file)
+  {
+    LOG_ERROR("Could not write settings to %s", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+}
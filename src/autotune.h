@@ -0,0 +1,84 @@
+#ifndef AUTOTUNE_H_
+#define AUTOTUNE_H_
+
+#include <string>
+
+#include "mandelbrot.h"
+
+/**
+ * @brief Finds the fastest Mandelbrot settings for the host
+ *
+ * The best kernel, number of threads and band height differ between hosts,
+ * so pmp_server --autotune measures them on a set of representative views
+ * and saves the fastest settings to a file, which is loaded on later startups.
+ */
+namespace Autotune
+{
+
+/**
+ * @brief Settings that are tuned, @see Mandelbrot::set_kernel etc.
+ */
+struct Settings
+{
+  Mandelbrot::Kernel kernel = Mandelbrot::Kernel::AUTO;
+  bool specialized_kernels = true;
+  int num_threads = 1;
+  int band_height = 4;
+};
+
+/**
+ * @brief Default path of the settings file, relative to the working directory
+ */
+constexpr const char* DEFAULT_PATH = "pmp_server.tune";
+
+/**
+ * @brief Gets the settings currently used by the Mandelbrot module
+ */
+Settings current();
+
+/**
+ * @brief Applies settings to the Mandelbrot module
+ *
+ * Must not be called while a computation is ongoing.
+ */
+void apply(const Settings& settings);
+
+/**
+ * @brief Measures the settings on a set of representative views
+ *
+ * One setting is tuned at a time, in the order kernel, specialized kernels,
+ * number of threads and band height, each keeping the best value found so
+ * far for the others. Progress is logged. The Mandelbrot module is left with
+ * the returned settings applied.
+ *
+ * @return The fastest settings
+ */
+Settings run();
+
+/**
+ * @brief Loads settings saved by save()
+ *
+ * Settings that are missing from the file keep their value in settings.
+ *
+ * @param[in]   path      Path of the file
+ * @param[out]  settings  Pointer to where to store the settings
+ *
+ * @return true if the file was loaded, false if it does not exist or is
+ *         invalid (which is logged), or if its kernel is not supported by
+ *         this host
+ */
+bool load(const std::string& path, Settings* settings);
+
+/**
+ * @brief Saves settings to a file, replacing it
+ *
+ * @param[in]  path      Path of the file
+ * @param[in]  settings  The settings
+ *
+ * @return true if saved, otherwise false (which is logged)
+ */
+bool save(const std::string& path, const Settings& settings);
+
+}
+
+#endif  // AUTOTUNE_H_
@@ -52,4 +52,19 @@ void stop()
   io_service.stop();
 }
 
+void post(const std::function<void(void)>& function)
+{
+  io_service.post(function);
+}
+
+void post_delayed(std::chrono::milliseconds delay, const std::function<void(void)>& function)
+{
+  // The timer is kept alive by the handler until it has been called
+  auto timer = std::make_shared<asio::steady_timer>(io_service, delay);
+  timer->async_wait([timer, function](const std::error_code&)
+                    {
+                      function();
+                    });
+}
+
 }
@@ -1,37 +1,264 @@
 #include "tcp_backend.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <unistd.h>
 
-#include "tcp_client_epoll.h"
+#include "tcp_backend_epoll.h"
+#include "tcp_connection_epoll.h"
 #include "tcp_server_epoll.h"
 #include "logger.h"
 
-std::unique_ptr<TcpBackend::Client> TcpBackend::create_client(const std::string& address,
-                                                              const std::string& port,
-                                                              const OnConnected& on_connected,
-                                                              const OnError& on_error)
+namespace
+{
+  // Functions posted with TcpBackend::post(), possibly from other threads.
+  // run() is woken up through the eventfd and calls them
+  std::mutex posted_mutex;
+  std::vector<std::function<void(void)>> posted_functions;
+  std::atomic<bool> stopped(false);
+
+  // Functions posted with TcpBackend::post_delayed(), by when to call them.
+  // Only used by the thread calling run()
+  std::multimap<std::chrono::steady_clock::time_point, std::function<void(void)>> delayed_functions;
+
+  // Callbacks of the file descriptors that run() waits for, @see TcpBackend::set_events
+  std::map<int, TcpBackend::OnEvents> fd_callbacks;
+
+  int get_post_fd()
+  {
+    static const auto post_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    return post_fd;
+  }
+
+  // Gets the epoll instance, which always waits for the eventfd of post()
+  int get_epoll_fd()
+  {
+    static const auto epoll_fd = []()
+    {
+      if (get_post_fd() < 0)
+      {
+        perror("eventfd");
+        return -1;
+      }
+
+      const auto fd = epoll_create1(EPOLL_CLOEXEC);
+      if (fd < 0)
+      {
+        perror("epoll_create1");
+        return -1;
+      }
+
+      epoll_event event = {};
+      event.events = EPOLLIN;
+      event.data.fd = get_post_fd();
+      if (epoll_ctl(fd, EPOLL_CTL_ADD, get_post_fd(), &event) < 0)
+      {
+        perror("epoll_ctl");
+        ::close(fd);
+        return -1;
+      }
+      return fd;
+    }();
+    return epoll_fd;
+  }
+
+  // Wakes up run(), only uses functions that are safe in a signal handler
+  void wake_up()
+  {
+    const std::uint64_t one = 1u;
+    if (::write(get_post_fd(), &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+      perror("write");
+    }
+  }
+
+  // Calls the functions that have been posted so far, in order
+  void call_posted_functions()
+  {
+    std::uint64_t count;
+    if (::read(get_post_fd(), &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+      perror("read");
+    }
+
+    std::vector<std::function<void(void)>> functions;
+    {
+      std::lock_guard<std::mutex> lock(posted_mutex);
+      functions.swap(posted_functions);
+    }
+    for (const auto& function : functions)
+    {
+      function();
+    }
+  }
+
+  // Calls the delayed functions whose time has come, in order
+  void call_delayed_functions()
+  {
+    const auto now = std::chrono::steady_clock::now();
+    while (!delayed_functions.empty() && delayed_functions.begin()->first <= now)
+    {
+      const auto function = std::move(delayed_functions.begin()->second);
+      delayed_functions.erase(delayed_functions.begin());
+      function();
+    }
+  }
+
+  // Milliseconds until the next delayed function is due (rounded up), -1 if there is none
+  int get_timeout()
+  {
+    if (delayed_functions.empty())
+    {
+      return -1;
+    }
+    const auto left = delayed_functions.begin()->first - std::chrono::steady_clock::now();
+    const auto left_ms = std::chrono::duration_cast<std::chrono::milliseconds>(left + std::chrono::milliseconds(1));
+    return static_cast<int>(std::max<std::chrono::milliseconds::rep>(0, left_ms.count()));
+  }
+
+  // Checks if run() has anything left to wait for or to call
+  bool has_work()
+  {
+    if (!fd_callbacks.empty() || !delayed_functions.empty())
+    {
+      return true;
+    }
+    std::lock_guard<std::mutex> lock(posted_mutex);
+    return !posted_functions.empty();
+  }
+
+  // State of a connect(), which tries the resolved addresses in order
+  struct Connecting
+  {
+    std::unique_ptr<addrinfo, void (*)(addrinfo*)> addresses{ nullptr, freeaddrinfo };
+    const addrinfo* next = nullptr;
+    std::string address;
+    std::string port;
+    TcpBackend::OnConnected on_connected;
+    TcpBackend::OnError on_error;
+    std::string error;
+  };
+
+  // Starts connecting to the next address, calls OnError if there is none left
+  void connect_next(const std::shared_ptr<Connecting>& connecting)
+  {
+    while (connecting->next)
+    {
+      const auto* info = connecting->next;
+      connecting->next = info->ai_next;
+
+      const auto socket_fd = socket(info->ai_family, info->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, info->ai_protocol);
+      if (socket_fd < 0)
+      {
+        connecting->error = strerror(errno);
+        continue;
+      }
+
+      if (::connect(socket_fd, info->ai_addr, info->ai_addrlen) < 0 && errno != EINPROGRESS)
+      {
+        connecting->error = strerror(errno);
+        ::close(socket_fd);
+        continue;
+      }
+
+      // The socket becomes writable when the connection is established or has failed
+      TcpBackend::set_events(socket_fd, EPOLLOUT, [connecting, socket_fd](std::uint32_t)
+      {
+        TcpBackend::set_events(socket_fd, 0u, nullptr);
+
+        auto error = 0;
+        auto len = static_cast<socklen_t>(sizeof(error));
+        if (getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+        {
+          error = errno;
+        }
+        if (error != 0)
+        {
+          connecting->error = strerror(error);
+          ::close(socket_fd);
+          connect_next(connecting);
+          return;
+        }
+
+        connecting->on_connected(std::make_unique<TcpBackend::ConnectionEpoll>(socket_fd),
+                                 connecting->address,
+                                 connecting->port);
+      });
+      return;
+    }
+
+    // Like the other callbacks OnError is not called in the context of connect()
+    TcpBackend::post([connecting]()
+    {
+      connecting->on_error(connecting->error);
+    });
+  }
+}
+
+void TcpBackend::connect(const std::string& address,
+                         const std::string& port,
+                         const OnConnected& on_connected,
+                         const OnError& on_error)
 {
-  LOG_ERROR("%s: not yet implemented", __func__);
-  (void)address;
-  (void)port;
-  (void)on_connected;
-  (void)on_error;
-  return nullptr;
+  auto connecting = std::make_shared<Connecting>();
+  connecting->address = address;
+  connecting->port = port;
+  connecting->on_connected = on_connected;
+  connecting->on_error = on_error;
+
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* addresses = nullptr;
+  const auto ret = getaddrinfo(address.c_str(), port.c_str(), &hints, &addresses);
+  if (ret != 0)
+  {
+    connecting->error = gai_strerror(ret);
+  }
+  else
+  {
+    connecting->addresses.reset(addresses);
+    connecting->next = addresses;
+  }
+  connect_next(connecting);
 }
 
 std::unique_ptr<TcpBackend::Server> TcpBackend::create_server(std::uint16_t port,
                                                               const OnAccept& on_accept)
 {
-  // Create socket
-  auto socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+  // Create socket, non-blocking since accepting is done when run() says it is ready
+  auto socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (socket_fd < 0)
   {
     perror("socket");
     return nullptr;
   }
 
+  // Allow restarting the server while connections of a previous run are in TIME_WAIT
+  const auto reuse_address = 1;
+  if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_address, sizeof(reuse_address)) < 0)
+  {
+    perror("setsockopt");
+    ::close(socket_fd);
+    return nullptr;
+  }
+
   // Bind socket
   sockaddr_in addr;
   addr.sin_family = AF_INET;
@@ -45,6 +272,7 @@ std::unique_ptr<TcpBackend::Server> TcpBackend::create_server(std::uint16_t port
   if (ret < 0)
   {
     perror("bind");
+    ::close(socket_fd);
     return nullptr;
   }
 
@@ -54,6 +282,7 @@ std::unique_ptr<TcpBackend::Server> TcpBackend::create_server(std::uint16_t port
   if (ret < 0)
   {
     perror("listen");
+    ::close(socket_fd);
     return nullptr;
   }
 
@@ -62,5 +291,92 @@ std::unique_ptr<TcpBackend::Server> TcpBackend::create_server(std::uint16_t port
 
 void TcpBackend::run()
 {
-  LOG_ERROR("%s: not yet implemented", __func__);
+  const auto epoll_fd = get_epoll_fd();
+  if (epoll_fd < 0)
+  {
+    return;
+  }
+
+  // Like asio, run until there is nothing left to wait for
+  while (!stopped && has_work())
+  {
+    static const auto max_events = 16;
+    epoll_event events[max_events];
+    const auto num_events = epoll_wait(epoll_fd, events, max_events, get_timeout());
+    if (num_events < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror("epoll_wait");
+      break;
+    }
+
+    for (auto i = 0; i < num_events; i++)
+    {
+      if (events[i].data.fd == get_post_fd())
+      {
+        call_posted_functions();
+        continue;
+      }
+
+      // A callback may change or remove the callbacks of any file descriptor,
+      // including its own, so the callback is copied before it is called
+      const auto it = fd_callbacks.find(events[i].data.fd);
+      if (it != fd_callbacks.end())
+      {
+        const auto on_events = it->second;
+        on_events(events[i].events);
+      }
+    }
+    call_delayed_functions();
+  }
+}
+
+void TcpBackend::stop()
+{
+  stopped = true;
+  wake_up();
+}
+
+void TcpBackend::post(const std::function<void(void)>& function)
+{
+  {
+    std::lock_guard<std::mutex> lock(posted_mutex);
+    posted_functions.push_back(function);
+  }
+  wake_up();
+}
+
+void TcpBackend::post_delayed(std::chrono::milliseconds delay, const std::function<void(void)>& function)
+{
+  delayed_functions.emplace(std::chrono::steady_clock::now() + delay, function);
+}
+
+void TcpBackend::set_events(int fd, std::uint32_t events, const OnEvents& on_events)
+{
+  const auto it = fd_callbacks.find(fd);
+  if (events == 0u)
+  {
+    if (it != fd_callbacks.end())
+    {
+      fd_callbacks.erase(it);
+      if (epoll_ctl(get_epoll_fd(), EPOLL_CTL_DEL, fd, nullptr) < 0)
+      {
+        perror("epoll_ctl");
+      }
+    }
+    return;
+  }
+
+  epoll_event event = {};
+  event.events = events;
+  event.data.fd = fd;
+  if (epoll_ctl(get_epoll_fd(), it != fd_callbacks.end() ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event) < 0)
+  {
+    perror("epoll_ctl");
+    return;
+  }
+  fd_callbacks[fd] = on_events;
 }
@@ -0,0 +1,34 @@
+#ifndef TCP_BACKEND_EPOLL_H_
+#define TCP_BACKEND_EPOLL_H_
+
+#include <cstdint>
+#include <functional>
+
+namespace TcpBackend
+{
+
+/**
+ * @brief OnEvents callback
+ *
+ * Called by run() when events that are waited for have occurred on a file descriptor
+ *
+ * @param[in]  events  The events, e.g. EPOLLIN, EPOLLOUT, EPOLLERR or EPOLLHUP
+ */
+using OnEvents = std::function<void(std::uint32_t events)>;
+
+/**
+ * @brief Sets the events that run() waits for on a file descriptor
+ *
+ * The events are level-triggered, so the file descriptor must be non-blocking.
+ * run() keeps running as long as any file descriptor has events to wait for.
+ * The file descriptor must stop waiting (events 0) before it is closed.
+ *
+ * @param[in]  fd         The file descriptor
+ * @param[in]  events     The events to wait for, e.g. EPOLLIN | EPOLLOUT, or 0 to stop waiting
+ * @param[in]  on_events  Callback that replaces the previous one of the file descriptor
+ */
+void set_events(int fd, std::uint32_t events, const OnEvents& on_events);
+
+}
+
+#endif  // TCP_BACKEND_EPOLL_H_
@@ -1 +0,0 @@
-#include "tcp_client_epoll.h"
@@ -1,15 +0,0 @@
-#ifndef TCP_CLIENT_EPOLL_H_
-#define TCP_CLIENT_EPOLL_H_
-
-#include "tcp_backend.h"
-
-namespace TcpBackend
-{
-
-class ClientEpoll : public Client
-{
-};
-
-}
-
-#endif  // TCP_CLIENT_EPOLL_H_
@@ -1,17 +1,48 @@
 #include "tcp_connection_epoll.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 
-#include "logger.h"
+#include "tcp_backend_epoll.h"
 
 namespace TcpBackend
 {
 
 ConnectionEpoll::ConnectionEpoll(int socket_fd)
-    : m_socket_fd(socket_fd)
+    : m_socket_fd(socket_fd),
+      m_read_buffer(),
+      m_write_buffer(),
+      m_read_len(0),
+      m_data_len(0),
+      m_write_len(0),
+      m_written(0),
+      m_read_ongoing(false),
+      m_write_ongoing(false),
+      m_closing(false),
+      m_on_disconnected(),
+      m_on_read(),
+      m_on_write(),
+      m_on_error()
 {
 }
 
+ConnectionEpoll::~ConnectionEpoll()
+{
+  if (m_socket_fd >= 0)
+  {
+    set_events(m_socket_fd, 0u, nullptr);
+    ::close(m_socket_fd);
+  }
+}
+
 void ConnectionEpoll::set_callbacks(const OnDisconnected& on_disconnected,
                                     const OnRead& on_read,
                                     const OnWrite& on_write,
@@ -25,23 +56,214 @@ void ConnectionEpoll::set_callbacks(const OnDisconnected& on_disconnected,
 
 void ConnectionEpoll::read()
 {
-  LOG_ERROR("%s: not yet implemented", __func__);
+  if (m_read_ongoing)
+  {
+    fprintf(stderr, "%s: read procedure already ongoing!\n", __func__);
+    return;
+  }
+
+  if (m_closing)
+  {
+    return;
+  }
+
+  // Read header (2 bytes) into m_read_buffer and then the data, @see read_ready
+  m_read_ongoing = true;
+  m_read_len = 0;
+  m_data_len = 0;
+  update_events();
 }
 
 void ConnectionEpoll::write(const std::uint8_t* buffer, int len)
 {
-  LOG_ERROR("%s: not yet implemented", __func__);
-  (void)buffer;
-  (void)len;
+  if (m_write_ongoing)
+  {
+    fprintf(stderr, "%s: write procedure already ongoing!\n", __func__);
+    return;
+  }
+
+  if (len == 0 || m_closing)
+  {
+    return;
+  }
+
+  const auto total_len = 2 + len;
+  if (total_len > static_cast<int>(m_write_buffer.size()))
+  {
+    fprintf(stderr, "%s: trying to send too much data (%d)\n", __func__, len);
+    return;
+  }
+
+  // Write header to buffer
+  m_write_buffer[0] = len & 0xff;
+  m_write_buffer[1] = (len >> 8) & 0xff;
+
+  // Copy data to buffer
+  std::copy(buffer, buffer + len, m_write_buffer.data() + 2);
+
+  // Send buffer when the socket is writable, @see write_ready
+  m_write_ongoing = true;
+  m_write_len = total_len;
+  m_written = 0;
+  update_events();
 }
 
 void ConnectionEpoll::close()
 {
-  if (m_socket_fd >= 0)
+  if (!m_closing)
   {
+    m_closing = true;
+    const auto ongoing = m_read_ongoing || m_write_ongoing;
+    m_read_ongoing = false;
+    m_write_ongoing = false;
+    set_events(m_socket_fd, 0u, nullptr);
     ::close(m_socket_fd);
+    m_socket_fd = -1;
+
+    if (!ongoing)
+    {
+      m_on_disconnected();
+      // Warning: this instance can be deleted now
+      //          don't access any instance variables
+      return;
+    }
+
+    // Like with asio, the aborted procedures end later, in the context of run()
+    post([this]()
+    {
+      m_on_disconnected();
+    });
+  }
+}
+
+void ConnectionEpoll::update_events()
+{
+  const auto events = (m_read_ongoing ? static_cast<std::uint32_t>(EPOLLIN) : 0u) |
+                      (m_write_ongoing ? static_cast<std::uint32_t>(EPOLLOUT) : 0u);
+  set_events(m_socket_fd, events, [this](std::uint32_t events)
+  {
+    on_events(events);
+  });
+}
+
+void ConnectionEpoll::on_events(std::uint32_t events)
+{
+  // Only one procedure is continued, since its callback may delete this instance.
+  // The events are level-triggered, so the other one is continued the next time
+  if (m_write_ongoing && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+  {
+    write_ready();
+  }
+  else if (m_read_ongoing && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+  {
+    read_ready();
+  }
+}
+
+void ConnectionEpoll::read_ready()
+{
+  const auto len = m_data_len > 0 ? m_data_len : 2;
+  const auto ret = ::recv(m_socket_fd, m_read_buffer.data() + m_read_len, len - m_read_len, 0);
+  if (ret < 0)
+  {
+    const auto error = errno;
+    if (error == EAGAIN || error == EWOULDBLOCK || error == EINTR)
+    {
+      return;
+    }
+    m_read_ongoing = false;
+    update_events();
+    m_on_error(strerror(error));
+    return;
+  }
+
+  if (ret == 0)
+  {
+    // The remote side closed the connection
+    m_read_ongoing = false;
+    update_events();
+    closed();
+    return;
+  }
+
+  m_read_len += static_cast<int>(ret);
+  if (m_read_len < len)
+  {
+    return;
+  }
+
+  if (m_data_len == 0)
+  {
+    const auto data_len = (m_read_buffer[1] << 8) | m_read_buffer[0];
+    if (data_len == 0 || data_len > static_cast<int>(m_read_buffer.size()))
+    {
+      m_read_ongoing = false;
+      update_events();
+      m_on_error("data_len (" + std::to_string(data_len) + ") in header is invalid");
+      return;
+    }
+
+    // Continue with the data
+    m_data_len = data_len;
+    m_read_len = 0;
+    return;
+  }
+
+  m_read_ongoing = false;
+  update_events();
+
+  // Call callback with data and data length
+  m_on_read(m_read_buffer.data(), m_data_len);
+}
+
+void ConnectionEpoll::write_ready()
+{
+  const auto ret = ::send(m_socket_fd, m_write_buffer.data() + m_written, m_write_len - m_written, MSG_NOSIGNAL);
+  if (ret < 0)
+  {
+    const auto error = errno;
+    if (error == EAGAIN || error == EWOULDBLOCK || error == EINTR)
+    {
+      return;
+    }
+    m_write_ongoing = false;
+    update_events();
+    if (m_closing)
+    {
+      closed();
+      return;
+    }
+    m_on_error(strerror(error));
+    return;
+  }
+
+  m_written += static_cast<int>(ret);
+  if (m_written < m_write_len)
+  {
+    return;
+  }
+
+  m_write_ongoing = false;
+  update_events();
+  if (m_closing)
+  {
+    closed();
+    return;
+  }
+  m_on_write();
+}
+
+void ConnectionEpoll::closed()
+{
+  m_closing = true;
+
+  // Check if we are ready to call OnDisconnected
+  if (!m_read_ongoing && !m_write_ongoing)
+  {
+    m_on_disconnected();
+    // Warning: this instance can be deleted now
+    //          don't access any instance variables
   }
-  m_socket_fd = -1;
 }
 
 }
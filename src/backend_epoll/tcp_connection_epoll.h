@@ -3,6 +3,9 @@
 
 #include "tcp_backend.h"
 
+#include <cstdint>
+#include <array>
+
 namespace TcpBackend
 {
 
@@ -10,6 +13,7 @@ class ConnectionEpoll : public Connection
 {
  public:
   ConnectionEpoll(int socket_fd);
+  ~ConnectionEpoll() override;
 
   void set_callbacks(const OnDisconnected& on_disconnected,
                      const OnRead& on_read,
@@ -20,8 +24,29 @@ class ConnectionEpoll : public Connection
   void close() override;
 
  private:
+  void update_events();
+  void on_events(std::uint32_t events);
+  void read_ready();
+  void write_ready();
+  void closed();
+
   int m_socket_fd;
 
+  // A message consists of a header and data, @see ConnectionAsio
+  // The read buffer first reads the 2 byte header and then the
+  // message data while the write buffer contains the whole message.
+  std::array<std::uint8_t, (1 << 16) - 1>     m_read_buffer;
+  std::array<std::uint8_t, (1 << 16) - 1 + 2> m_write_buffer;
+
+  int m_read_len;   // Bytes read of the header, or of the data if m_data_len > 0
+  int m_data_len;   // Length of the data, 0 while the header is read
+  int m_write_len;  // Length of the message in m_write_buffer
+  int m_written;    // Bytes of it written so far
+
+  bool m_read_ongoing;
+  bool m_write_ongoing;
+  bool m_closing;
+
   OnDisconnected m_on_disconnected;
   OnRead         m_on_read;
   OnWrite        m_on_write;
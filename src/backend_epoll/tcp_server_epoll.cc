@@ -1,10 +1,14 @@
 #include "tcp_server_epoll.h"
 
+#include <cerrno>
 #include <cstdio>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <unistd.h>
 
+#include "tcp_backend_epoll.h"
 #include "tcp_connection_epoll.h"
 
 namespace TcpBackend
@@ -16,19 +20,32 @@ ServerEpoll::ServerEpoll(int socket_fd, const OnAccept& on_accept)
 {
 }
 
+ServerEpoll::~ServerEpoll()
+{
+  set_events(m_socket_fd, 0u, nullptr);
+  ::close(m_socket_fd);
+}
+
 void ServerEpoll::accept()
 {
-#if 0
-  // Ignore connection address
-  auto socket_fd = ::accept(m_socket_fd, nullptr, nullptr);
-  if (socket_fd < 0)
+  set_events(m_socket_fd, EPOLLIN, [this](std::uint32_t)
   {
-    perror("accept");
-    continue;
-  }
-
-  m_on_accept(std::make_unique<ConnectionEpoll>(socket_fd));
-#endif
+    // Ignore connection address
+    auto socket_fd = ::accept4(m_socket_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (socket_fd < 0)
+    {
+      // Keep waiting for the next connection, like with asio
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+        perror("accept4");
+      }
+      return;
+    }
+
+    // One connection per accept()
+    set_events(m_socket_fd, 0u, nullptr);
+    m_on_accept(std::make_unique<ConnectionEpoll>(socket_fd));
+  });
 }
 
 }
@@ -12,6 +12,7 @@ class ServerEpoll : public Server
 {
  public:
   ServerEpoll(int socket_fd, const OnAccept& on_accept);
+  ~ServerEpoll() override;
 
   void accept() override;
 
@@ -0,0 +1,447 @@
+#include "double_double.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PMP_X86
+#include <immintrin.h>
+#endif
+
+// @see mandelbrot_kernels.cc
+#if defined(__GNUC__)
+#define TARGET(isa) __attribute__((target(isa)))
+#else
+#define TARGET(isa)
+#endif
+
+namespace Mandelbrot
+{
+
+namespace DoubleDouble
+{
+
+// Note on exactness:
+// All kernels perform the same operations in the same order as the scalar
+// helpers below, so that they are bit-identical (the build uses
+// -ffp-contract=off). The escape test uses only the hi parts:
+// !(x2.hi + y2.hi < 4)
+// Interior points are detected as in the double precision kernels,
+// @see mandelbrot_kernels.cc
+
+namespace
+{
+  // Splits a into two 26-bit halves so that products of halves are exact
+  constexpr double SPLITTER = 134217729.0;  // 2^27 + 1
+
+  // a + b = result.hi + result.lo exactly
+  inline Value two_sum(double a, double b)
+  {
+    const auto s = a + b;
+    const auto bb = s - a;
+    return { s, (a - (s - bb)) + (b - bb) };
+  }
+
+  // Same as two_sum but requires |a| >= |b|
+  inline Value quick_two_sum(double a, double b)
+  {
+    const auto s = a + b;
+    return { s, b - (s - a) };
+  }
+
+  // a * b = result.hi + result.lo exactly
+  inline Value two_prod(double a, double b)
+  {
+    const auto p = a * b;
+    const auto ta = SPLITTER * a;
+    const auto a_hi = ta - (ta - a);
+    const auto a_lo = a - a_hi;
+    const auto tb = SPLITTER * b;
+    const auto b_hi = tb - (tb - b);
+    const auto b_lo = b - b_hi;
+    return { p, ((a_hi * b_hi - p) + a_hi * b_lo + a_lo * b_hi) + a_lo * b_lo };
+  }
+
+  inline Value add(const Value& a, const Value& b)
+  {
+    const auto s = two_sum(a.hi, b.hi);
+    return quick_two_sum(s.hi, s.lo + (a.lo + b.lo));
+  }
+
+  inline Value sub(const Value& a, const Value& b)
+  {
+    return add(a, { -b.hi, -b.lo });
+  }
+
+  inline Value mul(const Value& a, const Value& b)
+  {
+    const auto p = two_prod(a.hi, b.hi);
+    return quick_two_sum(p.hi, p.lo + (a.hi * b.lo + a.lo * b.hi));
+  }
+}
+
+Value from_expansion(const std::vector<double>& expansion)
+{
+  Value result = { 0.0, 0.0 };
+  for (const auto value : expansion)
+  {
+    result = add(result, value);
+  }
+  return result;
+}
+
+Value add(const Value& a, double b)
+{
+  const auto s = two_sum(a.hi, b);
+  return quick_two_sum(s.hi, s.lo + a.lo);
+}
+
+void row_scalar(const Value& center_re, const Value& center_im, const Kernels::Row& row,
+                std::uint8_t* pixels, Stats* stats)
+{
+  const auto max_iter = row.max_iter;
+  const auto c_im = add(center_im, row.c_im);
+  for (auto px = row.px_begin; px < row.px_end; px += row.px_step)
+  {
+    const auto c_re = add(center_re, row.min_re + px * row.dx);
+    if (Kernels::in_cardioid_or_bulb(c_re.hi, c_im.hi))
+    {
+      stats->iterations_skipped += max_iter;
+      *pixels++ = 0;
+      continue;
+    }
+
+    // Same as Kernels::row_scalar, including the cycle detection
+    Value x = { 0.0, 0.0 };
+    Value y = { 0.0, 0.0 };
+    auto n = 0;
+    auto x_saved = x;
+    auto y_saved = y;
+    auto next_save = 1ll;
+    auto periodic = false;
+    while (n < max_iter)
+    {
+      const auto x2 = mul(x, x);
+      const auto y2 = mul(y, y);
+      if (!(x2.hi + y2.hi < 4.0))
+      {
+        break;
+      }
+      y = add(mul({ x.hi + x.hi, x.lo + x.lo }, y), c_im);
+      x = add(sub(x2, y2), c_re);
+      n += 1;
+
+      if (x.hi == x_saved.hi && x.lo == x_saved.lo && y.hi == y_saved.hi && y.lo == y_saved.lo)
+      {
+        periodic = true;
+        break;
+      }
+      if (n == next_save)
+      {
+        x_saved = x;
+        y_saved = y;
+        next_save *= 2;
+      }
+    }
+
+    stats->iterations += n;
+    if (periodic)
+    {
+      stats->iterations_skipped += max_iter - n;
+      *pixels++ = 0;
+    }
+    else
+    {
+      *pixels++ = Kernels::to_pixel(n, max_iter);
+    }
+  }
+}
+
+#if defined(PMP_X86)
+
+// The SIMD kernels compute the error of a product with FMA instead of Dekker's
+// algorithm. Both compute the exact error, so the result is the same.
+
+namespace
+{
+  // Four double-doubles, and the helpers above for them
+  struct Value4
+  {
+    __m256d hi;
+    __m256d lo;
+  };
+
+  TARGET("avx2,fma")
+  inline Value4 two_sum(__m256d a, __m256d b)
+  {
+    const auto s = _mm256_add_pd(a, b);
+    const auto bb = _mm256_sub_pd(s, a);
+    return { s, _mm256_add_pd(_mm256_sub_pd(a, _mm256_sub_pd(s, bb)), _mm256_sub_pd(b, bb)) };
+  }
+
+  TARGET("avx2,fma")
+  inline Value4 quick_two_sum(__m256d a, __m256d b)
+  {
+    const auto s = _mm256_add_pd(a, b);
+    return { s, _mm256_sub_pd(b, _mm256_sub_pd(s, a)) };
+  }
+
+  TARGET("avx2,fma")
+  inline Value4 two_prod(__m256d a, __m256d b)
+  {
+    const auto p = _mm256_mul_pd(a, b);
+    return { p, _mm256_fmsub_pd(a, b, p) };
+  }
+
+  TARGET("avx2,fma")
+  inline Value4 add(const Value4& a, const Value4& b)
+  {
+    const auto s = two_sum(a.hi, b.hi);
+    return quick_two_sum(s.hi, _mm256_add_pd(s.lo, _mm256_add_pd(a.lo, b.lo)));
+  }
+
+  TARGET("avx2,fma")
+  inline Value4 sub(const Value4& a, const Value4& b)
+  {
+    const auto v_sign = _mm256_set1_pd(-0.0);
+    return add(a, { _mm256_xor_pd(b.hi, v_sign), _mm256_xor_pd(b.lo, v_sign) });
+  }
+
+  TARGET("avx2,fma")
+  inline Value4 mul(const Value4& a, const Value4& b)
+  {
+    const auto p = two_prod(a.hi, b.hi);
+    const auto cross = _mm256_add_pd(_mm256_mul_pd(a.hi, b.lo), _mm256_mul_pd(a.lo, b.hi));
+    return quick_two_sum(p.hi, _mm256_add_pd(p.lo, cross));
+  }
+
+  // Eight double-doubles, and the helpers above for them
+  struct Value8
+  {
+    __m512d hi;
+    __m512d lo;
+  };
+
+  TARGET("avx512f")
+  inline Value8 two_sum(__m512d a, __m512d b)
+  {
+    const auto s = _mm512_add_pd(a, b);
+    const auto bb = _mm512_sub_pd(s, a);
+    return { s, _mm512_add_pd(_mm512_sub_pd(a, _mm512_sub_pd(s, bb)), _mm512_sub_pd(b, bb)) };
+  }
+
+  TARGET("avx512f")
+  inline Value8 quick_two_sum(__m512d a, __m512d b)
+  {
+    const auto s = _mm512_add_pd(a, b);
+    return { s, _mm512_sub_pd(b, _mm512_sub_pd(s, a)) };
+  }
+
+  TARGET("avx512f")
+  inline Value8 two_prod(__m512d a, __m512d b)
+  {
+    const auto p = _mm512_mul_pd(a, b);
+    return { p, _mm512_fmsub_pd(a, b, p) };
+  }
+
+  TARGET("avx512f")
+  inline Value8 add(const Value8& a, const Value8& b)
+  {
+    const auto s = two_sum(a.hi, b.hi);
+    return quick_two_sum(s.hi, _mm512_add_pd(s.lo, _mm512_add_pd(a.lo, b.lo)));
+  }
+
+  TARGET("avx512f")
+  inline Value8 sub(const Value8& a, const Value8& b)
+  {
+    // _mm512_xor_pd requires AVX512DQ, so flip the sign bits as integers
+    const auto v_sign = _mm512_set1_epi64(static_cast<long long>(1ull << 63));
+    return add(a, { _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(b.hi), v_sign)),
+                    _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(b.lo), v_sign)) });
+  }
+
+  TARGET("avx512f")
+  inline Value8 mul(const Value8& a, const Value8& b)
+  {
+    const auto p = two_prod(a.hi, b.hi);
+    const auto cross = _mm512_add_pd(_mm512_mul_pd(a.hi, b.lo), _mm512_mul_pd(a.lo, b.hi));
+    return quick_two_sum(p.hi, _mm512_add_pd(p.lo, cross));
+  }
+
+  // Main cardioid and period-2 bulb, checked per lane as in row_scalar
+  // Returns a bitmask of the lanes that are inside
+  int interior_lanes(const double* c_re_hi, int num_lanes, double c_im_hi)
+  {
+    auto interior = 0;
+    for (auto lane = 0; lane < num_lanes; lane++)
+    {
+      if (Kernels::in_cardioid_or_bulb(c_re_hi[lane], c_im_hi))
+      {
+        interior |= 1 << lane;
+      }
+    }
+    return interior;
+  }
+}
+
+TARGET("avx2,fma")
+void row_avx2(const Value& center_re, const Value& center_im, const Kernels::Row& row,
+              std::uint8_t* pixels, Stats* stats)
+{
+  const auto v_four      = _mm256_set1_pd(4.0);
+  const auto v_one       = _mm256_set1_pd(1.0);
+  const auto v_all       = _mm256_cmp_pd(v_one, v_one, _CMP_EQ_OQ);
+  const auto v_lane      = _mm256_mul_pd(_mm256_set_pd(3.0, 2.0, 1.0, 0.0), _mm256_set1_pd(row.px_step));
+  const auto v_lane_bit  = _mm256_set_epi64x(8, 4, 2, 1);
+  const auto v_min_re    = _mm256_set1_pd(row.min_re);
+  const auto v_dx        = _mm256_set1_pd(row.dx);
+  const auto v_center_hi = _mm256_set1_pd(center_re.hi);
+  const auto v_center_lo = _mm256_set1_pd(center_re.lo);
+  const auto c_im_scalar = add(center_im, row.c_im);
+  const Value4 c_im      = { _mm256_set1_pd(c_im_scalar.hi), _mm256_set1_pd(c_im_scalar.lo) };
+
+  for (auto px = row.px_begin; px < row.px_end; px += 4 * row.px_step)
+  {
+    // c_re = add(center_re, min_re + px * dx), @see add(const Value&, double)
+    const auto offset = _mm256_add_pd(v_min_re, _mm256_mul_pd(_mm256_add_pd(_mm256_set1_pd(px), v_lane), v_dx));
+    const auto s = two_sum(v_center_hi, offset);
+    const auto c_re = quick_two_sum(s.hi, _mm256_add_pd(s.lo, v_center_lo));
+
+    alignas(32) double c_re_hi[4];
+    _mm256_store_pd(c_re_hi, c_re.hi);
+    const auto v_interior_bits = _mm256_set1_epi64x(interior_lanes(c_re_hi, 4, c_im_scalar.hi));
+    auto interior = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(v_interior_bits, v_lane_bit),
+                                                           v_lane_bit));
+    auto active = _mm256_andnot_pd(interior, v_all);
+
+    Value4 x = { _mm256_setzero_pd(), _mm256_setzero_pd() };
+    Value4 y = { _mm256_setzero_pd(), _mm256_setzero_pd() };
+    auto n = _mm256_setzero_pd();
+    auto x_saved = x;
+    auto y_saved = y;
+    auto next_save = 1ll;
+    for (auto i = 0; i < row.max_iter; i++)
+    {
+      const auto x2 = mul(x, x);
+      const auto y2 = mul(y, y);
+      active = _mm256_and_pd(active, _mm256_cmp_pd(_mm256_add_pd(x2.hi, y2.hi), v_four, _CMP_LT_OQ));
+      if (_mm256_movemask_pd(active) == 0)
+      {
+        break;
+      }
+      n = _mm256_add_pd(n, _mm256_and_pd(active, v_one));
+      y = add(mul({ _mm256_add_pd(x.hi, x.hi), _mm256_add_pd(x.lo, x.lo) }, y), c_im);
+      x = add(sub(x2, y2), c_re);
+
+      const auto same = _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(x.hi, x_saved.hi, _CMP_EQ_OQ),
+                                                    _mm256_cmp_pd(x.lo, x_saved.lo, _CMP_EQ_OQ)),
+                                      _mm256_and_pd(_mm256_cmp_pd(y.hi, y_saved.hi, _CMP_EQ_OQ),
+                                                    _mm256_cmp_pd(y.lo, y_saved.lo, _CMP_EQ_OQ)));
+      const auto periodic = _mm256_and_pd(active, same);
+      interior = _mm256_or_pd(interior, periodic);
+      active = _mm256_andnot_pd(periodic, active);
+      if (i + 1 == next_save)
+      {
+        x_saved = x;
+        y_saved = y;
+        next_save *= 2;
+      }
+    }
+
+    alignas(32) double lanes[4];
+    _mm256_store_pd(lanes, n);
+    Kernels::store_lanes(lanes,
+                         _mm256_movemask_pd(interior),
+                         Kernels::pixels_left(row, px, 4),
+                         row.max_iter,
+                         &pixels,
+                         stats);
+  }
+}
+
+TARGET("avx512f")
+void row_avx512(const Value& center_re, const Value& center_im, const Kernels::Row& row,
+                std::uint8_t* pixels, Stats* stats)
+{
+  const auto v_four      = _mm512_set1_pd(4.0);
+  const auto v_one       = _mm512_set1_pd(1.0);
+  const auto v_lane      = _mm512_mul_pd(_mm512_set_pd(7.0, 6.0, 5.0, 4.0, 3.0, 2.0, 1.0, 0.0),
+                                         _mm512_set1_pd(row.px_step));
+  const auto v_min_re    = _mm512_set1_pd(row.min_re);
+  const auto v_dx        = _mm512_set1_pd(row.dx);
+  const auto v_center_hi = _mm512_set1_pd(center_re.hi);
+  const auto v_center_lo = _mm512_set1_pd(center_re.lo);
+  const auto c_im_scalar = add(center_im, row.c_im);
+  const Value8 c_im      = { _mm512_set1_pd(c_im_scalar.hi), _mm512_set1_pd(c_im_scalar.lo) };
+
+  for (auto px = row.px_begin; px < row.px_end; px += 8 * row.px_step)
+  {
+    // c_re = add(center_re, min_re + px * dx), @see add(const Value&, double)
+    const auto offset = _mm512_add_pd(v_min_re, _mm512_mul_pd(_mm512_add_pd(_mm512_set1_pd(px), v_lane), v_dx));
+    const auto s = two_sum(v_center_hi, offset);
+    const auto c_re = quick_two_sum(s.hi, _mm512_add_pd(s.lo, v_center_lo));
+
+    alignas(64) double c_re_hi[8];
+    _mm512_store_pd(c_re_hi, c_re.hi);
+    __mmask8 interior = interior_lanes(c_re_hi, 8, c_im_scalar.hi);
+    __mmask8 active = ~interior;
+
+    Value8 x = { _mm512_setzero_pd(), _mm512_setzero_pd() };
+    Value8 y = { _mm512_setzero_pd(), _mm512_setzero_pd() };
+    auto n = _mm512_setzero_pd();
+    auto x_saved = x;
+    auto y_saved = y;
+    auto next_save = 1ll;
+    for (auto i = 0; i < row.max_iter; i++)
+    {
+      const auto x2 = mul(x, x);
+      const auto y2 = mul(y, y);
+      active = _mm512_mask_cmp_pd_mask(active, _mm512_add_pd(x2.hi, y2.hi), v_four, _CMP_LT_OQ);
+      if (active == 0)
+      {
+        break;
+      }
+      n = _mm512_mask_add_pd(n, active, n, v_one);
+      y = add(mul({ _mm512_add_pd(x.hi, x.hi), _mm512_add_pd(x.lo, x.lo) }, y), c_im);
+      x = add(sub(x2, y2), c_re);
+
+      auto periodic = _mm512_mask_cmp_pd_mask(active, x.hi, x_saved.hi, _CMP_EQ_OQ);
+      periodic = _mm512_mask_cmp_pd_mask(periodic, x.lo, x_saved.lo, _CMP_EQ_OQ);
+      periodic = _mm512_mask_cmp_pd_mask(periodic, y.hi, y_saved.hi, _CMP_EQ_OQ);
+      periodic = _mm512_mask_cmp_pd_mask(periodic, y.lo, y_saved.lo, _CMP_EQ_OQ);
+      interior |= periodic;
+      active &= ~periodic;
+      if (i + 1 == next_save)
+      {
+        x_saved = x;
+        y_saved = y;
+        next_save *= 2;
+      }
+    }
+
+    alignas(64) double lanes[8];
+    _mm512_store_pd(lanes, n);
+    Kernels::store_lanes(lanes, interior, Kernels::pixels_left(row, px, 8), row.max_iter, &pixels, stats);
+  }
+}
+
+#else  // PMP_X86
+
+// Non-x86 hosts: the SIMD kernels are never selected, @see mandelbrot_kernels.cc
+
+void row_avx2(const Value& center_re, const Value& center_im, const Kernels::Row& row,
+              std::uint8_t* pixels, Stats* stats)
+{
+  row_scalar(center_re, center_im, row, pixels, stats);
+}
+
+void row_avx512(const Value& center_re, const Value& center_im, const Kernels::Row& row,
+                std::uint8_t* pixels, Stats* stats)
+{
+  row_scalar(center_re, center_im, row, pixels, stats);
+}
+
+#endif  // PMP_X86
+
+}
+
+}
@@ -0,0 +1,79 @@
+#ifndef DOUBLE_DOUBLE_H_
+#define DOUBLE_DOUBLE_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "mandelbrot.h"
+#include "mandelbrot_kernels.h"
+
+namespace Mandelbrot
+{
+
+/**
+ * @brief Double-double engine for moderately deep zooms
+ *
+ * A double-double is an unevaluated sum hi + lo of two doubles with
+ * |lo| <= ulp(hi) / 2, which gives about 106 bits of precision using only
+ * double precision hardware operations. The error free transformations
+ * (two_sum, two_prod) are exact, so every kernel produces exactly the same
+ * pixels, like the double precision kernels. The scalar kernel uses Dekker's
+ * algorithm for two_prod and the SIMD kernels use FMA.
+ *
+ * The pixels are computed as c = center + (min_re + px * dx, c_im), where
+ * the center is a double-double and the rest of the row is relative to it.
+ */
+namespace DoubleDouble
+{
+
+/**
+ * @brief A double-double value hi + lo
+ */
+struct Value
+{
+  double hi;
+  double lo;
+};
+
+/**
+ * @brief Rounds a floating point expansion to a double-double
+ *
+ * @param[in]  expansion  Doubles whose exact sum is the value
+ */
+Value from_expansion(const std::vector<double>& expansion);
+
+/**
+ * @brief Adds a double to a double-double
+ */
+Value add(const Value& a, double b);
+
+/**
+ * @brief Computes a range of pixels in one image row
+ *
+ * Same as Kernels::RowKernel except that row.min_re and row.c_im are
+ * relative to the center.
+ *
+ * @param[in]   center_re  Real value of the center
+ * @param[in]   center_im  Imaginary value of the center
+ * @param[in]   row        The pixels to compute
+ * @param[out]  pixels     Pointer to where to write the pixels (8bpp)
+ * @param[out]  stats      Statistics are added to this object
+ */
+using RowKernel = void (*)(const Value& center_re,
+                           const Value& center_im,
+                           const Kernels::Row& row,
+                           std::uint8_t* pixels,
+                           Stats* stats);
+
+void row_scalar(const Value& center_re, const Value& center_im, const Kernels::Row& row,
+                std::uint8_t* pixels, Stats* stats);
+void row_avx2(const Value& center_re, const Value& center_im, const Kernels::Row& row,
+              std::uint8_t* pixels, Stats* stats);  // Requires AVX2 and FMA
+void row_avx512(const Value& center_re, const Value& center_im, const Kernels::Row& row,
+                std::uint8_t* pixels, Stats* stats);
+
+}
+
+}
+
+#endif  // DOUBLE_DOUBLE_H_
@@ -0,0 +1,317 @@
+#include "fixed_point.h"
+
+#include <algorithm>
+#include <cmath>
+
+FixedPoint::FixedPoint(int frac_limbs)
+    : m_negative(false),
+      m_limbs(std::max(0, frac_limbs) + 1, 0u)
+{
+}
+
+FixedPoint FixedPoint::from_double(double value, int frac_limbs)
+{
+  FixedPoint result(frac_limbs);
+  if (value == 0.0 || !std::isfinite(value))
+  {
+    return result;
+  }
+
+  // |value| = mantissa * 2^(exp - 53) where mantissa is a 53-bit integer
+  // The magnitude (as an integer) is |value| * 2^(32 * frac_limbs)
+  int exp = 0;
+  const auto fraction = std::frexp(std::fabs(value), &exp);
+  auto mantissa = static_cast<std::uint64_t>(std::ldexp(fraction, 53));
+  auto shift = exp - 53 + 32 * (static_cast<int>(result.m_limbs.size()) - 1);
+  if (shift < 0)
+  {
+    if (shift <= -64)
+    {
+      return result;
+    }
+    mantissa >>= -shift;
+    shift = 0;
+  }
+
+  // Place mantissa << shift into the limbs, 53 + 31 bits fit in three limbs
+  const auto limb = shift / 32;
+  const auto bit = shift % 32;
+  const auto low = mantissa << bit;
+  const auto high = bit == 0 ? 0u : mantissa >> (64 - bit);
+  const std::uint32_t parts[] = { static_cast<std::uint32_t>(low),
+                                  static_cast<std::uint32_t>(low >> 32),
+                                  static_cast<std::uint32_t>(high) };
+  for (auto i = 0; i < 3; i++)
+  {
+    if (limb + i < static_cast<int>(result.m_limbs.size()))
+    {
+      result.m_limbs[limb + i] = parts[i];
+    }
+  }
+
+  result.m_negative = value < 0.0 && !result.is_zero();
+  return result;
+}
+
+FixedPoint FixedPoint::from_expansion(const std::vector<double>& expansion, int frac_limbs)
+{
+  FixedPoint result(frac_limbs);
+  for (const auto value : expansion)
+  {
+    result = result + from_double(value, frac_limbs);
+  }
+  return result;
+}
+
+bool FixedPoint::from_string(const std::string& str, int frac_limbs, FixedPoint* value)
+{
+  auto pos = 0u;
+  auto negative = false;
+  if (pos < str.size() && (str[pos] == '-' || str[pos] == '+'))
+  {
+    negative = str[pos] == '-';
+    pos += 1;
+  }
+
+  // Integer part
+  std::uint64_t integer = 0;
+  auto num_digits = 0;
+  while (pos < str.size() && str[pos] >= '0' && str[pos] <= '9')
+  {
+    integer = integer * 10 + (str[pos] - '0');
+    if (integer > 0xffffffffu)
+    {
+      return false;
+    }
+    pos += 1;
+    num_digits += 1;
+  }
+
+  // Fractional part
+  std::string fraction;
+  if (pos < str.size() && str[pos] == '.')
+  {
+    pos += 1;
+    while (pos < str.size() && str[pos] >= '0' && str[pos] <= '9')
+    {
+      fraction.push_back(str[pos]);
+      pos += 1;
+      num_digits += 1;
+    }
+  }
+
+  if (pos != str.size() || num_digits == 0)
+  {
+    return false;
+  }
+
+  // Evaluate the fraction from the last digit: f = (d + f) / 10
+  FixedPoint result(frac_limbs);
+  for (auto it = fraction.rbegin(); it != fraction.rend(); ++it)
+  {
+    result.m_limbs.back() = *it - '0';
+    result.divide_magnitude(10);
+  }
+  result.m_limbs.back() = static_cast<std::uint32_t>(integer);
+  result.m_negative = negative && !result.is_zero();
+
+  *value = result;
+  return true;
+}
+
+int FixedPoint::frac_limbs_for(double resolution)
+{
+  // 64 bits of margin, and cap the precision at 2048 bits
+  static const auto max_limbs = 64;
+  if (!(resolution > 0.0))
+  {
+    return max_limbs;
+  }
+  const auto bits = static_cast<int>(std::ceil(-std::log2(resolution))) + 64;
+  return std::min(max_limbs, std::max(2, (bits + 31) / 32));
+}
+
+double FixedPoint::to_double() const
+{
+  // Sum the three most significant non-zero limbs, least significant first
+  const auto frac_limbs = static_cast<int>(m_limbs.size()) - 1;
+  auto top = frac_limbs;
+  while (top > 0 && m_limbs[top] == 0)
+  {
+    top -= 1;
+  }
+
+  auto result = 0.0;
+  for (auto i = std::max(0, top - 2); i <= top; i++)
+  {
+    result += std::ldexp(static_cast<double>(m_limbs[i]), 32 * (i - frac_limbs));
+  }
+  return m_negative ? -result : result;
+}
+
+std::vector<double> FixedPoint::to_expansion() const
+{
+  // Repeatedly take the nearest double and continue with the remainder
+  const auto frac_limbs = static_cast<int>(m_limbs.size()) - 1;
+  const auto max_terms = (32 * (frac_limbs + 1)) / 52 + 2;
+  std::vector<double> result;
+  auto rest = *this;
+  while (!rest.is_zero() && static_cast<int>(result.size()) < max_terms)
+  {
+    const auto value = rest.to_double();
+    if (value == 0.0)
+    {
+      break;
+    }
+    result.push_back(value);
+    rest = rest - from_double(value, frac_limbs);
+  }
+  return result;
+}
+
+bool FixedPoint::is_zero() const
+{
+  return std::all_of(m_limbs.begin(), m_limbs.end(), [](std::uint32_t limb) { return limb == 0u; });
+}
+
+FixedPoint FixedPoint::operator-() const
+{
+  auto result = *this;
+  result.m_negative = !m_negative && !is_zero();
+  return result;
+}
+
+FixedPoint FixedPoint::operator+(const FixedPoint& other) const
+{
+  const auto frac_limbs = static_cast<int>(std::max(m_limbs.size(), other.m_limbs.size())) - 1;
+  const auto a = with_frac_limbs(frac_limbs);
+  const auto b = other.with_frac_limbs(frac_limbs);
+
+  if (a.m_negative == b.m_negative)
+  {
+    return add_magnitude(a, b, a.m_negative);
+  }
+  if (compare_magnitude(a, b) >= 0)
+  {
+    return sub_magnitude(a, b, a.m_negative);
+  }
+  return sub_magnitude(b, a, b.m_negative);
+}
+
+FixedPoint FixedPoint::operator-(const FixedPoint& other) const
+{
+  return *this + (-other);
+}
+
+FixedPoint FixedPoint::operator*(const FixedPoint& other) const
+{
+  const auto frac_limbs = static_cast<int>(std::max(m_limbs.size(), other.m_limbs.size())) - 1;
+  const auto a = with_frac_limbs(frac_limbs);
+  const auto b = other.with_frac_limbs(frac_limbs);
+  const auto size = a.m_limbs.size();
+
+  // Schoolbook multiplication of the magnitudes as integers
+  std::vector<std::uint32_t> product(2 * size, 0u);
+  for (auto i = 0u; i < size; i++)
+  {
+    std::uint64_t carry = 0;
+    for (auto j = 0u; j < size; j++)
+    {
+      const auto t = static_cast<std::uint64_t>(a.m_limbs[i]) * b.m_limbs[j] + product[i + j] + carry;
+      product[i + j] = static_cast<std::uint32_t>(t);
+      carry = t >> 32;
+    }
+    product[i + size] = static_cast<std::uint32_t>(carry);
+  }
+
+  // The product has 2 * frac_limbs fractional limbs, keep the top frac_limbs of them
+  // (anything above the integer limb would be an overflow and is dropped)
+  FixedPoint result(frac_limbs);
+  std::copy(product.begin() + frac_limbs, product.begin() + frac_limbs + size, result.m_limbs.begin());
+  result.m_negative = (a.m_negative != b.m_negative) && !result.is_zero();
+  return result;
+}
+
+bool FixedPoint::operator==(const FixedPoint& other) const
+{
+  // Zero is never negative, so equal values have equal representations
+  // when they have the same number of limbs
+  return m_negative == other.m_negative && m_limbs == other.m_limbs;
+}
+
+int FixedPoint::compare_magnitude(const FixedPoint& a, const FixedPoint& b)
+{
+  for (auto i = a.m_limbs.size(); i-- > 0;)
+  {
+    if (a.m_limbs[i] != b.m_limbs[i])
+    {
+      return a.m_limbs[i] < b.m_limbs[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+FixedPoint FixedPoint::add_magnitude(const FixedPoint& a, const FixedPoint& b, bool negative)
+{
+  FixedPoint result(static_cast<int>(a.m_limbs.size()) - 1);
+  std::uint64_t carry = 0;
+  for (auto i = 0u; i < a.m_limbs.size(); i++)
+  {
+    const auto t = static_cast<std::uint64_t>(a.m_limbs[i]) + b.m_limbs[i] + carry;
+    result.m_limbs[i] = static_cast<std::uint32_t>(t);
+    carry = t >> 32;
+  }
+  result.m_negative = negative && !result.is_zero();
+  return result;
+}
+
+FixedPoint FixedPoint::sub_magnitude(const FixedPoint& a, const FixedPoint& b, bool negative)
+{
+  FixedPoint result(static_cast<int>(a.m_limbs.size()) - 1);
+  std::int64_t borrow = 0;
+  for (auto i = 0u; i < a.m_limbs.size(); i++)
+  {
+    auto t = static_cast<std::int64_t>(a.m_limbs[i]) - b.m_limbs[i] - borrow;
+    borrow = t < 0 ? 1 : 0;
+    if (t < 0)
+    {
+      t += static_cast<std::int64_t>(1) << 32;
+    }
+    result.m_limbs[i] = static_cast<std::uint32_t>(t);
+  }
+  result.m_negative = negative && !result.is_zero();
+  return result;
+}
+
+FixedPoint FixedPoint::with_frac_limbs(int frac_limbs) const
+{
+  const auto old_frac_limbs = static_cast<int>(m_limbs.size()) - 1;
+  if (frac_limbs == old_frac_limbs)
+  {
+    return *this;
+  }
+
+  // Align the integer limbs, dropping or adding least significant limbs
+  FixedPoint result(frac_limbs);
+  for (auto i = 0; i <= frac_limbs; i++)
+  {
+    const auto old_i = i - frac_limbs + old_frac_limbs;
+    if (old_i >= 0)
+    {
+      result.m_limbs[i] = m_limbs[old_i];
+    }
+  }
+  result.m_negative = m_negative && !result.is_zero();
+  return result;
+}
+
+void FixedPoint::divide_magnitude(std::uint32_t divisor)
+{
+  std::uint64_t remainder = 0;
+  for (auto i = m_limbs.size(); i-- > 0;)
+  {
+    const auto t = (remainder << 32) | m_limbs[i];
+    m_limbs[i] = static_cast<std::uint32_t>(t / divisor);
+    remainder = t % divisor;
+  }
+}
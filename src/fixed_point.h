@@ -0,0 +1,109 @@
+#ifndef FIXED_POINT_H_
+#define FIXED_POINT_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Arbitrary precision signed fixed-point number
+ *
+ * The value is stored as a sign and a magnitude of 32-bit limbs: one limb for
+ * the integer part and a configurable number of limbs for the fractional part.
+ * Used for the few computations that need more than double precision, e.g. the
+ * reference orbit for deep zooms, so it is simple rather than fast.
+ *
+ * Values can also be converted to and from floating point expansions: a list of
+ * doubles whose exact sum is the value. Expansions are used to send
+ * high-precision values in the network protocol.
+ */
+class FixedPoint
+{
+ public:
+  /**
+   * @brief Creates a zero with the given precision
+   *
+   * @param[in]  frac_limbs  Number of 32-bit limbs in the fractional part
+   */
+  explicit FixedPoint(int frac_limbs = 0);
+
+  /**
+   * @brief Creates a number from a double
+   *
+   * The conversion is exact if the double has no bits below the precision.
+   * The integer part of the value must be less than 2^32.
+   *
+   * @param[in]  value       The value
+   * @param[in]  frac_limbs  Number of 32-bit limbs in the fractional part
+   */
+  static FixedPoint from_double(double value, int frac_limbs);
+
+  /**
+   * @brief Creates a number from a floating point expansion
+   *
+   * @param[in]  expansion   Doubles whose exact sum is the value
+   * @param[in]  frac_limbs  Number of 32-bit limbs in the fractional part
+   */
+  static FixedPoint from_expansion(const std::vector<double>& expansion, int frac_limbs);
+
+  /**
+   * @brief Parses a decimal number, e.g. "-0.7436438870371587047521915061"
+   *
+   * @param[in]   str         The string to parse
+   * @param[in]   frac_limbs  Number of 32-bit limbs in the fractional part
+   * @param[out]  value       Pointer to where to store the number
+   *
+   * @return true if the string is a valid decimal number, otherwise false
+   */
+  static bool from_string(const std::string& str, int frac_limbs, FixedPoint* value);
+
+  /**
+   * @brief Gets the number of fractional limbs needed for a given resolution
+   *
+   * @param[in]  resolution  Smallest difference that must be representable,
+   *                         with some bits of margin
+   */
+  static int frac_limbs_for(double resolution);
+
+  /**
+   * @brief Gets the value rounded to double precision
+   */
+  double to_double() const;
+
+  /**
+   * @brief Gets the value as a floating point expansion
+   *
+   * @return Doubles, largest magnitude first, whose exact sum is the value
+   */
+  std::vector<double> to_expansion() const;
+
+  bool is_zero() const;
+
+  FixedPoint operator-() const;
+  FixedPoint operator+(const FixedPoint& other) const;
+  FixedPoint operator-(const FixedPoint& other) const;
+  FixedPoint operator*(const FixedPoint& other) const;
+
+  bool operator==(const FixedPoint& other) const;
+
+ private:
+  // Compares magnitudes, returns -1, 0 or 1
+  static int compare_magnitude(const FixedPoint& a, const FixedPoint& b);
+
+  // Adds or subtracts magnitudes, for subtraction |a| must be >= |b|
+  static FixedPoint add_magnitude(const FixedPoint& a, const FixedPoint& b, bool negative);
+  static FixedPoint sub_magnitude(const FixedPoint& a, const FixedPoint& b, bool negative);
+
+  // Changes the number of fractional limbs, truncating if fewer
+  FixedPoint with_frac_limbs(int frac_limbs) const;
+
+  // Divides the magnitude by a small integer, truncating
+  void divide_magnitude(std::uint32_t divisor);
+
+  // Limbs in little-endian order: m_limbs[0] is the least significant fractional
+  // limb and m_limbs.back() is the integer part
+  bool m_negative;
+  std::vector<std::uint32_t> m_limbs;
+};
+
+#endif  // FIXED_POINT_H_
@@ -1,15 +1,741 @@
 #include "mandelbrot.h"
 
+#include <algorithm>
 #include <cmath>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "double_double.h"
+#include "fixed_point.h"
+#include "mandelbrot_kernels.h"
+#include "perturbation.h"
+#include "thread_pool.h"
+
+namespace
+{
+  using Mandelbrot::Kernel;
+
+  Kernel best_kernel()
+  {
+    if (Mandelbrot::Kernels::cpu_has_avx512()) return Kernel::AVX512;
+    if (Mandelbrot::Kernels::cpu_has_avx2())   return Kernel::AVX2;
+    if (Mandelbrot::Kernels::cpu_has_sse2())   return Kernel::SSE2;
+    return Kernel::SCALAR;
+  }
+
+  // The double precision row kernels, indexed by
+  // [kernel - Kernel::SCALAR][refill][cycles], @see Kernels::row_scalar
+  const Mandelbrot::Kernels::RowKernel row_kernels[4][2][2] =
+  {
+    {
+      { &Mandelbrot::Kernels::row_scalar<false, false>, &Mandelbrot::Kernels::row_scalar<false, true> },
+      { &Mandelbrot::Kernels::row_scalar<true, false>,  &Mandelbrot::Kernels::row_scalar<true, true> },
+    },
+    {
+      { &Mandelbrot::Kernels::row_sse2<false, false>, &Mandelbrot::Kernels::row_sse2<false, true> },
+      { &Mandelbrot::Kernels::row_sse2<true, false>,  &Mandelbrot::Kernels::row_sse2<true, true> },
+    },
+    {
+      { &Mandelbrot::Kernels::row_avx2<false, false>, &Mandelbrot::Kernels::row_avx2<false, true> },
+      { &Mandelbrot::Kernels::row_avx2<true, false>,  &Mandelbrot::Kernels::row_avx2<true, true> },
+    },
+    {
+      { &Mandelbrot::Kernels::row_avx512<false, false>, &Mandelbrot::Kernels::row_avx512<false, true> },
+      { &Mandelbrot::Kernels::row_avx512<true, false>,  &Mandelbrot::Kernels::row_avx512<true, true> },
+    },
+  };
+
+  // Whether get_row_kernel selects a variant for each image,
+  // @see Mandelbrot::set_specialized_kernels
+  bool specialized_kernels = true;
+
+  // Refilling lanes only pays off when the lanes can wait long for the
+  // slowest pixel of a vector
+  constexpr int REFILL_MIN_ITER = 256;
+
+  // With a low max_iter the cycle detection costs more than it saves
+  constexpr int CYCLES_MIN_ITER = 256;
+
+  // Gets the double precision row kernel for an image with the given corners
+  Mandelbrot::Kernels::RowKernel get_row_kernel(Kernel kernel,
+                                                std::complex<double> corner_a,
+                                                std::complex<double> corner_b,
+                                                int max_iter)
+  {
+    auto refill = true;
+    auto cycles = true;
+    if (specialized_kernels)
+    {
+      // Only points in the set can be periodic, and the set is inside
+      // [-2, 0.5] x [-1.2, 1.2]
+      const auto outside_set = std::max(corner_a.real(), corner_b.real()) < -2.0 ||
+                               std::min(corner_a.real(), corner_b.real()) > 0.5 ||
+                               std::max(corner_a.imag(), corner_b.imag()) < -1.2 ||
+                               std::min(corner_a.imag(), corner_b.imag()) > 1.2;
+      refill = max_iter > REFILL_MIN_ITER;
+      cycles = max_iter > CYCLES_MIN_ITER && !outside_set;
+    }
+    return row_kernels[static_cast<int>(kernel) - static_cast<int>(Kernel::SCALAR)][refill][cycles];
+  }
+
+  Mandelbrot::Kernels::RowKernel get_float_row_kernel(Kernel kernel)
+  {
+    switch (kernel)
+    {
+      case Kernel::SSE2:   return &Mandelbrot::Kernels::row_sse2_f32;
+      case Kernel::AVX2:   return &Mandelbrot::Kernels::row_avx2_f32;
+      case Kernel::AVX512: return &Mandelbrot::Kernels::row_avx512_f32;
+      case Kernel::SCALAR:
+      default:             return &Mandelbrot::Kernels::row_scalar_f32;
+    }
+  }
+
+  // The kernel used by compute(), selected once at startup
+  // and possibly overridden with set_kernel()
+  Kernel current_kernel = best_kernel();
+
+  // Parallel compute settings and the thread pool, which is
+  // created when first needed
+  int num_threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+  int band_height = 4;
+  std::unique_ptr<ThreadPool> thread_pool;
+  std::mutex thread_pool_mutex;
+
+  ThreadPool* get_thread_pool()
+  {
+    std::lock_guard<std::mutex> lock(thread_pool_mutex);
+    if (!thread_pool && num_threads > 1)
+    {
+      thread_pool = std::make_unique<ThreadPool>(num_threads);
+    }
+    return thread_pool.get();
+  }
+
+  // Checks an optional cancellation token, @see Mandelbrot::Options::cancel
+  bool is_cancelled(const std::atomic<bool>* cancel)
+  {
+    return cancel && cancel->load(std::memory_order_relaxed);
+  }
+
+  // Runs task(0), task(1), ..., task(num_tasks - 1) on the thread pool,
+  // or in this thread if the thread pool is disabled
+  void run_tasks(int num_tasks, const std::function<void(int)>& task)
+  {
+    auto* pool = get_thread_pool();
+    if (pool && num_tasks > 1)
+    {
+      pool->parallel_for(num_tasks, task);
+    }
+    else
+    {
+      for (auto i = 0; i < num_tasks; i++)
+      {
+        task(i);
+      }
+    }
+  }
+
+  // The double-double kernel to use with the given (double precision) kernel
+  Mandelbrot::DoubleDouble::RowKernel get_double_double_row_kernel(Kernel kernel)
+  {
+    if (kernel == Kernel::AVX512)
+    {
+      return &Mandelbrot::DoubleDouble::row_avx512;
+    }
+    if (kernel == Kernel::AVX2 && Mandelbrot::Kernels::cpu_has_fma())
+    {
+      return &Mandelbrot::DoubleDouble::row_avx2;
+    }
+    return &Mandelbrot::DoubleDouble::row_scalar;
+  }
+
+  // The points kernel to use with the given row kernel
+  Mandelbrot::Kernels::PointsKernel get_points_kernel(Kernel kernel)
+  {
+    switch (kernel)
+    {
+      case Kernel::AVX2:   return &Mandelbrot::Kernels::points_avx2;
+      case Kernel::AVX512: return &Mandelbrot::Kernels::points_avx512;
+      case Kernel::SCALAR:
+      case Kernel::SSE2:
+      default:             return &Mandelbrot::Kernels::points_scalar;
+    }
+  }
+
+  // Recently used reference orbits, most recently used first, so that
+  // rendering an image in several compute_into() calls (e.g. in bands)
+  // computes its reference orbit only once. The orbit is computed outside
+  // the cache lock, and concurrent users of the same entry wait for it.
+  struct CachedReference
+  {
+    FixedPoint c_re;
+    FixedPoint c_im;
+    int max_iter;
+    std::once_flag computed;
+    std::unique_ptr<Mandelbrot::Perturbation::Reference> reference;
+  };
+  constexpr std::size_t reference_cache_size = 4;
+  std::vector<std::shared_ptr<CachedReference>> reference_cache;
+  std::mutex reference_cache_mutex;
+
+  std::shared_ptr<const CachedReference> get_reference(const FixedPoint& c_re, const FixedPoint& c_im, int max_iter)
+  {
+    std::shared_ptr<CachedReference> entry;
+    {
+      std::lock_guard<std::mutex> lock(reference_cache_mutex);
+      auto it = std::find_if(reference_cache.begin(), reference_cache.end(), [&](const std::shared_ptr<CachedReference>& e)
+      {
+        return e->max_iter == max_iter && e->c_re == c_re && e->c_im == c_im;
+      });
+      if (it != reference_cache.end())
+      {
+        entry = *it;
+        reference_cache.erase(it);
+      }
+      else
+      {
+        entry = std::make_shared<CachedReference>();
+        entry->c_re     = c_re;
+        entry->c_im     = c_im;
+        entry->max_iter = max_iter;
+        if (reference_cache.size() == reference_cache_size)
+        {
+          reference_cache.pop_back();
+        }
+      }
+      reference_cache.insert(reference_cache.begin(), entry);
+    }
+
+    std::call_once(entry->computed, [&entry]()
+    {
+      entry->reference = std::make_unique<Mandelbrot::Perturbation::Reference>(entry->c_re, entry->c_im, entry->max_iter);
+    });
+    return entry;
+  }
+
+  // Everything needed to compute pixels of one image
+  // If reference is set the coordinates are relative to the reference point
+  // and the perturbation engine is used, otherwise if double_double_row_kernel
+  // is set the coordinates are relative to center_re/center_im and the
+  // double-double engine is used, otherwise row_kernel is used
+  struct Target
+  {
+    Mandelbrot::Kernels::RowKernel row_kernel;
+    Mandelbrot::DoubleDouble::RowKernel double_double_row_kernel;
+    Mandelbrot::DoubleDouble::Value center_re;
+    Mandelbrot::DoubleDouble::Value center_im;
+    const Mandelbrot::Perturbation::Reference* reference;
+    double min_re;
+    double min_im;
+    double dx;
+    double dy;
+    int max_iter;
+    std::uint8_t* pixels;   // Pixel (x0, y0)
+    std::ptrdiff_t stride;  // Distance in bytes between two rows
+    int x0;
+    int y0;
+
+    std::uint8_t& at(int px, int py) const
+    {
+      return pixels[(py - y0) * stride + (px - x0)];
+    }
+  };
+
+  // Computes a row with the engine of target
+  void compute_row(const Target& target, const Mandelbrot::Kernels::Row& row, std::uint8_t* pixels, Mandelbrot::Stats* stats)
+  {
+    if (target.reference)
+    {
+      Mandelbrot::Perturbation::row(*target.reference, row, pixels, stats);
+    }
+    else if (target.double_double_row_kernel)
+    {
+      target.double_double_row_kernel(target.center_re, target.center_im, row, pixels, stats);
+    }
+    else
+    {
+      target.row_kernel(row, pixels, stats);
+    }
+  }
+
+  // Computes pixels px_begin, px_begin + px_step, ... below px_end in image row py
+  void compute_span(const Target& target, int py, int px_begin, int px_end, Mandelbrot::Stats* stats, int px_step = 1)
+  {
+    Mandelbrot::Kernels::Row row;
+    row.min_re   = target.min_re;
+    row.dx       = target.dx;
+    row.px_begin = px_begin;
+    row.px_end   = px_end;
+    row.px_step  = px_step;
+    row.c_im     = target.min_im + py * target.dy;
+    row.max_iter = target.max_iter;
+    if (px_step == 1)
+    {
+      compute_row(target, row, &target.at(px_begin, py), stats);
+      stats->pixels_computed += px_end - px_begin;
+      return;
+    }
+
+    // The kernels write the pixels next to each other
+    std::vector<std::uint8_t> pixels(Mandelbrot::Kernels::pixels_left(row, px_begin, px_end - px_begin));
+    compute_row(target, row, pixels.data(), stats);
+    for (auto i = 0u; i < pixels.size(); i++)
+    {
+      target.at(px_begin + static_cast<int>(i) * px_step, py) = pixels[i];
+    }
+    stats->pixels_computed += pixels.size();
+  }
+
+  // Computes pixels px_begin..px_end-1 in image row py of target, from the
+  // same pixels computed with one sample per pixel in first, which must also
+  // have their neighbours inside the image. Pixels that differ from one of
+  // their four neighbours are replaced by the average of factor x factor
+  // samples spread evenly over the pixel, the other pixels are copied.
+  // The sample offsets are symmetric around the pixel, so that mirrored rows
+  // (@see mirror_supersampled_row) get exactly mirrored samples. Each row of
+  // samples of a span of pixels is computed as one row with factor times as
+  // many pixels, to keep the vector lanes busy.
+  void supersample_span(const Target& target,
+                        const Target& first,
+                        int image_width,
+                        int image_height,
+                        int factor,
+                        int py,
+                        int px_begin,
+                        int px_end,
+                        Mandelbrot::Stats* stats)
+  {
+    const auto differs = [&](int px)
+    {
+      const auto value = first.at(px, py);
+      return (px > 0 && first.at(px - 1, py) != value) ||
+             (px + 1 < image_width && first.at(px + 1, py) != value) ||
+             (py > 0 && first.at(px, py - 1) != value) ||
+             (py + 1 < image_height && first.at(px, py + 1) != value);
+    };
+
+    const auto num_samples = static_cast<unsigned>(factor * factor);
+    std::vector<unsigned> sums;
+    std::vector<std::uint8_t> samples;
+    Mandelbrot::Kernels::Row row;
+    row.min_re   = target.min_re - (factor - 1) * target.dx / (2 * factor);
+    row.dx       = target.dx / factor;
+    row.max_iter = target.max_iter;
+    auto px = px_begin;
+    while (px < px_end)
+    {
+      if (!differs(px))
+      {
+        target.at(px, py) = first.at(px, py);
+        px += 1;
+        continue;
+      }
+
+      auto span_end = px + 1;
+      while (span_end < px_end && differs(span_end))
+      {
+        span_end += 1;
+      }
+
+      const auto num_pixels = span_end - px;
+      sums.assign(num_pixels, 0u);
+      samples.resize(num_pixels * factor);
+      row.px_begin = px * factor;
+      row.px_end   = span_end * factor;
+      for (auto j = 0; j < factor; j++)
+      {
+        const auto offset = static_cast<double>(2 * j - (factor - 1)) / (2 * factor);
+        row.c_im = (target.min_im + py * target.dy) + offset * target.dy;
+        compute_row(target, row, samples.data(), stats);
+        for (auto i = 0; i < num_pixels * factor; i++)
+        {
+          sums[i / factor] += samples[i];
+        }
+      }
+      for (auto i = 0; i < num_pixels; i++)
+      {
+        target.at(px + i, py) = static_cast<std::uint8_t>((sums[i] + num_samples / 2) / num_samples);
+      }
+      stats->pixels_supersampled += num_pixels;
+      px = span_end;
+    }
+  }
+
+  // Selects the engine based on the pixel spacing, @see Mandelbrot::compute
+  Mandelbrot::Engine select_engine(std::complex<double> min_c,
+                                   std::complex<double> max_c,
+                                   double dx,
+                                   double dy,
+                                   int max_iter,
+                                   bool preview)
+  {
+    const auto scale = std::max({ 1.0,
+                                  std::fabs(min_c.real()), std::fabs(min_c.imag()),
+                                  std::fabs(max_c.real()), std::fabs(max_c.imag()) });
+    const auto spacing = std::min(std::fabs(dx), std::fabs(dy));
+    if (preview && spacing >= std::ldexp(scale, -8) && max_iter <= 64)
+    {
+      return Mandelbrot::Engine::FLOAT;
+    }
+    if (spacing >= std::ldexp(scale, -42))
+    {
+      return Mandelbrot::Engine::DOUBLE;
+    }
+    if (spacing >= std::ldexp(scale, -70))
+    {
+      return Mandelbrot::Engine::DOUBLE_DOUBLE;
+    }
+    return Mandelbrot::Engine::PERTURBATION;
+  }
+
+  // Gets the row whose c_im is exactly the negation of the c_im of row py,
+  // or -1 if there is no such row in 0..image_height-1 (or if it is py itself)
+  int mirror_row(double min_im, double dy, int image_height, int py)
+  {
+    const auto c_im = min_im + py * dy;
+    const auto mirror = (-c_im - min_im) / dy;
+    if (c_im == 0.0 || !(mirror > -1.0 && mirror < image_height))
+    {
+      return -1;
+    }
+    const auto row = static_cast<int>(std::lround(mirror));
+    if (row == image_height || min_im + row * dy != -c_im)
+    {
+      return -1;
+    }
+    return row;
+  }
+
+  // Same as mirror_row, but with supersampling the rows above and below must
+  // mirror each other as well (or both be outside of the image), since they
+  // decide which pixels are supersampled
+  int mirror_supersampled_row(double min_im, double dy, int image_height, int py)
+  {
+    const auto mirror = mirror_row(min_im, dy, image_height, py);
+    if (mirror < 0)
+    {
+      return -1;
+    }
+    for (const auto d : { -1, 1 })
+    {
+      const auto inside = py + d >= 0 && py + d < image_height;
+      const auto mirror_inside = mirror - d >= 0 && mirror - d < image_height;
+      if (inside != mirror_inside || (inside && mirror_row(min_im, dy, image_height, py + d) != mirror - d))
+      {
+        return -1;
+      }
+    }
+    return mirror;
+  }
+
+  double sum(const std::vector<double>& expansion)
+  {
+    auto result = 0.0;
+    for (const auto value : expansion)
+    {
+      result += value;
+    }
+    return result;
+  }
+
+  // Mariani-Silver tiles are computed in parallel, rectangles that are
+  // smaller than MIN_SUBDIVIDE pixels in either direction are not subdivided
+  constexpr int MARIANI_SILVER_TILE = Mandelbrot::MARIANI_SILVER_TILE_SIZE;
+  constexpr int MIN_SUBDIVIDE = 4;
+
+  // Mariani-Silver subdivision of the rectangle (x0, y0)..(x1, y1), inclusive
+  // The border of the rectangle must already be computed
+  void subdivide(const Target& target, int x0, int y0, int x1, int y1, Mandelbrot::Stats* stats)
+  {
+    if (x1 - x0 < 2 || y1 - y0 < 2)
+    {
+      // No interior
+      return;
+    }
+
+    // Check if the border is uniform
+    const auto value = target.at(x0, y0);
+    auto uniform = true;
+    for (auto px = x0; px <= x1 && uniform; px++)
+    {
+      uniform = target.at(px, y0) == value && target.at(px, y1) == value;
+    }
+    for (auto py = y0 + 1; py < y1 && uniform; py++)
+    {
+      uniform = target.at(x0, py) == value && target.at(x1, py) == value;
+    }
+
+    if (uniform)
+    {
+      for (auto py = y0 + 1; py < y1; py++)
+      {
+        std::fill(&target.at(x0 + 1, py), &target.at(x1, py), value);
+      }
+      return;
+    }
+
+    if (x1 - x0 <= MIN_SUBDIVIDE || y1 - y0 <= MIN_SUBDIVIDE)
+    {
+      // Too small to be worth subdividing, compute the interior
+      for (auto py = y0 + 1; py < y1; py++)
+      {
+        compute_span(target, py, x0 + 1, x1, stats);
+      }
+      return;
+    }
+
+    // Compute a horizontal and a vertical line through the middle of the
+    // rectangle, which gives us four rectangles with computed borders
+    const auto xm = (x0 + x1) / 2;
+    const auto ym = (y0 + y1) / 2;
+    compute_span(target, ym, x0 + 1, x1, stats);
+    for (auto py = y0 + 1; py < y1; py++)
+    {
+      if (py != ym)
+      {
+        compute_span(target, py, xm, xm + 1, stats);
+      }
+    }
+
+    subdivide(target, x0, y0, xm, ym, stats);
+    subdivide(target, xm, y0, x1, ym, stats);
+    subdivide(target, x0, ym, xm, y1, stats);
+    subdivide(target, xm, ym, x1, y1, stats);
+  }
+
+  // Computes the rectangle (x0, y0)..(x1, y1), inclusive, with Mariani-Silver
+  void compute_mariani_silver(const Target& target, int x0, int y0, int x1, int y1, Mandelbrot::Stats* stats)
+  {
+    compute_span(target, y0, x0, x1 + 1, stats);
+    if (y1 != y0)
+    {
+      compute_span(target, y1, x0, x1 + 1, stats);
+    }
+    for (auto py = y0 + 1; py < y1; py++)
+    {
+      compute_span(target, py, x0, x0 + 1, stats);
+      if (x1 != x0)
+      {
+        compute_span(target, py, x1, x1 + 1, stats);
+      }
+    }
+
+    subdivide(target, x0, y0, x1, y1, stats);
+  }
+
+  // Computes the rows of rect in parallel bands of rows, compute(py, stats)
+  // computes the pixels of rect in row py. Rows with positive c_im whose
+  // mirrored row, as given by mirror(py) (-1 if none), is in rect are copied
+  // from that row instead of computed. Only the rows and columns of the
+  // lattice of rect are computed and copied. Adds the statistics of each band
+  // to task_stats. Stops early if cancel becomes true.
+  void compute_rows(const Target& target,
+                    const Mandelbrot::Rect& rect,
+                    const std::function<int(int)>& mirror,
+                    const std::function<void(int, Mandelbrot::Stats*)>& compute,
+                    const std::atomic<bool>* cancel,
+                    std::vector<Mandelbrot::Stats>* task_stats)
+  {
+    const auto y_end = rect.y + rect.height;
+    std::vector<int> rows;
+    std::vector<std::pair<int, int>> mirrored_rows;  // (row, source row)
+    for (auto py = rect.y; py < y_end; py += rect.y_step)
+    {
+      const auto source = mirror(py);
+      if (source >= rect.y && source < y_end && (source - rect.y) % rect.y_step == 0 &&
+          target.min_im + py * target.dy > 0.0)
+      {
+        mirrored_rows.emplace_back(py, source);
+      }
+      else
+      {
+        rows.push_back(py);
+      }
+    }
+
+    // Bands of rows, the kernel handles the pixels in each row
+    const auto rows_per_band = band_height;
+    const auto num_rows = static_cast<int>(rows.size());
+    const auto num_bands = (num_rows + rows_per_band - 1) / rows_per_band;
+    const auto first_band = task_stats->size();
+    task_stats->resize(first_band + num_bands);
+    run_tasks(num_bands, [&](int band)
+    {
+      const auto begin = band * rows_per_band;
+      const auto end = std::min(num_rows, begin + rows_per_band);
+      for (auto i = begin; i < end && !is_cancelled(cancel); i++)
+      {
+        compute(rows[i], &(*task_stats)[first_band + band]);
+      }
+    });
+    if (is_cancelled(cancel))
+    {
+      return;
+    }
+
+    for (const auto& mirrored : mirrored_rows)
+    {
+      for (auto px = rect.x; px < rect.x + rect.width; px += rect.x_step)
+      {
+        target.at(px, mirrored.first) = target.at(px, mirrored.second);
+      }
+    }
+  }
+}
+
+bool Mandelbrot::is_supported(Kernel kernel)
+{
+  switch (kernel)
+  {
+    case Kernel::AUTO:   return true;
+    case Kernel::SCALAR: return true;
+    case Kernel::SSE2:   return Kernels::cpu_has_sse2();
+    case Kernel::AVX2:   return Kernels::cpu_has_avx2();
+    case Kernel::AVX512: return Kernels::cpu_has_avx512();
+    default:             return false;
+  }
+}
+
+bool Mandelbrot::set_kernel(Kernel kernel)
+{
+  if (!is_supported(kernel))
+  {
+    return false;
+  }
+
+  current_kernel = kernel == Kernel::AUTO ? best_kernel() : kernel;
+  return true;
+}
+
+Mandelbrot::Kernel Mandelbrot::get_kernel()
+{
+  return current_kernel;
+}
+
+const char* Mandelbrot::kernel_to_str(Kernel kernel)
+{
+  switch (kernel)
+  {
+    case Kernel::AUTO:   return "auto";
+    case Kernel::SCALAR: return "scalar";
+    case Kernel::SSE2:   return "sse2";
+    case Kernel::AVX2:   return "avx2";
+    case Kernel::AVX512: return "avx512";
+    default:             return "invalid";
+  }
+}
+
+const char* Mandelbrot::engine_to_str(Engine engine)
+{
+  switch (engine)
+  {
+    case Engine::AUTO:          return "auto";
+    case Engine::FLOAT:         return "float";
+    case Engine::DOUBLE:        return "double";
+    case Engine::DOUBLE_DOUBLE: return "double-double";
+    case Engine::PERTURBATION:  return "perturbation";
+    default:                    return "invalid";
+  }
+}
+
+bool Mandelbrot::kernel_from_str(const std::string& str, Kernel* kernel)
+{
+  for (const auto k : { Kernel::AUTO, Kernel::SCALAR, Kernel::SSE2, Kernel::AVX2, Kernel::AVX512 })
+  {
+    if (str == kernel_to_str(k))
+    {
+      *kernel = k;
+      return true;
+    }
+  }
+  return false;
+}
+
+void Mandelbrot::set_num_threads(int threads)
+{
+  std::lock_guard<std::mutex> lock(thread_pool_mutex);
+  num_threads = std::max(1, threads);
+  thread_pool.reset();
+}
+
+int Mandelbrot::get_num_threads()
+{
+  return num_threads;
+}
+
+void Mandelbrot::set_band_height(int rows)
+{
+  band_height = std::max(1, rows);
+}
+
+int Mandelbrot::get_band_height()
+{
+  return band_height;
+}
+
+void Mandelbrot::set_specialized_kernels(bool enabled)
+{
+  specialized_kernels = enabled;
+}
+
+bool Mandelbrot::get_specialized_kernels()
+{
+  return specialized_kernels;
+}
 
 std::vector<std::uint8_t> Mandelbrot::compute(std::complex<double> min_c,
                                               std::complex<double> max_c,
                                               int image_width,
                                               int image_height,
-                                              int max_iter)
+                                              int max_iter,
+                                              const Options& options,
+                                              Stats* stats)
 {
-  std::vector<std::uint8_t> pixels;
+  return compute({}, {}, min_c, max_c, image_width, image_height, max_iter, options, stats);
+}
 
+std::vector<std::uint8_t> Mandelbrot::compute(const std::vector<double>& center_re,
+                                              const std::vector<double>& center_im,
+                                              std::complex<double> min_c,
+                                              std::complex<double> max_c,
+                                              int image_width,
+                                              int image_height,
+                                              int max_iter,
+                                              const Options& options,
+                                              Stats* stats)
+{
+  std::vector<std::uint8_t> pixels(static_cast<std::size_t>(image_width) * image_height);
+  compute_into(center_re,
+               center_im,
+               min_c,
+               max_c,
+               image_width,
+               image_height,
+               max_iter,
+               { 0, 0, image_width, image_height },
+               pixels.data(),
+               image_width,
+               options,
+               stats);
+  return pixels;
+}
+
+void Mandelbrot::compute_into(const std::vector<double>& center_re,
+                              const std::vector<double>& center_im,
+                              std::complex<double> min_c,
+                              std::complex<double> max_c,
+                              int image_width,
+                              int image_height,
+                              int max_iter,
+                              const Rect& rect,
+                              std::uint8_t* pixels,
+                              std::ptrdiff_t stride,
+                              const Options& options,
+                              Stats* stats)
+{
   // Calculate image pixel size in the complex plane
   // Example: with x=y=10, min_c=(-2.0, -2.0) and max_c=(2.0, 2.0)
   //          we'll get dc=(4.0, 4.0), dx=0.4 and dy=0.4
@@ -19,32 +745,360 @@ std::vector<std::uint8_t> Mandelbrot::compute(std::complex<double> min_c,
   const auto dx = dc.real() / static_cast<double>(image_width);
   const auto dy = dc.imag() / static_cast<double>(image_height);
 
-  // Iterate over each image pixel
-  for (auto py = 0; py < image_height; py++)
+  const auto center = std::complex<double>(sum(center_re), sum(center_im));
+  const auto engine = get_engine(center_re, center_im, min_c, max_c, image_width, image_height, max_iter, options);
+
+  Target target;
+  target.row_kernel               = engine == Engine::FLOAT ? get_float_row_kernel(current_kernel)
+                                                            : get_row_kernel(current_kernel,
+                                                                             center + min_c,
+                                                                             center + max_c,
+                                                                             max_iter);
+  target.double_double_row_kernel = nullptr;
+  target.reference                = nullptr;
+  target.dx                       = dx;
+  target.dy                       = dy;
+  target.max_iter                 = max_iter;
+  target.pixels                   = pixels;
+  target.stride                   = stride;
+  target.x0                       = rect.x;
+  target.y0                       = rect.y;
+
+  // The extended precision engines use coordinates relative to a point
+  // near the image, so that the pixel offsets are exact enough in double
+  // precision even when min_c itself is not
+  std::shared_ptr<const CachedReference> reference;
+  if (engine == Engine::PERTURBATION)
+  {
+    // Use the pixel closest to the image center as reference point
+    const auto offset_re = (image_width / 2) * dx;
+    const auto offset_im = (image_height / 2) * dy;
+    const auto frac_limbs = FixedPoint::frac_limbs_for(std::min(std::fabs(dx), std::fabs(dy)));
+    const auto c_re = FixedPoint::from_expansion(center_re, frac_limbs) +
+                      FixedPoint::from_double(min_c.real(), frac_limbs) +
+                      FixedPoint::from_double(offset_re, frac_limbs);
+    const auto c_im = FixedPoint::from_expansion(center_im, frac_limbs) +
+                      FixedPoint::from_double(min_c.imag(), frac_limbs) +
+                      FixedPoint::from_double(offset_im, frac_limbs);
+    reference = get_reference(c_re, c_im, max_iter);
+
+    target.reference = reference->reference.get();
+    target.min_re    = -offset_re;
+    target.min_im    = -offset_im;
+  }
+  else if (engine == Engine::DOUBLE_DOUBLE)
+  {
+    // Relative to min_c
+    target.double_double_row_kernel = get_double_double_row_kernel(current_kernel);
+    target.center_re                = DoubleDouble::add(DoubleDouble::from_expansion(center_re), min_c.real());
+    target.center_im                = DoubleDouble::add(DoubleDouble::from_expansion(center_im), min_c.imag());
+    target.min_re                   = 0.0;
+    target.min_im                   = 0.0;
+  }
+  else
+  {
+    // Note: with an empty center this is exactly min_c
+    target.min_re = center.real() + min_c.real();
+    target.min_im = center.imag() + min_c.imag();
+  }
+
+  // Split the rectangle into tasks that are computed in parallel. Each task
+  // has its own Stats so that the threads don't need to synchronize.
+  const auto x_end = rect.x + rect.width;
+  const auto y_end = rect.y + rect.height;
+  std::vector<Stats> task_stats;
+
+  // The set is symmetric about the real axis, and the double and float
+  // kernels are exactly symmetric in c_im, @see mirror_row
+  const auto symmetric = engine == Engine::DOUBLE || engine == Engine::FLOAT;
+  const auto mirror = [&](int py)
+  {
+    return symmetric ? ::mirror_row(target.min_im, dy, image_height, py) : -1;
+  };
+
+  const auto lattice = rect.x_step > 1 || rect.y_step > 1;
+  if (rect.width <= 0 || rect.height <= 0)
+  {
+    // Nothing to compute
+  }
+  else if (options.supersampling > 1 && !lattice)
   {
-    for (auto px = 0; px < image_width; px++)
+    // Compute all pixels of rect and their neighbours with one sample first,
+    // then supersample the pixels that differ from one of their neighbours
+    const auto first_x = std::max(0, rect.x - 1);
+    const auto first_y = std::max(0, rect.y - 1);
+    const Rect first_rect = { first_x,
+                              first_y,
+                              std::min(image_width, x_end + 1) - first_x,
+                              std::min(image_height, y_end + 1) - first_y };
+    std::vector<std::uint8_t> first_pixels(static_cast<std::size_t>(first_rect.width) * first_rect.height);
+    auto first   = target;
+    first.pixels = first_pixels.data();
+    first.stride = first_rect.width;
+    first.x0     = first_rect.x;
+    first.y0     = first_rect.y;
+    compute_rows(first, first_rect, mirror, [&](int py, Stats* band_stats)
     {
-      // Mandelbrot set algorithm
-      const auto c = min_c + std::complex<double>(px * dx, py * dy);
-      auto z = std::complex<double>(0.0f, 0.0f);
-      int n = 0;
-      while (n < max_iter && std::abs(z) < 2.0f)
-      {
-        z = std::pow(z, 2) + c;
-        n += 1;
-      }
+      compute_span(first, py, first_rect.x, first_rect.x + first_rect.width, band_stats);
+    }, options.cancel, &task_stats);
 
-      if (n == max_iter)
+    const auto mirror_supersampled = [&](int py)
+    {
+      return symmetric ? mirror_supersampled_row(target.min_im, dy, image_height, py) : -1;
+    };
+    compute_rows(target, rect, mirror_supersampled, [&](int py, Stats* band_stats)
+    {
+      supersample_span(target, first, image_width, image_height, options.supersampling, py, rect.x, x_end, band_stats);
+    }, options.cancel, &task_stats);
+  }
+  else if (options.mariani_silver && !lattice)
+  {
+    // Tiles of MARIANI_SILVER_TILE x MARIANI_SILVER_TILE pixels, aligned to the
+    // image so that the result does not depend on rect
+    const auto tile_x_begin = rect.x / MARIANI_SILVER_TILE;
+    const auto tile_y_begin = rect.y / MARIANI_SILVER_TILE;
+    const auto tiles_x = (x_end - 1) / MARIANI_SILVER_TILE - tile_x_begin + 1;
+    const auto tiles_y = (y_end - 1) / MARIANI_SILVER_TILE - tile_y_begin + 1;
+    task_stats.resize(tiles_x * tiles_y);
+    run_tasks(tiles_x * tiles_y, [&](int tile)
+    {
+      if (is_cancelled(options.cancel))
       {
-        pixels.push_back(0);  // black
+        return;
       }
-      else
+      const auto tile_x = (tile_x_begin + tile % tiles_x) * MARIANI_SILVER_TILE;
+      const auto tile_y = (tile_y_begin + tile / tiles_x) * MARIANI_SILVER_TILE;
+      const auto x0 = std::max(rect.x, tile_x);
+      const auto y0 = std::max(rect.y, tile_y);
+      const auto x1 = std::min(x_end, tile_x + MARIANI_SILVER_TILE) - 1;
+      const auto y1 = std::min(y_end, tile_y + MARIANI_SILVER_TILE) - 1;
+      compute_mariani_silver(target, x0, y0, x1, y1, &task_stats[tile]);
+    });
+  }
+  else
+  {
+    compute_rows(target, rect, mirror, [&](int py, Stats* band_stats)
+    {
+      compute_span(target, py, rect.x, x_end, band_stats, rect.x_step);
+    }, options.cancel, &task_stats);
+  }
+
+  if (stats)
+  {
+    *stats = Stats();
+    for (const auto& s : task_stats)
+    {
+      *stats += s;
+    }
+    stats->engine = engine;
+  }
+}
+
+Mandelbrot::Engine Mandelbrot::get_engine(const std::vector<double>& center_re,
+                                          const std::vector<double>& center_im,
+                                          std::complex<double> min_c,
+                                          std::complex<double> max_c,
+                                          int image_width,
+                                          int image_height,
+                                          int max_iter,
+                                          const Options& options)
+{
+  if (options.engine != Engine::AUTO)
+  {
+    return options.engine;
+  }
+
+  const auto dc = max_c - min_c;
+  const auto dx = dc.real() / static_cast<double>(image_width);
+  const auto dy = dc.imag() / static_cast<double>(image_height);
+  const auto center = std::complex<double>(sum(center_re), sum(center_im));
+  return select_engine(center + min_c, center + max_c, dx, dy, max_iter, options.preview);
+}
+
+int Mandelbrot::mirror_row(const std::vector<double>& center_re,
+                           const std::vector<double>& center_im,
+                           std::complex<double> min_c,
+                           std::complex<double> max_c,
+                           int image_width,
+                           int image_height,
+                           int max_iter,
+                           int row,
+                           const Options& options)
+{
+  const auto engine = get_engine(center_re, center_im, min_c, max_c, image_width, image_height, max_iter, options);
+  if ((engine != Engine::DOUBLE && engine != Engine::FLOAT) ||
+      (options.mariani_silver && options.supersampling <= 1))
+  {
+    return -1;
+  }
+
+  // The same row coordinates as compute_into()
+  const auto dy = (max_c - min_c).imag() / static_cast<double>(image_height);
+  const auto min_im = sum(center_im) + min_c.imag();
+  return options.supersampling > 1 ? mirror_supersampled_row(min_im, dy, image_height, row)
+                                   : ::mirror_row(min_im, dy, image_height, row);
+}
+
+double Mandelbrot::get_pixel_coordinate(const std::vector<double>& center, double min, double max, int size, int p)
+{
+  // The same coordinates as compute_into() and the kernels
+  const auto d = (max - min) / static_cast<double>(size);
+  return (sum(center) + min) + p * d;
+}
+
+bool Mandelbrot::compute_resumable(const std::vector<double>& center_re,
+                                   const std::vector<double>& center_im,
+                                   std::complex<double> min_c,
+                                   std::complex<double> max_c,
+                                   int image_width,
+                                   int image_height,
+                                   int max_iter,
+                                   const Rect& rect,
+                                   std::uint8_t* pixels,
+                                   std::ptrdiff_t stride,
+                                   ResumeState* state,
+                                   Stats* stats,
+                                   const std::atomic<bool>* cancel)
+{
+  const auto engine = get_engine(center_re, center_im, min_c, max_c, image_width, image_height, max_iter);
+  if ((engine != Engine::DOUBLE && engine != Engine::FLOAT) || state->max_iter > max_iter)
+  {
+    return false;
+  }
+
+  // The same pixel coordinates as compute_into() with Engine::DOUBLE
+  const auto dc = max_c - min_c;
+  const auto dx = dc.real() / static_cast<double>(image_width);
+  const auto dy = dc.imag() / static_cast<double>(image_height);
+  const auto center = std::complex<double>(sum(center_re), sum(center_im));
+  const auto min_re = center.real() + min_c.real();
+  const auto min_im = center.imag() + min_c.imag();
+
+  Stats total;
+  total.engine = Engine::DOUBLE;
+  if (rect.width <= 0 || rect.height <= 0)
+  {
+    state->max_iter = max_iter;
+    if (stats)
+    {
+      *stats = total;
+    }
+    return true;
+  }
+
+  // The points to iterate: the pixels that did not escape before, or all
+  // pixels outside of the main cardioid and period-2 bulb
+  std::vector<double> c_re;
+  std::vector<double> c_im;
+  const auto n_begin = state->max_iter;
+  if (n_begin == 0)
+  {
+    state->pixel.clear();
+    for (auto py = rect.y; py < rect.y + rect.height; py++)
+    {
+      const auto row_c_im = min_im + py * dy;
+      for (auto px = rect.x; px < rect.x + rect.width; px++)
       {
-        // Implicit modulus 256 since pixels are std::uint8_t
-        pixels.push_back(n);
+        const auto pixel_c_re = min_re + px * dx;
+        if (Kernels::in_cardioid_or_bulb(pixel_c_re, row_c_im))
+        {
+          total.iterations_skipped += max_iter;
+          pixels[(py - rect.y) * stride + (px - rect.x)] = 0;
+          continue;
+        }
+        state->pixel.push_back((py - rect.y) * rect.width + (px - rect.x));
+        c_re.push_back(pixel_c_re);
+        c_im.push_back(row_c_im);
       }
     }
+    const auto count = state->pixel.size();
+    state->x.assign(count, 0.0);
+    state->y.assign(count, 0.0);
+    state->x_saved.assign(count, 0.0);
+    state->y_saved.assign(count, 0.0);
+    total.pixels_computed = static_cast<std::uint64_t>(rect.width) * rect.height;
+  }
+  else
+  {
+    for (const auto index : state->pixel)
+    {
+      c_re.push_back(min_re + (rect.x + index % rect.width) * dx);
+      c_im.push_back(min_im + (rect.y + index / rect.width) * dy);
+    }
+    total.pixels_computed = state->pixel.size();
   }
 
-  return pixels;
+  // Iterate the points in chunks on the thread pool
+  constexpr int chunk_size = 1024;
+  const auto count = static_cast<int>(state->pixel.size());
+  const auto num_chunks = (count + chunk_size - 1) / chunk_size;
+  const auto kernel = get_points_kernel(current_kernel);
+  std::vector<std::int32_t> n(count);
+  std::vector<Stats> task_stats(num_chunks);
+  run_tasks(num_chunks, [&](int chunk)
+  {
+    if (is_cancelled(cancel))
+    {
+      return;
+    }
+    const auto begin = chunk * chunk_size;
+    Kernels::Points points;
+    points.count    = std::min(chunk_size, count - begin);
+    points.n_begin  = n_begin;
+    points.max_iter = max_iter;
+    points.c_re     = c_re.data() + begin;
+    points.c_im     = c_im.data() + begin;
+    points.x        = state->x.data() + begin;
+    points.y        = state->y.data() + begin;
+    points.x_saved  = state->x_saved.data() + begin;
+    points.y_saved  = state->y_saved.data() + begin;
+    points.n        = n.data() + begin;
+    kernel(points, &task_stats[chunk]);
+  });
+  if (is_cancelled(cancel))
+  {
+    *state = ResumeState();
+    if (stats)
+    {
+      *stats = total;
+    }
+    return true;
+  }
+
+  // Write the pixels and keep the state of the pixels that did not escape
+  auto kept = 0;
+  for (auto i = 0; i < count; i++)
+  {
+    const auto index = state->pixel[i];
+    const auto px = index % rect.width;
+    const auto py = index / rect.width;
+    pixels[py * stride + px] = n[i] < 0 ? 0 : Kernels::to_pixel(n[i], max_iter);
+    if (n[i] == max_iter)
+    {
+      state->pixel[kept]   = index;
+      state->x[kept]       = state->x[i];
+      state->y[kept]       = state->y[i];
+      state->x_saved[kept] = state->x_saved[i];
+      state->y_saved[kept] = state->y_saved[i];
+      kept += 1;
+    }
+  }
+  for (auto* values : { &state->x, &state->y, &state->x_saved, &state->y_saved })
+  {
+    values->resize(kept);
+    values->shrink_to_fit();
+  }
+  state->pixel.resize(kept);
+  state->pixel.shrink_to_fit();
+  state->max_iter = max_iter;
+
+  if (stats)
+  {
+    *stats = total;
+    for (const auto& s : task_stats)
+    {
+      *stats += s;
+    }
+  }
+  return true;
 }
@@ -1,13 +1,221 @@
 #ifndef MANDELBROT_H_
 #define MANDELBROT_H_
 
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
 #include <complex>
+#include <string>
 #include <vector>
 
 namespace Mandelbrot
 {
 
+/**
+ * @brief Available compute kernels
+ *
+ * All kernels produce exactly the same pixels, they only differ
+ * in how many pixels they compute per instruction.
+ */
+enum class Kernel
+{
+  AUTO,    /**< Best kernel supported by the host CPU */
+  SCALAR,  /**< One pixel at a time, portable C++ */
+  SSE2,    /**< 2 pixels per instruction */
+  AVX2,    /**< 4 pixels per instruction */
+  AVX512,  /**< 8 pixels per instruction */
+};
+
+/**
+ * @brief Computation engines, selected by the precision a view needs
+ */
+enum class Engine
+{
+  AUTO,           /**< Select based on the pixel spacing */
+  FLOAT,          /**< Single precision, using the selected Kernel. Only
+                       selected by AUTO with Options::preview, since a few
+                       pixels differ from DOUBLE */
+  DOUBLE,         /**< Double precision, using the selected Kernel */
+  DOUBLE_DOUBLE,  /**< About 106 bits of precision, @see double_double.h */
+  PERTURBATION,   /**< Perturbation theory deep zoom engine, @see perturbation.h */
+};
+
+/**
+ * @brief Gets the name of an engine, e.g. "double"
+ */
+const char* engine_to_str(Engine engine);
+
+/**
+ * @brief Statistics from compute()
+ */
+struct Stats
+{
+  Engine engine = Engine::DOUBLE;        /**< The engine that computed the image */
+  std::uint64_t pixels_computed = 0;     /**< Number of pixels that were computed, the
+                                              others were filled in without computing */
+  std::uint64_t pixels_supersampled = 0; /**< Number of pixels that were also computed
+                                              with more samples, @see Options::supersampling */
+  std::uint64_t iterations = 0;          /**< Number of iterations computed */
+  std::uint64_t iterations_skipped = 0;  /**< Number of iterations skipped because the
+                                              point was found to be inside the set
+                                              (main cardioid, period-2 bulb or
+                                              periodic orbit) */
+
+  Stats& operator+=(const Stats& other)
+  {
+    pixels_computed += other.pixels_computed;
+    pixels_supersampled += other.pixels_supersampled;
+    iterations += other.iterations;
+    iterations_skipped += other.iterations_skipped;
+    return *this;
+  }
+};
+
+/**
+ * @brief Options for compute()
+ */
+struct Options
+{
+  Engine engine = Engine::AUTO;  /**< The engine to use */
+  bool preview = false;         /**< Allow Engine::AUTO to select Engine::FLOAT for
+                                     wide, shallow views, @see compute. About twice
+                                     as fast, but a few pixels may differ from
+                                     Engine::DOUBLE. */
+  bool mariani_silver = false;  /**< Use Mariani-Silver rectangle subdivision:
+                                     only the border of a rectangle is computed
+                                     and if all border pixels are equal the rectangle
+                                     is filled with that value, otherwise it is split
+                                     into four rectangles. Much faster on images with
+                                     large uniform areas, but small details that do
+                                     not touch a border may be lost. */
+  int supersampling = 1;        /**< Anti-aliasing: pixels that differ from one of
+                                     their four neighbours are replaced by the
+                                     average of supersampling x supersampling
+                                     samples spread over the pixel. Smooth areas
+                                     cost the same as without it. 1 disables it,
+                                     mariani_silver is ignored when enabled. */
+  const std::atomic<bool>* cancel = nullptr;  /**< Optional cancellation token: when it
+                                                   becomes true the computation stops at
+                                                   the next row (or tile) and the pixels
+                                                   that are left are undefined */
+};
+
+/**
+ * @brief Size of the square tiles that Options::mariani_silver subdivides
+ */
+constexpr int MARIANI_SILVER_TILE_SIZE = 64;
+
+/**
+ * @brief Checks if the host CPU can run the given kernel
+ *
+ * @param[in]  kernel  The kernel to check
+ *
+ * @return true if the kernel is supported, otherwise false
+ */
+bool is_supported(Kernel kernel);
+
+/**
+ * @brief Sets the kernel used by compute()
+ *
+ * Kernel::AUTO selects the best kernel supported by the host CPU,
+ * which is also the default.
+ *
+ * @param[in]  kernel  The kernel to use
+ *
+ * @return true if the kernel was set, false if it is not supported
+ */
+bool set_kernel(Kernel kernel);
+
+/**
+ * @brief Gets the kernel used by compute()
+ *
+ * @return The kernel in use, never Kernel::AUTO
+ */
+Kernel get_kernel();
+
+/**
+ * @brief Gets the name of a kernel, e.g. "avx2"
+ */
+const char* kernel_to_str(Kernel kernel);
+
+/**
+ * @brief Parses the name of a kernel
+ *
+ * @param[in]   str     Name of the kernel, @see kernel_to_str
+ * @param[out]  kernel  Pointer to where to store the kernel
+ *
+ * @return true if str is a valid kernel name, otherwise false
+ */
+bool kernel_from_str(const std::string& str, Kernel* kernel);
+
+/**
+ * @brief Sets the number of threads used by compute()
+ *
+ * The image is split into bands of rows that are computed in parallel on a
+ * work-stealing thread pool. The default is one thread per hardware thread.
+ * Must not be called while a compute() call is ongoing.
+ *
+ * @param[in]  num_threads  Number of threads, 1 disables the thread pool
+ */
+void set_num_threads(int num_threads);
+
+/**
+ * @brief Gets the number of threads used by compute()
+ */
+int get_num_threads();
+
+/**
+ * @brief Sets the number of image rows per parallel task (band)
+ *
+ * Smaller bands balance the load better, larger bands have less overhead.
+ * Must not be called while a compute() call is ongoing.
+ *
+ * @param[in]  band_height  Number of rows per band, at least 1
+ */
+void set_band_height(int band_height);
+
+/**
+ * @brief Gets the number of image rows per parallel task (band)
+ */
+int get_band_height();
+
+/**
+ * @brief Enables or disables the specialized double precision kernels
+ *
+ * The kernels are compiled in variants that leave out what an image does not
+ * need, e.g. the cycle detection when max_iter is low or the view is outside
+ * the set, and compute() selects one per image. When disabled the generic
+ * variant, which has every feature, is always used. The pixels are the same
+ * either way, only Stats::iterations_skipped may differ. Enabled by default.
+ * Must not be called while a compute() call is ongoing.
+ *
+ * @param[in]  enabled  true to select a variant per image
+ */
+void set_specialized_kernels(bool enabled);
+
+/**
+ * @brief Checks if the specialized double precision kernels are enabled
+ */
+bool get_specialized_kernels();
+
+/**
+ * @brief A rectangle of pixels in an image
+ *
+ * With steps larger than 1 only a lattice of its pixels is meant: columns
+ * x, x + x_step, ... and rows y, y + y_step, ... Only compute_into() takes
+ * such a lattice, e.g. for progressive rendering where a coarse lattice of
+ * the image is computed first and then refined.
+ */
+struct Rect
+{
+  int x;           /**< First column */
+  int y;           /**< First row */
+  int width;       /**< Number of columns */
+  int height;      /**< Number of rows */
+  int x_step = 1;  /**< Distance between the columns */
+  int y_step = 1;  /**< Distance between the rows */
+};
+
 /**
  * @brief Computes (renders) the Mandelbrot set
  *
@@ -16,6 +224,8 @@ namespace Mandelbrot
  * @param[in]  image_width   Width of output image
  * @param[in]  image_height  Height of output image
  * @param[in]  max_iter      Maximum number of iterations per sample/point
+ * @param[in]  options       Options, @see Options
+ * @param[out] stats         Optional pointer to where to store statistics
  *
  * @return Image pixels (8bpp)
  *         The number of pixels is image_width * image_height
@@ -24,7 +234,216 @@ std::vector<std::uint8_t> compute(std::complex<double> min_c,
                                   std::complex<double> max_c,
                                   int image_width,
                                   int image_height,
-                                  int max_iter);
+                                  int max_iter,
+                                  const Options& options = Options(),
+                                  Stats* stats = nullptr);
+
+/**
+ * @brief Computes (renders) the Mandelbrot set around a high-precision center
+ *
+ * Same as compute() above, but min_c and max_c are relative to center, which
+ * is given with more than double precision. This is needed for deep zooms,
+ * where the pixel spacing is too small to represent the pixels' coordinates
+ * in double precision.
+ *
+ * If options.engine is Engine::AUTO the engine is selected based on the pixel
+ * spacing relative to s = max(1, |c|):
+ * - options.preview, spacing >= s * 2^-8 and max_iter <= 64: Engine::FLOAT
+ * - spacing >= s * 2^-42 (about 2e-13 around the set): Engine::DOUBLE
+ * - spacing >= s * 2^-70 (about 8e-22): Engine::DOUBLE_DOUBLE
+ * - otherwise: Engine::PERTURBATION
+ * Double-double has 106 bits, but rounding errors in z are amplified along
+ * long orbits, while perturbation only rounds the (small) difference from the
+ * reference orbit. At 2^-70 the double-double engine still gets all but about
+ * 1% of the pixels right with 20000 iterations, and it is faster than
+ * perturbation.
+ * Single precision can never guarantee the same pixels as double precision,
+ * since points close to the boundary are sensitive to rounding. Even on wide,
+ * shallow views (e.g. thumbnails) a few pixels differ, though less than 0.01%,
+ * since the mismatch grows mostly with max_iter. So Engine::FLOAT is only
+ * selected with options.preview, for previews where speed matters more than
+ * those pixels. Run pmp_server --self-test to check this on a set of reference
+ * views.
+ *
+ * @param[in]  center_re     Real value of the center, as a floating point
+ *                           expansion: doubles whose exact sum is the value
+ * @param[in]  center_im     Imaginary value of the center, as an expansion
+ * @see compute
+ */
+std::vector<std::uint8_t> compute(const std::vector<double>& center_re,
+                                  const std::vector<double>& center_im,
+                                  std::complex<double> min_c,
+                                  std::complex<double> max_c,
+                                  int image_width,
+                                  int image_height,
+                                  int max_iter,
+                                  const Options& options = Options(),
+                                  Stats* stats = nullptr);
+
+/**
+ * @brief Computes (renders) a part of the Mandelbrot set into a caller-provided buffer
+ *
+ * Same as compute() but only the pixels in rect are computed, and they are
+ * written into pixels instead of into a new vector. Pixel (x, y) of the
+ * image is written to pixels[(y - rect.y) * stride + (x - rect.x)].
+ * The pixels are exactly the same as the corresponding pixels from compute(),
+ * so an image can be computed in parts, e.g. directly into network buffers.
+ * The exception is Options::mariani_silver, where pixels may differ if rect
+ * is not aligned to MARIANI_SILVER_TILE_SIZE.
+ *
+ * If rect has steps only its lattice of pixels is computed, the pixels in
+ * between are not written. Options::mariani_silver and Options::supersampling
+ * are then ignored, since they decide pixels from their neighbours.
+ *
+ * @param[in]  center_re     Real value of the center, may be empty,
+ *                           @see compute
+ * @param[in]  center_im     Imaginary value of the center, may be empty
+ * @param[in]  min_c         Minimum complex value (of the whole image)
+ * @param[in]  max_c         Maximum complex value (of the whole image)
+ * @param[in]  image_width   Width of the whole image
+ * @param[in]  image_height  Height of the whole image
+ * @param[in]  max_iter      Maximum number of iterations per sample/point
+ * @param[in]  rect          The pixels to compute, must be inside the image
+ * @param[out] pixels        Pointer to where to write the pixels (8bpp)
+ * @param[in]  stride        Distance in bytes between two rows in pixels
+ * @param[in]  options       Options, @see Options
+ * @param[out] stats         Optional pointer to where to store statistics
+ */
+void compute_into(const std::vector<double>& center_re,
+                  const std::vector<double>& center_im,
+                  std::complex<double> min_c,
+                  std::complex<double> max_c,
+                  int image_width,
+                  int image_height,
+                  int max_iter,
+                  const Rect& rect,
+                  std::uint8_t* pixels,
+                  std::ptrdiff_t stride,
+                  const Options& options = Options(),
+                  Stats* stats = nullptr);
+
+/**
+ * @brief Iteration state of the pixels in a rectangle that did not escape
+ *
+ * @see compute_resumable
+ */
+struct ResumeState
+{
+  int max_iter = 0;                  /**< max_iter that the pixels were iterated to,
+                                          0 if there is no state */
+  std::vector<std::int32_t> pixel;   /**< Index of each pixel in the rectangle,
+                                          (y - rect.y) * rect.width + (x - rect.x) */
+  std::vector<double> x;             /**< z = x + yi of each pixel */
+  std::vector<double> y;
+  std::vector<double> x_saved;       /**< z saved last by the cycle detection */
+  std::vector<double> y_saved;
+
+  /**
+   * @brief Gets the approximate memory used by the state
+   */
+  std::size_t size_bytes() const
+  {
+    return sizeof(*this) + pixel.size() * (sizeof(std::int32_t) + 4 * sizeof(double));
+  }
+};
+
+/**
+ * @brief Computes a part of the Mandelbrot set, keeping the state of the pixels
+ *        that did not escape so that they can be iterated further later
+ *
+ * Same as compute_into() with Engine::DOUBLE, but the state (z and the cycle
+ * detection) of the pixels that were iterated max_iter times without escaping
+ * is stored in state. If state already has a state for a lower max_iter, which
+ * must be for the same image and rect, and pixels contains the pixels that were
+ * computed then, only those pixels are iterated further, from where they
+ * stopped, and the other pixels are left as they are. The pixels are exactly
+ * the same as if they had been computed with the higher max_iter directly.
+ *
+ * Only supported when compute() would use Engine::DOUBLE or Engine::FLOAT (the
+ * state is always computed in double precision) and without Mariani-Silver.
+ *
+ * @param[in]     rect     The pixels to compute, must be inside the image
+ * @param[in,out] pixels   Pointer to where to write the pixels (8bpp)
+ * @param[in]     stride   Distance in bytes between two rows in pixels
+ * @param[in,out] state    The state, empty (max_iter = 0) to compute from the start
+ * @param[out]    stats    Optional pointer to where to store statistics
+ * @param[in]     cancel   Optional cancellation token, @see Options::cancel.
+ *                         If cancelled the state is emptied
+ * @see compute_into for the other parameters
+ *
+ * @return true if the pixels were computed, false if not supported for this
+ *         image or if state is for a higher max_iter (nothing is then changed)
+ */
+bool compute_resumable(const std::vector<double>& center_re,
+                       const std::vector<double>& center_im,
+                       std::complex<double> min_c,
+                       std::complex<double> max_c,
+                       int image_width,
+                       int image_height,
+                       int max_iter,
+                       const Rect& rect,
+                       std::uint8_t* pixels,
+                       std::ptrdiff_t stride,
+                       ResumeState* state,
+                       Stats* stats = nullptr,
+                       const std::atomic<bool>* cancel = nullptr);
+
+/**
+ * @brief Gets the engine that compute() and compute_into() use for an image
+ *
+ * Same parameters as compute(), the result is options.engine unless it is
+ * Engine::AUTO.
+ */
+Engine get_engine(const std::vector<double>& center_re,
+                  const std::vector<double>& center_im,
+                  std::complex<double> min_c,
+                  std::complex<double> max_c,
+                  int image_width,
+                  int image_height,
+                  int max_iter,
+                  const Options& options = Options());
+
+/**
+ * @brief Gets the row of an image that has exactly the same pixels as a given row
+ *
+ * The Mandelbrot set is symmetric about the real axis, so two rows whose
+ * imaginary values are exact negatives of each other have the same pixels.
+ * compute_into() computes only one row of each such pair in rect and copies
+ * it to the other, this allows callers to do the same across rects.
+ *
+ * Only Engine::DOUBLE and Engine::FLOAT compute exactly symmetric rows, and
+ * not with Options::mariani_silver, where the pixels depend on the tiles.
+ *
+ * @param[in]  row  The row, 0..image_height-1
+ * @see compute for the other parameters
+ *
+ * @return The mirrored row, or -1 if there is none (or if it is row itself)
+ */
+int mirror_row(const std::vector<double>& center_re,
+               const std::vector<double>& center_im,
+               std::complex<double> min_c,
+               std::complex<double> max_c,
+               int image_width,
+               int image_height,
+               int max_iter,
+               int row,
+               const Options& options = Options());
+
+/**
+ * @brief Gets the coordinate that Engine::DOUBLE computes a pixel column or row from
+ *
+ * Column px of an image is computed from c_re = get_pixel_coordinate(center_re,
+ * min_c.real(), max_c.real(), image_width, px), and row py likewise from the
+ * imaginary parts. Where two images have exactly the same coordinates they
+ * have exactly the same pixels.
+ *
+ * @param[in]  center  Real or imaginary value of the center, @see compute
+ * @param[in]  min     Real or imaginary value of min_c
+ * @param[in]  max     Real or imaginary value of max_c
+ * @param[in]  size    Image width or height
+ * @param[in]  p       The column or row
+ */
+double get_pixel_coordinate(const std::vector<double>& center, double min, double max, int size, int p);
 
 }
 
@@ -0,0 +1,1589 @@
+#include "mandelbrot_kernels.h"
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PMP_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang must be told that a function may use instructions that are
+// not enabled for the whole build, MSVC allows any instruction anyway.
+// It is up to the caller to verify that the CPU supports the instructions.
+#if defined(__GNUC__)
+#define TARGET(isa) __attribute__((target(isa)))
+#else
+#define TARGET(isa)
+#endif
+
+// Helpers that are shared by kernels for different instruction sets must be
+// inlined into each kernel, so that they are compiled for its instruction set
+// (mixing legacy SSE and AVX code is slow)
+#if defined(__GNUC__)
+#define FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#else
+#define FORCE_INLINE inline
+#endif
+
+namespace Mandelbrot
+{
+
+namespace Kernels
+{
+
+// Note on exactness:
+// All kernels perform exactly the same IEEE-754 operations, in the same order,
+// for each pixel: c_re = min_re + px * dx, x2 = x * x, y2 = y * y,
+// escape if !(x2 + y2 < 4), y = (x + x) * y + c_im, x = (x2 - y2) + c_re
+// This (and building with -ffp-contract=off so that the compiler does not
+// fuse multiplications and additions) makes the kernels bit-identical.
+//
+// Interior points are detected early in two ways, neither changes the output:
+// 1. Points inside the main cardioid or the period-2 bulb are never iterated,
+//    @see in_cardioid_or_bulb
+// 2. Brent's cycle detection: z is saved at iteration 1, 2, 4, 8, ... and if
+//    z later becomes exactly equal to the saved value then the (floating point)
+//    orbit is periodic and the point will never escape.
+
+namespace
+{
+  // row_scalar does the first FIRST_ITER iterations of a pixel one at a time,
+  // and then iterates in blocks of BLOCK_ITER iterations, @see step_block
+  // FIRST_ITER must be a multiple of BLOCK_ITER
+  constexpr int BLOCK_ITER = 8;
+  constexpr int FIRST_ITER = 32;
+
+  // Iteration state of one pixel
+  struct Orbit
+  {
+    double x;
+    double y;
+    double x_saved;
+    double y_saved;
+    int n;
+    long long next_save;
+    bool periodic;
+  };
+
+  // Iterates one iteration at a time until the pixel escapes, is found to be
+  // periodic (both return false) or n reaches end (returns true)
+  template<bool CYCLES>
+  inline bool step_exact(double c_re, double c_im, int end, Orbit* orbit)
+  {
+    auto x = orbit->x;
+    auto y = orbit->y;
+    auto x_saved = orbit->x_saved;
+    auto y_saved = orbit->y_saved;
+    auto n = orbit->n;
+    auto next_save = orbit->next_save;
+    auto iterating = true;
+    while (n < end)
+    {
+      const auto x2 = x * x;
+      const auto y2 = y * y;
+      if (!(x2 + y2 < 4.0))
+      {
+        iterating = false;
+        break;
+      }
+      y = (x + x) * y + c_im;
+      x = x2 - y2 + c_re;
+      n += 1;
+
+      if (CYCLES && x == x_saved && y == y_saved)
+      {
+        orbit->periodic = true;
+        iterating = false;
+        break;
+      }
+      if (CYCLES && n == next_save)
+      {
+        x_saved = x;
+        y_saved = y;
+        next_save *= 2;
+      }
+    }
+    orbit->x = x;
+    orbit->y = y;
+    orbit->x_saved = x_saved;
+    orbit->y_saved = y_saved;
+    orbit->n = n;
+    orbit->next_save = next_save;
+    return iterating;
+  }
+
+  // Checks if an orbit may have escaped somewhere in a block, given z after it
+  // The block must start at n >= 1 so that |c| < 2 (or the pixel escaped at
+  // n = 1). Once |z| >= 2 it can then never get below 2 again, as
+  // |z^2 + c| >= |z|^2 - |c|, except for rounding, hence the margin. An orbit
+  // that kept on escaping overflows to inf or NaN, which fail the check too.
+  inline bool may_have_escaped(double x, double y)
+  {
+    return !(x * x + y * y < 3.9);
+  }
+
+  // Saves z at the end of a block if it is time to, @see step_block
+  template<bool CYCLES>
+  inline void end_block(double x, double y, Orbit* orbit)
+  {
+    orbit->x = x;
+    orbit->y = y;
+    orbit->n += BLOCK_ITER;
+    if (CYCLES && orbit->n == orbit->next_save)
+    {
+      orbit->x_saved = x;
+      orbit->y_saved = y;
+      orbit->next_save *= 2;
+    }
+  }
+
+  // Iterates BLOCK_ITER iterations without the escape check, which is done
+  // only once after the block, @see may_have_escaped. If the pixel may have
+  // escaped or was periodic somewhere in the block the orbit is left unchanged
+  // and false is returned: the block must then be redone with step_exact to
+  // get the exact iteration count.
+  // orbit->n must be a multiple of BLOCK_ITER, and at least BLOCK_ITER: z is
+  // then only saved at the end of a block (next_save is a power of two).
+  template<bool CYCLES>
+  inline bool step_block(double c_re, double c_im, Orbit* orbit)
+  {
+    const auto x_saved = orbit->x_saved;
+    const auto y_saved = orbit->y_saved;
+    auto x = orbit->x;
+    auto y = orbit->y;
+    for (auto i = 0; i < BLOCK_ITER; i++)
+    {
+      const auto x2 = x * x;
+      const auto y2 = y * y;
+      y = (x + x) * y + c_im;
+      x = x2 - y2 + c_re;
+      if (CYCLES && x == x_saved && y == y_saved)
+      {
+        return false;
+      }
+    }
+    if (may_have_escaped(x, y))
+    {
+      return false;
+    }
+    end_block<CYCLES>(x, y, orbit);
+    return true;
+  }
+
+  // Like step_block, but for two pixels at the same n at once. The iterations
+  // of one pixel do not depend on the other's, so the CPU can overlap them,
+  // which hides most of the latency of the multiplications and additions.
+  // Returns false, and leaves both orbits unchanged, if either pixel may have
+  // escaped or was periodic.
+  template<bool CYCLES>
+  inline bool step_block2(double c_re_a, double c_re_b, double c_im, Orbit* a, Orbit* b)
+  {
+    const auto xa_saved = a->x_saved;
+    const auto ya_saved = a->y_saved;
+    const auto xb_saved = b->x_saved;
+    const auto yb_saved = b->y_saved;
+    auto xa = a->x;
+    auto ya = a->y;
+    auto xb = b->x;
+    auto yb = b->y;
+    for (auto i = 0; i < BLOCK_ITER; i++)
+    {
+      const auto xa2 = xa * xa;
+      const auto ya2 = ya * ya;
+      const auto xb2 = xb * xb;
+      const auto yb2 = yb * yb;
+      ya = (xa + xa) * ya + c_im;
+      xa = xa2 - ya2 + c_re_a;
+      yb = (xb + xb) * yb + c_im;
+      xb = xb2 - yb2 + c_re_b;
+      if (CYCLES && ((xa == xa_saved && ya == ya_saved) || (xb == xb_saved && yb == yb_saved)))
+      {
+        return false;
+      }
+    }
+    if (may_have_escaped(xa, ya) || may_have_escaped(xb, yb))
+    {
+      return false;
+    }
+    end_block<CYCLES>(xa, ya, a);
+    end_block<CYCLES>(xb, yb, b);
+    return true;
+  }
+
+  // Continues a pixel that has done the first FIRST_ITER iterations, until it
+  // escapes, is periodic or reaches max_iter
+  template<bool CYCLES>
+  void iterate_blocks(double c_re, double c_im, int max_iter, Orbit* orbit)
+  {
+    while (orbit->n + BLOCK_ITER <= max_iter)
+    {
+      if (!step_block<CYCLES>(c_re, c_im, orbit) && !step_exact<CYCLES>(c_re, c_im, orbit->n + BLOCK_ITER, orbit))
+      {
+        return;
+      }
+    }
+    step_exact<CYCLES>(c_re, c_im, max_iter, orbit);
+  }
+
+  // Continues two pixels that have done the first FIRST_ITER iterations, in
+  // pairs of blocks as long as both are iterating
+  template<bool CYCLES>
+  void iterate_pair_blocks(double c_re_a, double c_re_b, double c_im, int max_iter, Orbit* a, Orbit* b)
+  {
+    auto iterating_a = true;
+    auto iterating_b = true;
+    while (iterating_a && iterating_b && a->n + BLOCK_ITER <= max_iter)
+    {
+      if (!step_block2<CYCLES>(c_re_a, c_re_b, c_im, a, b))
+      {
+        iterating_a = step_exact<CYCLES>(c_re_a, c_im, a->n + BLOCK_ITER, a);
+        iterating_b = step_exact<CYCLES>(c_re_b, c_im, b->n + BLOCK_ITER, b);
+      }
+    }
+    if (iterating_a)
+    {
+      iterate_blocks<CYCLES>(c_re_a, c_im, max_iter, a);
+    }
+    if (iterating_b)
+    {
+      iterate_blocks<CYCLES>(c_re_b, c_im, max_iter, b);
+    }
+  }
+
+  void write_pixel(const Orbit& orbit, int max_iter, std::uint8_t* pixel, Stats* stats)
+  {
+    stats->iterations += orbit.n;
+    if (orbit.periodic)
+    {
+      stats->iterations_skipped += max_iter - orbit.n;
+      *pixel = 0;
+    }
+    else
+    {
+      *pixel = to_pixel(orbit.n, max_iter);
+    }
+  }
+}
+
+template<bool REFILL, bool CYCLES>
+void row_scalar(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  // The first iterations, where most pixels escape, are done one at a time:
+  // blocks would often have to be redone there. The pixels that are still
+  // iterating after them are then continued two at a time, @see step_block2
+  const auto max_iter = row.max_iter;
+  const auto first_end = std::min(FIRST_ITER, max_iter);
+  auto pending = -1;
+  auto pending_c_re = 0.0;
+  Orbit pending_orbit = { 0.0, 0.0, 0.0, 0.0, 0, 1, false };
+  for (auto px = row.px_begin, i = 0; px < row.px_end; px += row.px_step, i++)
+  {
+    const auto c_re = row.min_re + px * row.dx;
+    if (in_cardioid_or_bulb(c_re, row.c_im))
+    {
+      stats->iterations_skipped += max_iter;
+      pixels[i] = 0;
+      continue;
+    }
+
+    Orbit orbit = { 0.0, 0.0, 0.0, 0.0, 0, 1, false };
+    if (!step_exact<CYCLES>(c_re, row.c_im, first_end, &orbit) || orbit.n == max_iter)
+    {
+      write_pixel(orbit, max_iter, &pixels[i], stats);
+    }
+    else if (pending == -1)
+    {
+      pending = i;
+      pending_c_re = c_re;
+      pending_orbit = orbit;
+    }
+    else
+    {
+      iterate_pair_blocks<CYCLES>(pending_c_re, c_re, row.c_im, max_iter, &pending_orbit, &orbit);
+      write_pixel(pending_orbit, max_iter, &pixels[pending], stats);
+      write_pixel(orbit, max_iter, &pixels[i], stats);
+      pending = -1;
+    }
+  }
+
+  if (pending != -1)
+  {
+    iterate_blocks<CYCLES>(pending_c_re, row.c_im, max_iter, &pending_orbit);
+    write_pixel(pending_orbit, max_iter, &pixels[pending], stats);
+  }
+}
+
+void row_scalar_f32(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  const auto max_iter = row.max_iter;
+  const auto min_re = static_cast<float>(row.min_re);
+  const auto dx = static_cast<float>(row.dx);
+  const auto c_im = static_cast<float>(row.c_im);
+  for (auto px = row.px_begin; px < row.px_end; px += row.px_step)
+  {
+    const auto c_re = min_re + static_cast<float>(px) * dx;
+    if (in_cardioid_or_bulb(c_re, c_im))
+    {
+      stats->iterations_skipped += max_iter;
+      *pixels++ = 0;
+      continue;
+    }
+
+    auto x = 0.0f;
+    auto y = 0.0f;
+    auto n = 0;
+    auto x_saved = 0.0f;
+    auto y_saved = 0.0f;
+    auto next_save = 1ll;
+    auto periodic = false;
+    while (n < max_iter)
+    {
+      const auto x2 = x * x;
+      const auto y2 = y * y;
+      if (!(x2 + y2 < 4.0f))
+      {
+        break;
+      }
+      y = (x + x) * y + c_im;
+      x = x2 - y2 + c_re;
+      n += 1;
+
+      if (x == x_saved && y == y_saved)
+      {
+        periodic = true;
+        break;
+      }
+      if (n == next_save)
+      {
+        x_saved = x;
+        y_saved = y;
+        next_save *= 2;
+      }
+    }
+
+    stats->iterations += n;
+    if (periodic)
+    {
+      stats->iterations_skipped += max_iter - n;
+      *pixels++ = 0;
+    }
+    else
+    {
+      *pixels++ = to_pixel(n, max_iter);
+    }
+  }
+}
+
+void points_scalar(const Points& points, Stats* stats)
+{
+  const auto max_iter = points.max_iter;
+  for (auto i = 0; i < points.count; i++)
+  {
+    const auto c_re = points.c_re[i];
+    const auto c_im = points.c_im[i];
+    auto x = points.x[i];
+    auto y = points.y[i];
+    auto n = points.n_begin;
+    auto x_saved = points.x_saved[i];
+    auto y_saved = points.y_saved[i];
+    auto next_save = next_save_after(n);
+    auto periodic = false;
+    while (n < max_iter)
+    {
+      const auto x2 = x * x;
+      const auto y2 = y * y;
+      if (!(x2 + y2 < 4.0))
+      {
+        break;
+      }
+      y = (x + x) * y + c_im;
+      x = x2 - y2 + c_re;
+      n += 1;
+
+      if (x == x_saved && y == y_saved)
+      {
+        periodic = true;
+        break;
+      }
+      if (n == next_save)
+      {
+        x_saved = x;
+        y_saved = y;
+        next_save *= 2;
+      }
+    }
+
+    points.x[i] = x;
+    points.y[i] = y;
+    points.x_saved[i] = x_saved;
+    points.y_saved[i] = y_saved;
+    points.n[i] = periodic ? -1 : n;
+    stats->iterations += n - points.n_begin;
+    if (periodic)
+    {
+      stats->iterations_skipped += max_iter - n;
+    }
+  }
+}
+
+#if defined(PMP_X86)
+
+// The double precision SIMD kernels run in two phases, so that the vector
+// lanes are kept busy however the escape counts are spread:
+// 1. Lockstep: each vector of consecutive pixels is iterated together for at
+//    most LOCKSTEP_ITER iterations, like a plain SIMD loop. Most pixels of a
+//    typical image escape (or are found to be inside the set) here, and a
+//    vector waits at most LOCKSTEP_ITER iterations for its slowest pixel.
+//    Without REFILL the whole computation runs in lockstep, which is faster
+//    when max_iter is too low for the lanes to wait long anyway.
+// 2. Refill: the pixels that are still iterating are queued with their state
+//    (z, iteration count and cycle detection), and each lane iterates its own
+//    pixel. As soon as a pixel escapes, is found to be periodic or reaches
+//    max_iter its result is written and the next queued pixel is loaded into
+//    the lane, so the lanes only run empty at the end of the queue.
+// To keep the refill loop short, a lane leaves it when its pixel escapes, is
+// periodic or reaches its next event: the iteration at which z is saved for
+// the cycle detection, or max_iter. The events are then handled for all
+// lanes at once. Each pixel still goes through exactly the same operations
+// as in row_scalar. Without CYCLES the cycle detection is left out, and the
+// only events are escaping and max_iter.
+
+namespace
+{
+  constexpr int LOCKSTEP_ITER = 64;
+
+  // Pixels that are still iterating after the lockstep phase, with their state
+  struct RefillQueue
+  {
+    std::vector<int> px;
+    std::vector<double> c_re;
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<double> x_saved;
+    std::vector<double> y_saved;
+    int n;          // Iteration count, the same for all pixels
+    int next;       // Next pixel to load into a lane
+  };
+
+  template<int N>
+  struct Lanes
+  {
+    alignas(64) double c_re[N];
+    alignas(64) double x[N];
+    alignas(64) double y[N];
+    alignas(64) double x_saved[N];
+    alignas(64) double y_saved[N];
+    alignas(64) double n[N];
+    alignas(64) double next_save[N];
+    int px[N];      // Index of the pixel in each lane in the row's pixels, -1 if the lane is empty
+    int occupied;   // Bitmask of lanes with a pixel
+
+    Lanes()
+      : occupied(0)
+    {
+      for (auto lane = 0; lane < N; lane++)
+      {
+        c_re[lane] = x[lane] = y[lane] = x_saved[lane] = y_saved[lane] = n[lane] = 0.0;
+        next_save[lane] = 1.0;
+        px[lane] = -1;
+      }
+    }
+
+    // Writes the pixels of the lockstep phase that are done, or queues them
+    // if they are still iterating. n, x, y, x_saved and y_saved must be
+    // stored for the num_lanes lanes of pixel px.
+    FORCE_INLINE void finish_lockstep(const Row& row, int px, int num_lanes, int interior, int active,
+                                      RefillQueue* queue, std::uint8_t* pixels, Stats* stats) const
+    {
+      const auto index = (px - row.px_begin) / row.px_step;
+      for (auto lane = 0; lane < num_lanes; lane++)
+      {
+        const auto lane_n = static_cast<int>(n[lane]);
+        if ((active & (1 << lane)) && lane_n < row.max_iter)
+        {
+          queue->px.push_back(index + lane);
+          queue->c_re.push_back(c_re[lane]);
+          queue->x.push_back(x[lane]);
+          queue->y.push_back(y[lane]);
+          queue->x_saved.push_back(x_saved[lane]);
+          queue->y_saved.push_back(y_saved[lane]);
+          queue->n = lane_n;
+          continue;
+        }
+
+        stats->iterations += lane_n;
+        if (interior & (1 << lane))
+        {
+          stats->iterations_skipped += row.max_iter - lane_n;
+          pixels[index + lane] = 0;
+        }
+        else
+        {
+          pixels[index + lane] = to_pixel(lane_n, row.max_iter);
+        }
+      }
+    }
+
+    // Writes the pixels of the lanes in finished, which must be occupied, and
+    // loads the next queued pixels into them or into any empty lane.
+    // All lane arrays must be stored before and loaded after.
+    FORCE_INLINE void refill(const Row& row, int finished, int periodic, RefillQueue* queue,
+                             std::uint8_t* pixels, Stats* stats)
+    {
+      for (auto lane = 0; lane < N; lane++)
+      {
+        const auto bit = 1 << lane;
+        if (finished & bit)
+        {
+          const auto lane_n = static_cast<int>(n[lane]);
+          stats->iterations += lane_n;
+          if (periodic & bit)
+          {
+            stats->iterations_skipped += row.max_iter - lane_n;
+            pixels[px[lane]] = 0;
+          }
+          else
+          {
+            pixels[px[lane]] = to_pixel(lane_n, row.max_iter);
+          }
+          px[lane] = -1;
+          occupied &= ~bit;
+        }
+
+        if (!(occupied & bit) && queue->next < static_cast<int>(queue->px.size()))
+        {
+          const auto i = queue->next++;
+          px[lane]        = queue->px[i];
+          c_re[lane]      = queue->c_re[i];
+          x[lane]         = queue->x[i];
+          y[lane]         = queue->y[i];
+          x_saved[lane]   = queue->x_saved[i];
+          y_saved[lane]   = queue->y_saved[i];
+          n[lane]         = queue->n;
+          next_save[lane] = static_cast<double>(next_save_after(queue->n));
+          occupied |= bit;
+        }
+      }
+    }
+  };
+}
+
+template<bool REFILL, bool CYCLES>
+TARGET("sse2")
+void row_sse2_impl(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  const auto v_four      = _mm_set1_pd(4.0);
+  const auto v_one       = _mm_set1_pd(1.0);
+  const auto v_all       = _mm_cmpeq_pd(v_one, v_one);
+  const auto v_lane      = _mm_mul_pd(_mm_set_pd(1.0, 0.0), _mm_set1_pd(row.px_step));
+  const auto v_min_re    = _mm_set1_pd(row.min_re);
+  const auto v_dx        = _mm_set1_pd(row.dx);
+  const auto v_c_im      = _mm_set1_pd(row.c_im);
+  const auto v_margin    = _mm_set1_pd(INTERIOR_MARGIN);
+  const auto v_c_im2     = _mm_set1_pd(row.c_im * row.c_im);
+  const auto v_c_im2_4   = _mm_set1_pd(0.25 * (row.c_im * row.c_im));
+  const auto v_quarter   = _mm_set1_pd(0.25);
+  const auto v_sixteenth = _mm_set1_pd(0.0625);
+  const auto v_max_iter  = _mm_set1_pd(row.max_iter);
+
+  Lanes<2> lanes;
+  RefillQueue queue;
+  queue.next = 0;
+  const auto lockstep_iter = REFILL ? std::min(row.max_iter, LOCKSTEP_ITER) : row.max_iter;
+  for (auto px = row.px_begin; px < row.px_end; px += 2 * row.px_step)
+  {
+    const auto v_px = _mm_add_pd(_mm_set1_pd(px), v_lane);
+    const auto c_re = _mm_add_pd(v_min_re, _mm_mul_pd(v_px, v_dx));
+
+    // Main cardioid and period-2 bulb, @see in_cardioid_or_bulb
+    const auto xq = _mm_sub_pd(c_re, v_quarter);
+    const auto q = _mm_add_pd(_mm_mul_pd(xq, xq), v_c_im2);
+    const auto cardioid = _mm_cmplt_pd(_mm_add_pd(_mm_mul_pd(q, _mm_add_pd(q, xq)), v_margin), v_c_im2_4);
+    const auto xb = _mm_add_pd(c_re, v_one);
+    const auto bulb = _mm_cmplt_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(xb, xb), v_c_im2), v_margin), v_sixteenth);
+    auto interior = _mm_or_pd(cardioid, bulb);
+    auto active = _mm_andnot_pd(interior, v_all);
+
+    auto x = _mm_setzero_pd();
+    auto y = _mm_setzero_pd();
+    auto n = _mm_setzero_pd();
+    auto x_saved = _mm_setzero_pd();
+    auto y_saved = _mm_setzero_pd();
+    auto next_save = 1ll;
+    for (auto i = 0; i < lockstep_iter; i++)
+    {
+      const auto x2 = _mm_mul_pd(x, x);
+      const auto y2 = _mm_mul_pd(y, y);
+      active = _mm_and_pd(active, _mm_cmplt_pd(_mm_add_pd(x2, y2), v_four));
+      if (_mm_movemask_pd(active) == 0)
+      {
+        break;
+      }
+      n = _mm_add_pd(n, _mm_and_pd(active, v_one));
+      y = _mm_add_pd(_mm_mul_pd(_mm_add_pd(x, x), y), v_c_im);
+      x = _mm_add_pd(_mm_sub_pd(x2, y2), c_re);
+
+      if (CYCLES)
+      {
+        const auto same = _mm_and_pd(_mm_cmpeq_pd(x, x_saved), _mm_cmpeq_pd(y, y_saved));
+        const auto periodic = _mm_and_pd(active, same);
+        interior = _mm_or_pd(interior, periodic);
+        active = _mm_andnot_pd(periodic, active);
+        if (i + 1 == next_save)
+        {
+          x_saved = x;
+          y_saved = y;
+          next_save *= 2;
+        }
+      }
+    }
+
+    // The pixels that did not escape yet are still active if z has not
+    // escaped in the last iteration, which is checked in the refill phase
+    _mm_store_pd(lanes.c_re, c_re);
+    _mm_store_pd(lanes.x, x);
+    _mm_store_pd(lanes.y, y);
+    _mm_store_pd(lanes.x_saved, x_saved);
+    _mm_store_pd(lanes.y_saved, y_saved);
+    _mm_store_pd(lanes.n, n);
+    lanes.finish_lockstep(row, px, pixels_left(row, px, 2), _mm_movemask_pd(interior),
+                          _mm_movemask_pd(active), &queue, pixels, stats);
+  }
+
+  if (!REFILL)
+  {
+    return;
+  }
+
+  lanes.refill(row, 0, 0, &queue, pixels, stats);
+  auto c_re = _mm_load_pd(lanes.c_re);
+  auto x = _mm_load_pd(lanes.x);
+  auto y = _mm_load_pd(lanes.y);
+  auto x_saved = _mm_load_pd(lanes.x_saved);
+  auto y_saved = _mm_load_pd(lanes.y_saved);
+  auto n = _mm_load_pd(lanes.n);
+  auto next_save = _mm_load_pd(lanes.next_save);
+  auto next_event = CYCLES ? _mm_min_pd(next_save, v_max_iter) : v_max_iter;
+  while (lanes.occupied)
+  {
+    auto x2 = _mm_mul_pd(x, x);
+    auto y2 = _mm_mul_pd(y, y);
+    auto escaped = _mm_cmpnlt_pd(_mm_add_pd(x2, y2), v_four);
+    auto periodic = _mm_setzero_pd();
+    if (!(_mm_movemask_pd(escaped) & lanes.occupied))
+    {
+      for (;;)
+      {
+        y = _mm_add_pd(_mm_mul_pd(_mm_add_pd(x, x), y), v_c_im);
+        x = _mm_add_pd(_mm_sub_pd(x2, y2), c_re);
+        n = _mm_add_pd(n, v_one);
+        x2 = _mm_mul_pd(x, x);
+        y2 = _mm_mul_pd(y, y);
+
+        escaped = _mm_cmpnlt_pd(_mm_add_pd(x2, y2), v_four);
+        if (CYCLES)
+        {
+          periodic = _mm_and_pd(_mm_cmpeq_pd(x, x_saved), _mm_cmpeq_pd(y, y_saved));
+        }
+        const auto stop = _mm_or_pd(_mm_or_pd(escaped, periodic), _mm_cmpeq_pd(n, next_event));
+        if (_mm_movemask_pd(stop) & lanes.occupied)
+        {
+          break;
+        }
+      }
+    }
+
+    // Events: escaped, periodic or max_iter reached, save z
+    const auto finished = _mm_movemask_pd(_mm_or_pd(_mm_or_pd(escaped, periodic), _mm_cmpeq_pd(n, v_max_iter)));
+    if (CYCLES)
+    {
+      const auto save = _mm_cmpeq_pd(n, next_save);
+      x_saved = _mm_or_pd(_mm_andnot_pd(save, x_saved), _mm_and_pd(save, x));
+      y_saved = _mm_or_pd(_mm_andnot_pd(save, y_saved), _mm_and_pd(save, y));
+      next_save = _mm_add_pd(next_save, _mm_and_pd(save, next_save));
+      next_event = _mm_min_pd(next_save, v_max_iter);
+    }
+    if (finished & lanes.occupied)
+    {
+      _mm_store_pd(lanes.x, x);
+      _mm_store_pd(lanes.y, y);
+      _mm_store_pd(lanes.x_saved, x_saved);
+      _mm_store_pd(lanes.y_saved, y_saved);
+      _mm_store_pd(lanes.n, n);
+      _mm_store_pd(lanes.next_save, next_save);
+      lanes.refill(row, finished & lanes.occupied, _mm_movemask_pd(periodic), &queue, pixels, stats);
+      c_re = _mm_load_pd(lanes.c_re);
+      x = _mm_load_pd(lanes.x);
+      y = _mm_load_pd(lanes.y);
+      x_saved = _mm_load_pd(lanes.x_saved);
+      y_saved = _mm_load_pd(lanes.y_saved);
+      n = _mm_load_pd(lanes.n);
+      next_save = _mm_load_pd(lanes.next_save);
+      next_event = CYCLES ? _mm_min_pd(next_save, v_max_iter) : v_max_iter;
+    }
+  }
+}
+
+template<bool REFILL, bool CYCLES>
+TARGET("avx2")
+void row_avx2_impl(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  const auto v_four      = _mm256_set1_pd(4.0);
+  const auto v_one       = _mm256_set1_pd(1.0);
+  const auto v_all       = _mm256_cmp_pd(v_one, v_one, _CMP_EQ_OQ);
+  const auto v_lane      = _mm256_mul_pd(_mm256_set_pd(3.0, 2.0, 1.0, 0.0), _mm256_set1_pd(row.px_step));
+  const auto v_min_re    = _mm256_set1_pd(row.min_re);
+  const auto v_dx        = _mm256_set1_pd(row.dx);
+  const auto v_c_im      = _mm256_set1_pd(row.c_im);
+  const auto v_margin    = _mm256_set1_pd(INTERIOR_MARGIN);
+  const auto v_c_im2     = _mm256_set1_pd(row.c_im * row.c_im);
+  const auto v_c_im2_4   = _mm256_set1_pd(0.25 * (row.c_im * row.c_im));
+  const auto v_quarter   = _mm256_set1_pd(0.25);
+  const auto v_sixteenth = _mm256_set1_pd(0.0625);
+  const auto v_max_iter  = _mm256_set1_pd(row.max_iter);
+
+  Lanes<4> lanes;
+  RefillQueue queue;
+  queue.next = 0;
+  const auto lockstep_iter = REFILL ? std::min(row.max_iter, LOCKSTEP_ITER) : row.max_iter;
+  for (auto px = row.px_begin; px < row.px_end; px += 4 * row.px_step)
+  {
+    const auto v_px = _mm256_add_pd(_mm256_set1_pd(px), v_lane);
+    const auto c_re = _mm256_add_pd(v_min_re, _mm256_mul_pd(v_px, v_dx));
+
+    // Main cardioid and period-2 bulb, @see in_cardioid_or_bulb
+    const auto xq = _mm256_sub_pd(c_re, v_quarter);
+    const auto q = _mm256_add_pd(_mm256_mul_pd(xq, xq), v_c_im2);
+    const auto cardioid = _mm256_cmp_pd(_mm256_add_pd(_mm256_mul_pd(q, _mm256_add_pd(q, xq)), v_margin),
+                                        v_c_im2_4,
+                                        _CMP_LT_OQ);
+    const auto xb = _mm256_add_pd(c_re, v_one);
+    const auto bulb = _mm256_cmp_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(xb, xb), v_c_im2), v_margin),
+                                    v_sixteenth,
+                                    _CMP_LT_OQ);
+    auto interior = _mm256_or_pd(cardioid, bulb);
+    auto active = _mm256_andnot_pd(interior, v_all);
+
+    auto x = _mm256_setzero_pd();
+    auto y = _mm256_setzero_pd();
+    auto n = _mm256_setzero_pd();
+    auto x_saved = _mm256_setzero_pd();
+    auto y_saved = _mm256_setzero_pd();
+    auto next_save = 1ll;
+    for (auto i = 0; i < lockstep_iter; i++)
+    {
+      const auto x2 = _mm256_mul_pd(x, x);
+      const auto y2 = _mm256_mul_pd(y, y);
+      active = _mm256_and_pd(active, _mm256_cmp_pd(_mm256_add_pd(x2, y2), v_four, _CMP_LT_OQ));
+      if (_mm256_movemask_pd(active) == 0)
+      {
+        break;
+      }
+      n = _mm256_add_pd(n, _mm256_and_pd(active, v_one));
+      y = _mm256_add_pd(_mm256_mul_pd(_mm256_add_pd(x, x), y), v_c_im);
+      x = _mm256_add_pd(_mm256_sub_pd(x2, y2), c_re);
+
+      if (CYCLES)
+      {
+        const auto same = _mm256_and_pd(_mm256_cmp_pd(x, x_saved, _CMP_EQ_OQ),
+                                        _mm256_cmp_pd(y, y_saved, _CMP_EQ_OQ));
+        const auto periodic = _mm256_and_pd(active, same);
+        interior = _mm256_or_pd(interior, periodic);
+        active = _mm256_andnot_pd(periodic, active);
+        if (i + 1 == next_save)
+        {
+          x_saved = x;
+          y_saved = y;
+          next_save *= 2;
+        }
+      }
+    }
+
+    _mm256_store_pd(lanes.c_re, c_re);
+    _mm256_store_pd(lanes.x, x);
+    _mm256_store_pd(lanes.y, y);
+    _mm256_store_pd(lanes.x_saved, x_saved);
+    _mm256_store_pd(lanes.y_saved, y_saved);
+    _mm256_store_pd(lanes.n, n);
+    lanes.finish_lockstep(row, px, pixels_left(row, px, 4), _mm256_movemask_pd(interior),
+                          _mm256_movemask_pd(active), &queue, pixels, stats);
+  }
+
+  if (!REFILL)
+  {
+    return;
+  }
+
+  lanes.refill(row, 0, 0, &queue, pixels, stats);
+  auto c_re = _mm256_load_pd(lanes.c_re);
+  auto x = _mm256_load_pd(lanes.x);
+  auto y = _mm256_load_pd(lanes.y);
+  auto x_saved = _mm256_load_pd(lanes.x_saved);
+  auto y_saved = _mm256_load_pd(lanes.y_saved);
+  auto n = _mm256_load_pd(lanes.n);
+  auto next_save = _mm256_load_pd(lanes.next_save);
+  auto next_event = CYCLES ? _mm256_min_pd(next_save, v_max_iter) : v_max_iter;
+  while (lanes.occupied)
+  {
+    auto x2 = _mm256_mul_pd(x, x);
+    auto y2 = _mm256_mul_pd(y, y);
+    auto escaped = _mm256_cmp_pd(_mm256_add_pd(x2, y2), v_four, _CMP_NLT_UQ);
+    auto periodic = _mm256_setzero_pd();
+    if (!(_mm256_movemask_pd(escaped) & lanes.occupied))
+    {
+      for (;;)
+      {
+        y = _mm256_add_pd(_mm256_mul_pd(_mm256_add_pd(x, x), y), v_c_im);
+        x = _mm256_add_pd(_mm256_sub_pd(x2, y2), c_re);
+        n = _mm256_add_pd(n, v_one);
+        x2 = _mm256_mul_pd(x, x);
+        y2 = _mm256_mul_pd(y, y);
+
+        escaped = _mm256_cmp_pd(_mm256_add_pd(x2, y2), v_four, _CMP_NLT_UQ);
+        if (CYCLES)
+        {
+          periodic = _mm256_and_pd(_mm256_cmp_pd(x, x_saved, _CMP_EQ_OQ),
+                                   _mm256_cmp_pd(y, y_saved, _CMP_EQ_OQ));
+        }
+        const auto stop = _mm256_or_pd(_mm256_or_pd(escaped, periodic),
+                                       _mm256_cmp_pd(n, next_event, _CMP_EQ_OQ));
+        if (_mm256_movemask_pd(stop) & lanes.occupied)
+        {
+          break;
+        }
+      }
+    }
+
+    // Events: escaped, periodic or max_iter reached, save z
+    const auto finished = _mm256_movemask_pd(_mm256_or_pd(_mm256_or_pd(escaped, periodic),
+                                                          _mm256_cmp_pd(n, v_max_iter, _CMP_EQ_OQ)));
+    if (CYCLES)
+    {
+      const auto save = _mm256_cmp_pd(n, next_save, _CMP_EQ_OQ);
+      x_saved = _mm256_blendv_pd(x_saved, x, save);
+      y_saved = _mm256_blendv_pd(y_saved, y, save);
+      next_save = _mm256_add_pd(next_save, _mm256_and_pd(save, next_save));
+      next_event = _mm256_min_pd(next_save, v_max_iter);
+    }
+    if (finished & lanes.occupied)
+    {
+      _mm256_store_pd(lanes.x, x);
+      _mm256_store_pd(lanes.y, y);
+      _mm256_store_pd(lanes.x_saved, x_saved);
+      _mm256_store_pd(lanes.y_saved, y_saved);
+      _mm256_store_pd(lanes.n, n);
+      _mm256_store_pd(lanes.next_save, next_save);
+      lanes.refill(row, finished & lanes.occupied, _mm256_movemask_pd(periodic), &queue, pixels, stats);
+      c_re = _mm256_load_pd(lanes.c_re);
+      x = _mm256_load_pd(lanes.x);
+      y = _mm256_load_pd(lanes.y);
+      x_saved = _mm256_load_pd(lanes.x_saved);
+      y_saved = _mm256_load_pd(lanes.y_saved);
+      n = _mm256_load_pd(lanes.n);
+      next_save = _mm256_load_pd(lanes.next_save);
+      next_event = CYCLES ? _mm256_min_pd(next_save, v_max_iter) : v_max_iter;
+    }
+  }
+}
+
+template<bool REFILL, bool CYCLES>
+TARGET("avx512f")
+void row_avx512_impl(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  const auto v_four      = _mm512_set1_pd(4.0);
+  const auto v_one       = _mm512_set1_pd(1.0);
+  const auto v_lane      = _mm512_mul_pd(_mm512_set_pd(7.0, 6.0, 5.0, 4.0, 3.0, 2.0, 1.0, 0.0),
+                                         _mm512_set1_pd(row.px_step));
+  const auto v_min_re    = _mm512_set1_pd(row.min_re);
+  const auto v_dx        = _mm512_set1_pd(row.dx);
+  const auto v_c_im      = _mm512_set1_pd(row.c_im);
+  const auto v_margin    = _mm512_set1_pd(INTERIOR_MARGIN);
+  const auto v_c_im2     = _mm512_set1_pd(row.c_im * row.c_im);
+  const auto v_c_im2_4   = _mm512_set1_pd(0.25 * (row.c_im * row.c_im));
+  const auto v_quarter   = _mm512_set1_pd(0.25);
+  const auto v_sixteenth = _mm512_set1_pd(0.0625);
+  const auto v_max_iter  = _mm512_set1_pd(row.max_iter);
+
+  Lanes<8> lanes;
+  RefillQueue queue;
+  queue.next = 0;
+  const auto lockstep_iter = REFILL ? std::min(row.max_iter, LOCKSTEP_ITER) : row.max_iter;
+  for (auto px = row.px_begin; px < row.px_end; px += 8 * row.px_step)
+  {
+    const auto v_px = _mm512_add_pd(_mm512_set1_pd(px), v_lane);
+    const auto c_re = _mm512_add_pd(v_min_re, _mm512_mul_pd(v_px, v_dx));
+
+    // Main cardioid and period-2 bulb, @see in_cardioid_or_bulb
+    const auto xq = _mm512_sub_pd(c_re, v_quarter);
+    const auto q = _mm512_add_pd(_mm512_mul_pd(xq, xq), v_c_im2);
+    const auto cardioid = _mm512_cmp_pd_mask(_mm512_add_pd(_mm512_mul_pd(q, _mm512_add_pd(q, xq)), v_margin),
+                                             v_c_im2_4,
+                                             _CMP_LT_OQ);
+    const auto xb = _mm512_add_pd(c_re, v_one);
+    const auto bulb = _mm512_cmp_pd_mask(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(xb, xb), v_c_im2), v_margin),
+                                         v_sixteenth,
+                                         _CMP_LT_OQ);
+    __mmask8 interior = cardioid | bulb;
+    __mmask8 active = ~interior;
+
+    auto x = _mm512_setzero_pd();
+    auto y = _mm512_setzero_pd();
+    auto n = _mm512_setzero_pd();
+    auto x_saved = _mm512_setzero_pd();
+    auto y_saved = _mm512_setzero_pd();
+    auto next_save = 1ll;
+    for (auto i = 0; i < lockstep_iter; i++)
+    {
+      const auto x2 = _mm512_mul_pd(x, x);
+      const auto y2 = _mm512_mul_pd(y, y);
+      active = _mm512_mask_cmp_pd_mask(active, _mm512_add_pd(x2, y2), v_four, _CMP_LT_OQ);
+      if (active == 0)
+      {
+        break;
+      }
+      n = _mm512_mask_add_pd(n, active, n, v_one);
+      y = _mm512_add_pd(_mm512_mul_pd(_mm512_add_pd(x, x), y), v_c_im);
+      x = _mm512_add_pd(_mm512_sub_pd(x2, y2), c_re);
+
+      if (CYCLES)
+      {
+        const __mmask8 periodic = _mm512_mask_cmp_pd_mask(_mm512_mask_cmp_pd_mask(active, x, x_saved, _CMP_EQ_OQ),
+                                                          y,
+                                                          y_saved,
+                                                          _CMP_EQ_OQ);
+        interior |= periodic;
+        active &= ~periodic;
+        if (i + 1 == next_save)
+        {
+          x_saved = x;
+          y_saved = y;
+          next_save *= 2;
+        }
+      }
+    }
+
+    _mm512_store_pd(lanes.c_re, c_re);
+    _mm512_store_pd(lanes.x, x);
+    _mm512_store_pd(lanes.y, y);
+    _mm512_store_pd(lanes.x_saved, x_saved);
+    _mm512_store_pd(lanes.y_saved, y_saved);
+    _mm512_store_pd(lanes.n, n);
+    lanes.finish_lockstep(row, px, pixels_left(row, px, 8), interior, active, &queue, pixels, stats);
+  }
+
+  if (!REFILL)
+  {
+    return;
+  }
+
+  lanes.refill(row, 0, 0, &queue, pixels, stats);
+  auto c_re = _mm512_load_pd(lanes.c_re);
+  auto x = _mm512_load_pd(lanes.x);
+  auto y = _mm512_load_pd(lanes.y);
+  auto x_saved = _mm512_load_pd(lanes.x_saved);
+  auto y_saved = _mm512_load_pd(lanes.y_saved);
+  auto n = _mm512_load_pd(lanes.n);
+  auto next_save = _mm512_load_pd(lanes.next_save);
+  // min(next_save, max_iter) with a blend, GCC warns about the undefined
+  // vector that _mm512_min_pd() passes to the masked instruction
+  auto next_event = CYCLES ? _mm512_mask_blend_pd(_mm512_cmp_pd_mask(next_save, v_max_iter, _CMP_LT_OQ),
+                                                  v_max_iter,
+                                                  next_save)
+                           : v_max_iter;
+  while (lanes.occupied)
+  {
+    auto x2 = _mm512_mul_pd(x, x);
+    auto y2 = _mm512_mul_pd(y, y);
+    __mmask8 escaped = _mm512_cmp_pd_mask(_mm512_add_pd(x2, y2), v_four, _CMP_NLT_UQ);
+    __mmask8 periodic = 0;
+    if (!(escaped & lanes.occupied))
+    {
+      for (;;)
+      {
+        y = _mm512_add_pd(_mm512_mul_pd(_mm512_add_pd(x, x), y), v_c_im);
+        x = _mm512_add_pd(_mm512_sub_pd(x2, y2), c_re);
+        n = _mm512_add_pd(n, v_one);
+        x2 = _mm512_mul_pd(x, x);
+        y2 = _mm512_mul_pd(y, y);
+
+        escaped = _mm512_cmp_pd_mask(_mm512_add_pd(x2, y2), v_four, _CMP_NLT_UQ);
+        if (CYCLES)
+        {
+          periodic = _mm512_mask_cmp_pd_mask(_mm512_cmp_pd_mask(x, x_saved, _CMP_EQ_OQ), y, y_saved, _CMP_EQ_OQ);
+        }
+        const auto stop = escaped | periodic | _mm512_cmp_pd_mask(n, next_event, _CMP_EQ_OQ);
+        if (stop & lanes.occupied)
+        {
+          break;
+        }
+      }
+    }
+
+    // Events: escaped, periodic or max_iter reached, save z
+    const auto finished = escaped | periodic | _mm512_cmp_pd_mask(n, v_max_iter, _CMP_EQ_OQ);
+    if (CYCLES)
+    {
+      const auto save = _mm512_cmp_pd_mask(n, next_save, _CMP_EQ_OQ);
+      x_saved = _mm512_mask_mov_pd(x_saved, save, x);
+      y_saved = _mm512_mask_mov_pd(y_saved, save, y);
+      next_save = _mm512_mask_add_pd(next_save, save, next_save, next_save);
+      next_event = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(next_save, v_max_iter, _CMP_LT_OQ), v_max_iter, next_save);
+    }
+    if (finished & lanes.occupied)
+    {
+      _mm512_store_pd(lanes.x, x);
+      _mm512_store_pd(lanes.y, y);
+      _mm512_store_pd(lanes.x_saved, x_saved);
+      _mm512_store_pd(lanes.y_saved, y_saved);
+      _mm512_store_pd(lanes.n, n);
+      _mm512_store_pd(lanes.next_save, next_save);
+      lanes.refill(row, finished & lanes.occupied, periodic, &queue, pixels, stats);
+      c_re = _mm512_load_pd(lanes.c_re);
+      x = _mm512_load_pd(lanes.x);
+      y = _mm512_load_pd(lanes.y);
+      x_saved = _mm512_load_pd(lanes.x_saved);
+      y_saved = _mm512_load_pd(lanes.y_saved);
+      n = _mm512_load_pd(lanes.n);
+      next_save = _mm512_load_pd(lanes.next_save);
+      next_event = CYCLES ? _mm512_mask_blend_pd(_mm512_cmp_pd_mask(next_save, v_max_iter, _CMP_LT_OQ),
+                                                 v_max_iter,
+                                                 next_save)
+                          : v_max_iter;
+    }
+  }
+}
+
+// The kernels are declared in the header without the target attribute, which
+// GCC then ignores on their definitions, so they forward to the implementations
+
+template<bool REFILL, bool CYCLES>
+void row_sse2(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  row_sse2_impl<REFILL, CYCLES>(row, pixels, stats);
+}
+
+template<bool REFILL, bool CYCLES>
+void row_avx2(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  row_avx2_impl<REFILL, CYCLES>(row, pixels, stats);
+}
+
+template<bool REFILL, bool CYCLES>
+void row_avx512(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  row_avx512_impl<REFILL, CYCLES>(row, pixels, stats);
+}
+
+// The single precision kernels check the main cardioid and period-2 bulb in
+// double precision, per lane, since a margin for single precision rounding
+// errors would have to be large. The iteration count is kept in integer lanes.
+
+namespace
+{
+  // Returns a bitmask of the lanes whose (single precision) c is inside the
+  // main cardioid or the period-2 bulb, @see in_cardioid_or_bulb
+  int interior_lanes_f32(const float* c_re, int num_lanes, float c_im)
+  {
+    auto interior = 0;
+    for (auto lane = 0; lane < num_lanes; lane++)
+    {
+      if (in_cardioid_or_bulb(c_re[lane], c_im))
+      {
+        interior |= 1 << lane;
+      }
+    }
+    return interior;
+  }
+}
+
+TARGET("sse2")
+void row_sse2_f32(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  const auto v_four     = _mm_set1_ps(4.0f);
+  const auto v_lane     = _mm_mul_ps(_mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f),
+                                     _mm_set1_ps(static_cast<float>(row.px_step)));
+  const auto v_lane_bit = _mm_set_epi32(8, 4, 2, 1);
+  const auto v_min_re   = _mm_set1_ps(static_cast<float>(row.min_re));
+  const auto v_dx       = _mm_set1_ps(static_cast<float>(row.dx));
+  const auto c_im       = static_cast<float>(row.c_im);
+  const auto v_c_im     = _mm_set1_ps(c_im);
+
+  for (auto px = row.px_begin; px < row.px_end; px += 4 * row.px_step)
+  {
+    const auto v_px = _mm_add_ps(_mm_set1_ps(static_cast<float>(px)), v_lane);
+    const auto c_re = _mm_add_ps(v_min_re, _mm_mul_ps(v_px, v_dx));
+
+    alignas(16) float c_re_lanes[4];
+    _mm_store_ps(c_re_lanes, c_re);
+    const auto v_interior_bits = _mm_set1_epi32(interior_lanes_f32(c_re_lanes, 4, c_im));
+    auto interior = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(v_interior_bits, v_lane_bit), v_lane_bit));
+    auto active = _mm_andnot_ps(interior, _mm_castsi128_ps(_mm_set1_epi32(-1)));
+
+    auto x = _mm_setzero_ps();
+    auto y = _mm_setzero_ps();
+    auto n = _mm_setzero_si128();
+    auto x_saved = _mm_setzero_ps();
+    auto y_saved = _mm_setzero_ps();
+    auto next_save = 1ll;
+    for (auto i = 0; i < row.max_iter; i++)
+    {
+      const auto x2 = _mm_mul_ps(x, x);
+      const auto y2 = _mm_mul_ps(y, y);
+      active = _mm_and_ps(active, _mm_cmplt_ps(_mm_add_ps(x2, y2), v_four));
+      if (_mm_movemask_ps(active) == 0)
+      {
+        break;
+      }
+      n = _mm_sub_epi32(n, _mm_castps_si128(active));  // active lanes are -1
+      y = _mm_add_ps(_mm_mul_ps(_mm_add_ps(x, x), y), v_c_im);
+      x = _mm_add_ps(_mm_sub_ps(x2, y2), c_re);
+
+      const auto same = _mm_and_ps(_mm_cmpeq_ps(x, x_saved), _mm_cmpeq_ps(y, y_saved));
+      const auto periodic = _mm_and_ps(active, same);
+      interior = _mm_or_ps(interior, periodic);
+      active = _mm_andnot_ps(periodic, active);
+      if (i + 1 == next_save)
+      {
+        x_saved = x;
+        y_saved = y;
+        next_save *= 2;
+      }
+    }
+
+    alignas(16) std::int32_t lanes[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), n);
+    store_lanes(lanes, _mm_movemask_ps(interior), pixels_left(row, px, 4), row.max_iter, &pixels, stats);
+  }
+}
+
+TARGET("avx2")
+void row_avx2_f32(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  const auto v_four     = _mm256_set1_ps(4.0f);
+  const auto v_lane     = _mm256_mul_ps(_mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f),
+                                        _mm256_set1_ps(static_cast<float>(row.px_step)));
+  const auto v_lane_bit = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+  const auto v_min_re   = _mm256_set1_ps(static_cast<float>(row.min_re));
+  const auto v_dx       = _mm256_set1_ps(static_cast<float>(row.dx));
+  const auto c_im       = static_cast<float>(row.c_im);
+  const auto v_c_im     = _mm256_set1_ps(c_im);
+
+  for (auto px = row.px_begin; px < row.px_end; px += 8 * row.px_step)
+  {
+    const auto v_px = _mm256_add_ps(_mm256_set1_ps(static_cast<float>(px)), v_lane);
+    const auto c_re = _mm256_add_ps(v_min_re, _mm256_mul_ps(v_px, v_dx));
+
+    alignas(32) float c_re_lanes[8];
+    _mm256_store_ps(c_re_lanes, c_re);
+    const auto v_interior_bits = _mm256_set1_epi32(interior_lanes_f32(c_re_lanes, 8, c_im));
+    auto interior = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(v_interior_bits, v_lane_bit),
+                                                           v_lane_bit));
+    auto active = _mm256_andnot_ps(interior, _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+
+    auto x = _mm256_setzero_ps();
+    auto y = _mm256_setzero_ps();
+    auto n = _mm256_setzero_si256();
+    auto x_saved = _mm256_setzero_ps();
+    auto y_saved = _mm256_setzero_ps();
+    auto next_save = 1ll;
+    for (auto i = 0; i < row.max_iter; i++)
+    {
+      const auto x2 = _mm256_mul_ps(x, x);
+      const auto y2 = _mm256_mul_ps(y, y);
+      active = _mm256_and_ps(active, _mm256_cmp_ps(_mm256_add_ps(x2, y2), v_four, _CMP_LT_OQ));
+      if (_mm256_movemask_ps(active) == 0)
+      {
+        break;
+      }
+      n = _mm256_sub_epi32(n, _mm256_castps_si256(active));  // active lanes are -1
+      y = _mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(x, x), y), v_c_im);
+      x = _mm256_add_ps(_mm256_sub_ps(x2, y2), c_re);
+
+      const auto same = _mm256_and_ps(_mm256_cmp_ps(x, x_saved, _CMP_EQ_OQ),
+                                      _mm256_cmp_ps(y, y_saved, _CMP_EQ_OQ));
+      const auto periodic = _mm256_and_ps(active, same);
+      interior = _mm256_or_ps(interior, periodic);
+      active = _mm256_andnot_ps(periodic, active);
+      if (i + 1 == next_save)
+      {
+        x_saved = x;
+        y_saved = y;
+        next_save *= 2;
+      }
+    }
+
+    alignas(32) std::int32_t lanes[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), n);
+    store_lanes(lanes, _mm256_movemask_ps(interior), pixels_left(row, px, 8), row.max_iter, &pixels, stats);
+  }
+}
+
+TARGET("avx512f")
+void row_avx512_f32(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  const auto v_four   = _mm512_set1_ps(4.0f);
+  const auto v_one    = _mm512_set1_epi32(1);
+  const auto v_lane   = _mm512_mul_ps(_mm512_set_ps(15.0f, 14.0f, 13.0f, 12.0f, 11.0f, 10.0f, 9.0f, 8.0f,
+                                                    7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f),
+                                      _mm512_set1_ps(static_cast<float>(row.px_step)));
+  const auto v_min_re = _mm512_set1_ps(static_cast<float>(row.min_re));
+  const auto v_dx     = _mm512_set1_ps(static_cast<float>(row.dx));
+  const auto c_im     = static_cast<float>(row.c_im);
+  const auto v_c_im   = _mm512_set1_ps(c_im);
+
+  for (auto px = row.px_begin; px < row.px_end; px += 16 * row.px_step)
+  {
+    const auto v_px = _mm512_add_ps(_mm512_set1_ps(static_cast<float>(px)), v_lane);
+    const auto c_re = _mm512_add_ps(v_min_re, _mm512_mul_ps(v_px, v_dx));
+
+    alignas(64) float c_re_lanes[16];
+    _mm512_store_ps(c_re_lanes, c_re);
+    __mmask16 interior = interior_lanes_f32(c_re_lanes, 16, c_im);
+    __mmask16 active = ~interior;
+
+    auto x = _mm512_setzero_ps();
+    auto y = _mm512_setzero_ps();
+    auto n = _mm512_setzero_si512();
+    auto x_saved = _mm512_setzero_ps();
+    auto y_saved = _mm512_setzero_ps();
+    auto next_save = 1ll;
+    for (auto i = 0; i < row.max_iter; i++)
+    {
+      const auto x2 = _mm512_mul_ps(x, x);
+      const auto y2 = _mm512_mul_ps(y, y);
+      active = _mm512_mask_cmp_ps_mask(active, _mm512_add_ps(x2, y2), v_four, _CMP_LT_OQ);
+      if (active == 0)
+      {
+        break;
+      }
+      n = _mm512_mask_add_epi32(n, active, n, v_one);
+      y = _mm512_add_ps(_mm512_mul_ps(_mm512_add_ps(x, x), y), v_c_im);
+      x = _mm512_add_ps(_mm512_sub_ps(x2, y2), c_re);
+
+      const __mmask16 periodic = _mm512_mask_cmp_ps_mask(_mm512_mask_cmp_ps_mask(active, x, x_saved, _CMP_EQ_OQ),
+                                                         y,
+                                                         y_saved,
+                                                         _CMP_EQ_OQ);
+      interior |= periodic;
+      active &= ~periodic;
+      if (i + 1 == next_save)
+      {
+        x_saved = x;
+        y_saved = y;
+        next_save *= 2;
+      }
+    }
+
+    alignas(64) std::int32_t lanes[16];
+    _mm512_store_si512(lanes, n);
+    store_lanes(lanes, interior, pixels_left(row, px, 16), row.max_iter, &pixels, stats);
+  }
+}
+
+// The points kernels load and store whole vectors of points, the last
+// (partial) vector is copied to and from local arrays, padded with c = 0
+// which is periodic after one iteration. Like in the row kernels, lanes that
+// are done keep iterating, so their z is only valid for points that reached
+// max_iter, which are the only ones that can be continued.
+
+namespace
+{
+  template<int N>
+  struct PointLanes
+  {
+    alignas(64) double c_re[N];
+    alignas(64) double c_im[N];
+    alignas(64) double x[N];
+    alignas(64) double y[N];
+    alignas(64) double x_saved[N];
+    alignas(64) double y_saved[N];
+    alignas(64) double n[N];
+    int periodic;
+
+    void load(const Points& points, int i, int num_lanes)
+    {
+      for (auto lane = 0; lane < N; lane++)
+      {
+        const auto valid = lane < num_lanes;
+        c_re[lane]    = valid ? points.c_re[i + lane] : 0.0;
+        c_im[lane]    = valid ? points.c_im[i + lane] : 0.0;
+        x[lane]       = valid ? points.x[i + lane] : 0.0;
+        y[lane]       = valid ? points.y[i + lane] : 0.0;
+        x_saved[lane] = valid ? points.x_saved[i + lane] : 0.0;
+        y_saved[lane] = valid ? points.y_saved[i + lane] : 0.0;
+      }
+    }
+
+    void store(const Points& points, int i, int num_lanes, Stats* stats) const
+    {
+      for (auto lane = 0; lane < num_lanes; lane++)
+      {
+        const auto lane_n = static_cast<int>(n[lane]);
+        points.x[i + lane] = x[lane];
+        points.y[i + lane] = y[lane];
+        points.x_saved[i + lane] = x_saved[lane];
+        points.y_saved[i + lane] = y_saved[lane];
+        stats->iterations += lane_n - points.n_begin;
+        if (periodic & (1 << lane))
+        {
+          stats->iterations_skipped += points.max_iter - lane_n;
+          points.n[i + lane] = -1;
+        }
+        else
+        {
+          points.n[i + lane] = lane_n;
+        }
+      }
+    }
+  };
+}
+
+TARGET("avx2")
+void points_avx2(const Points& points, Stats* stats)
+{
+  const auto v_four = _mm256_set1_pd(4.0);
+  const auto v_one  = _mm256_set1_pd(1.0);
+  const auto v_all  = _mm256_cmp_pd(v_one, v_one, _CMP_EQ_OQ);
+
+  PointLanes<4> lanes;
+  for (auto i = 0; i < points.count; i += 4)
+  {
+    const auto num_lanes = std::min(4, points.count - i);
+    lanes.load(points, i, num_lanes);
+
+    const auto c_re = _mm256_load_pd(lanes.c_re);
+    const auto c_im = _mm256_load_pd(lanes.c_im);
+    auto x = _mm256_load_pd(lanes.x);
+    auto y = _mm256_load_pd(lanes.y);
+    auto x_saved = _mm256_load_pd(lanes.x_saved);
+    auto y_saved = _mm256_load_pd(lanes.y_saved);
+    auto n = _mm256_set1_pd(points.n_begin);
+    auto active = v_all;
+    auto periodic_lanes = _mm256_setzero_pd();
+    auto next_save = next_save_after(points.n_begin);
+    for (auto j = points.n_begin; j < points.max_iter; j++)
+    {
+      const auto x2 = _mm256_mul_pd(x, x);
+      const auto y2 = _mm256_mul_pd(y, y);
+      active = _mm256_and_pd(active, _mm256_cmp_pd(_mm256_add_pd(x2, y2), v_four, _CMP_LT_OQ));
+      if (_mm256_movemask_pd(active) == 0)
+      {
+        break;
+      }
+
+      n = _mm256_add_pd(n, _mm256_and_pd(active, v_one));
+      y = _mm256_add_pd(_mm256_mul_pd(_mm256_add_pd(x, x), y), c_im);
+      x = _mm256_add_pd(_mm256_sub_pd(x2, y2), c_re);
+
+      const auto same = _mm256_and_pd(_mm256_cmp_pd(x, x_saved, _CMP_EQ_OQ),
+                                      _mm256_cmp_pd(y, y_saved, _CMP_EQ_OQ));
+      const auto periodic = _mm256_and_pd(active, same);
+      periodic_lanes = _mm256_or_pd(periodic_lanes, periodic);
+      active = _mm256_andnot_pd(periodic, active);
+      if (j + 1 == next_save)
+      {
+        x_saved = x;
+        y_saved = y;
+        next_save *= 2;
+      }
+    }
+
+    _mm256_store_pd(lanes.x, x);
+    _mm256_store_pd(lanes.y, y);
+    _mm256_store_pd(lanes.x_saved, x_saved);
+    _mm256_store_pd(lanes.y_saved, y_saved);
+    _mm256_store_pd(lanes.n, n);
+    lanes.periodic = _mm256_movemask_pd(periodic_lanes);
+    lanes.store(points, i, num_lanes, stats);
+  }
+}
+
+TARGET("avx512f")
+void points_avx512(const Points& points, Stats* stats)
+{
+  const auto v_four = _mm512_set1_pd(4.0);
+  const auto v_one  = _mm512_set1_pd(1.0);
+
+  PointLanes<8> lanes;
+  for (auto i = 0; i < points.count; i += 8)
+  {
+    const auto num_lanes = std::min(8, points.count - i);
+    lanes.load(points, i, num_lanes);
+
+    const auto c_re = _mm512_load_pd(lanes.c_re);
+    const auto c_im = _mm512_load_pd(lanes.c_im);
+    auto x = _mm512_load_pd(lanes.x);
+    auto y = _mm512_load_pd(lanes.y);
+    auto x_saved = _mm512_load_pd(lanes.x_saved);
+    auto y_saved = _mm512_load_pd(lanes.y_saved);
+    auto n = _mm512_set1_pd(points.n_begin);
+    __mmask8 active = 0xff;
+    __mmask8 periodic_lanes = 0;
+    auto next_save = next_save_after(points.n_begin);
+    for (auto j = points.n_begin; j < points.max_iter; j++)
+    {
+      const auto x2 = _mm512_mul_pd(x, x);
+      const auto y2 = _mm512_mul_pd(y, y);
+      active = _mm512_mask_cmp_pd_mask(active, _mm512_add_pd(x2, y2), v_four, _CMP_LT_OQ);
+      if (active == 0)
+      {
+        break;
+      }
+
+      n = _mm512_mask_add_pd(n, active, n, v_one);
+      y = _mm512_add_pd(_mm512_mul_pd(_mm512_add_pd(x, x), y), c_im);
+      x = _mm512_add_pd(_mm512_sub_pd(x2, y2), c_re);
+
+      const __mmask8 periodic = _mm512_mask_cmp_pd_mask(_mm512_mask_cmp_pd_mask(active, x, x_saved, _CMP_EQ_OQ),
+                                                        y,
+                                                        y_saved,
+                                                        _CMP_EQ_OQ);
+      periodic_lanes |= periodic;
+      active &= ~periodic;
+      if (j + 1 == next_save)
+      {
+        x_saved = x;
+        y_saved = y;
+        next_save *= 2;
+      }
+    }
+
+    _mm512_store_pd(lanes.x, x);
+    _mm512_store_pd(lanes.y, y);
+    _mm512_store_pd(lanes.x_saved, x_saved);
+    _mm512_store_pd(lanes.y_saved, y_saved);
+    _mm512_store_pd(lanes.n, n);
+    lanes.periodic = periodic_lanes;
+    lanes.store(points, i, num_lanes, stats);
+  }
+}
+
+#if defined(_MSC_VER)
+
+namespace
+{
+  // Returns true if CPUID leaf 7 reports the given EBX bit and the OS saves
+  // the register state given by xcr0_mask
+  bool msvc_cpu_supports(int leaf7_ebx_bit, unsigned long long xcr0_mask)
+  {
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+
+    // OSXSAVE (CPUID.1:ECX bit 27) is required for _xgetbv
+    __cpuid(info, 1);
+    if ((info[2] & (1 << 27)) == 0) return false;
+    if ((_xgetbv(0) & xcr0_mask) != xcr0_mask) return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << leaf7_ebx_bit)) != 0;
+  }
+}
+
+bool cpu_has_sse2()   { return true; }
+bool cpu_has_avx2()   { return msvc_cpu_supports(5, 0x06); }
+bool cpu_has_avx512() { return msvc_cpu_supports(16, 0xe6); }
+
+bool cpu_has_fma()
+{
+  // FMA is CPUID.1:ECX bit 12 and requires OSXSAVE and the AVX register state
+  int info[4];
+  __cpuid(info, 1);
+  if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 12)) == 0) return false;
+  return (_xgetbv(0) & 0x06) == 0x06;
+}
+
+#else
+
+// Note: __builtin_cpu_init() must be called before __builtin_cpu_supports()
+//       if we might be called before constructors have run
+
+bool cpu_has_sse2()   { __builtin_cpu_init(); return __builtin_cpu_supports("sse2"); }
+bool cpu_has_avx2()   { __builtin_cpu_init(); return __builtin_cpu_supports("avx2"); }
+bool cpu_has_avx512() { __builtin_cpu_init(); return __builtin_cpu_supports("avx512f"); }
+bool cpu_has_fma()    { __builtin_cpu_init(); return __builtin_cpu_supports("fma"); }
+
+#endif
+
+#else  // PMP_X86
+
+// Non-x86 hosts: the SIMD kernels are never selected since
+// cpu_has_*() returns false, but they must still be defined
+
+template<bool REFILL, bool CYCLES>
+void row_sse2(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  row_scalar<REFILL, CYCLES>(row, pixels, stats);
+}
+
+template<bool REFILL, bool CYCLES>
+void row_avx2(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  row_scalar<REFILL, CYCLES>(row, pixels, stats);
+}
+
+template<bool REFILL, bool CYCLES>
+void row_avx512(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  row_scalar<REFILL, CYCLES>(row, pixels, stats);
+}
+
+void row_sse2_f32(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  row_scalar_f32(row, pixels, stats);
+}
+
+void row_avx2_f32(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  row_scalar_f32(row, pixels, stats);
+}
+
+void row_avx512_f32(const Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  row_scalar_f32(row, pixels, stats);
+}
+
+void points_avx2(const Points& points, Stats* stats)
+{
+  points_scalar(points, stats);
+}
+
+void points_avx512(const Points& points, Stats* stats)
+{
+  points_scalar(points, stats);
+}
+
+bool cpu_has_sse2()   { return false; }
+bool cpu_has_avx2()   { return false; }
+bool cpu_has_avx512() { return false; }
+bool cpu_has_fma()    { return false; }
+
+#endif  // PMP_X86
+
+// Every variant of the double precision kernels, @see row_scalar
+template void row_scalar<false, false>(const Row& row, std::uint8_t* pixels, Stats* stats);
+template void row_scalar<false, true>(const Row& row, std::uint8_t* pixels, Stats* stats);
+template void row_scalar<true, false>(const Row& row, std::uint8_t* pixels, Stats* stats);
+template void row_scalar<true, true>(const Row& row, std::uint8_t* pixels, Stats* stats);
+template void row_sse2<false, false>(const Row& row, std::uint8_t* pixels, Stats* stats);
+template void row_sse2<false, true>(const Row& row, std::uint8_t* pixels, Stats* stats);
+template void row_sse2<true, false>(const Row& row, std::uint8_t* pixels, Stats* stats);
+template void row_sse2<true, true>(const Row& row, std::uint8_t* pixels, Stats* stats);
+template void row_avx2<false, false>(const Row& row, std::uint8_t* pixels, Stats* stats);
+template void row_avx2<false, true>(const Row& row, std::uint8_t* pixels, Stats* stats);
+template void row_avx2<true, false>(const Row& row, std::uint8_t* pixels, Stats* stats);
+template void row_avx2<true, true>(const Row& row, std::uint8_t* pixels, Stats* stats);
+template void row_avx512<false, false>(const Row& row, std::uint8_t* pixels, Stats* stats);
+template void row_avx512<false, true>(const Row& row, std::uint8_t* pixels, Stats* stats);
+template void row_avx512<true, false>(const Row& row, std::uint8_t* pixels, Stats* stats);
+template void row_avx512<true, true>(const Row& row, std::uint8_t* pixels, Stats* stats);
+
+}
+
+}
@@ -0,0 +1,240 @@
+#ifndef MANDELBROT_KERNELS_H_
+#define MANDELBROT_KERNELS_H_
+
+#include <cstdint>
+
+#include "mandelbrot.h"
+
+namespace Mandelbrot
+{
+
+namespace Kernels
+{
+
+/**
+ * @brief Describes a range of pixels in one image row
+ *
+ * Pixel px in the row corresponds to the complex value (min_re + px * dx, c_im).
+ */
+struct Row
+{
+  double min_re;    /**< Real value of pixel 0 */
+  double dx;        /**< Pixel width in the complex plane */
+  int px_begin;     /**< First pixel to compute */
+  int px_end;       /**< One past the last pixel to compute */
+  int px_step = 1;  /**< Distance between the pixels to compute */
+  double c_im;      /**< Imaginary value of the row */
+  int max_iter;     /**< Maximum number of iterations per pixel */
+};
+
+/**
+ * @brief Gets the number of pixels of a row to compute from pixel px on,
+ *        at most max_pixels
+ */
+inline int pixels_left(const Row& row, int px, int max_pixels)
+{
+  const auto left = (row.px_end - px + row.px_step - 1) / row.px_step;
+  return left < max_pixels ? left : max_pixels;
+}
+
+/**
+ * @brief Computes a range of pixels in one image row
+ *
+ * Pixels row.px_begin, row.px_begin + row.px_step, ... below row.px_end are
+ * written to pixels[0], pixels[1], ... The pixels are exactly the same as
+ * when every pixel is computed: pixel px is always computed from
+ * min_re + px * dx, never by adding up steps.
+ *
+ * All kernels must produce exactly the same pixels as row_scalar.
+ *
+ * @param[in]   row     The pixels to compute
+ * @param[out]  pixels  Pointer to where to write the pixels (8bpp)
+ * @param[out]  stats   Statistics are added to this object
+ */
+using RowKernel = void (*)(const Row& row, std::uint8_t* pixels, Stats* stats);
+
+/**
+ * @brief Double precision kernels
+ *
+ * Every kernel is compiled in variants that leave out features, so that the
+ * iteration loops of a variant have no runtime checks for them:
+ * - REFILL: pixels that are still iterating after a number of iterations
+ *   continue in refilled lanes, without it the whole row is iterated in
+ *   lockstep, which is faster when max_iter is low (not used by row_scalar)
+ * - CYCLES: Brent's cycle detection, which only pays off for points inside
+ *   the set that would otherwise be iterated for long
+ * All variants produce exactly the same pixels: a periodic orbit never
+ * escapes, so without the cycle detection it reaches max_iter and is black
+ * anyway. Only the Stats differ. The generic variant is <true, true>.
+ */
+template<bool REFILL, bool CYCLES>
+void row_scalar(const Row& row, std::uint8_t* pixels, Stats* stats);
+template<bool REFILL, bool CYCLES>
+void row_sse2(const Row& row, std::uint8_t* pixels, Stats* stats);
+template<bool REFILL, bool CYCLES>
+void row_avx2(const Row& row, std::uint8_t* pixels, Stats* stats);
+template<bool REFILL, bool CYCLES>
+void row_avx512(const Row& row, std::uint8_t* pixels, Stats* stats);
+
+/**
+ * @brief Single precision kernels, twice as many pixels per instruction
+ *
+ * The row is rounded to single precision and the pixels are computed as
+ * c_re = float(min_re) + float(px) * float(dx), c_im = float(c_im).
+ * All single precision kernels produce exactly the same pixels as
+ * row_scalar_f32, but not necessarily the same pixels as the double
+ * precision kernels, @see Mandelbrot::compute for when they are used.
+ */
+void row_scalar_f32(const Row& row, std::uint8_t* pixels, Stats* stats);
+void row_sse2_f32(const Row& row, std::uint8_t* pixels, Stats* stats);
+void row_avx2_f32(const Row& row, std::uint8_t* pixels, Stats* stats);
+void row_avx512_f32(const Row& row, std::uint8_t* pixels, Stats* stats);
+
+/**
+ * @brief Describes independent points whose iteration is continued
+ *
+ * Point i has c = (c_re[i], c_im[i]) and has been iterated n_begin times,
+ * giving z = (x[i], y[i]), and (x_saved[i], y_saved[i]) is the z that Brent's
+ * cycle detection saved last. With n_begin = 0 and all zero the points are
+ * iterated from the start. The main cardioid and period-2 bulb test is not
+ * done, the caller does it before the first iteration.
+ *
+ * The points are iterated until they escape, are found to be periodic or have
+ * been iterated max_iter times, and the state is updated. Since the operations
+ * are the same as in the row kernels, the final iteration counts are exactly
+ * the same as if the points had been computed by row_scalar with max_iter.
+ */
+struct Points
+{
+  int count;             /**< Number of points */
+  int n_begin;           /**< Number of iterations already done, for all points */
+  int max_iter;          /**< Maximum number of iterations per point */
+  const double* c_re;    /**< Real value of each point */
+  const double* c_im;    /**< Imaginary value of each point */
+  double* x;             /**< Real value of z */
+  double* y;             /**< Imaginary value of z */
+  double* x_saved;       /**< Real value of the saved z */
+  double* y_saved;       /**< Imaginary value of the saved z */
+  std::int32_t* n;       /**< Output: iteration count, or -1 if the point was
+                              found to be periodic (inside the set) */
+};
+
+/**
+ * @brief Continues the iteration of independent points
+ *
+ * All kernels must produce exactly the same result as points_scalar.
+ * SSE2 has no points kernel, points_scalar is used instead.
+ *
+ * @param[in,out]  points  The points
+ * @param[out]     stats   Statistics are added to this object
+ */
+using PointsKernel = void (*)(const Points& points, Stats* stats);
+
+void points_scalar(const Points& points, Stats* stats);
+void points_avx2(const Points& points, Stats* stats);
+void points_avx512(const Points& points, Stats* stats);
+
+/**
+ * @brief CPU feature flags, detected at runtime
+ */
+bool cpu_has_sse2();
+bool cpu_has_avx2();
+bool cpu_has_avx512();
+bool cpu_has_fma();
+
+/**
+ * @brief Converts an iteration count to a pixel value
+ *
+ * Points that did not escape are black (0), the others get the
+ * iteration count with an implicit modulus 256.
+ */
+inline std::uint8_t to_pixel(int n, int max_iter)
+{
+  return n == max_iter ? 0 : static_cast<std::uint8_t>(n);
+}
+
+/**
+ * @brief Gets the iteration at which Brent's cycle detection saves z next
+ *
+ * z is saved at iteration 1, 2, 4, 8, ... so this is the smallest power of
+ * two larger than n.
+ */
+inline long long next_save_after(int n)
+{
+  auto next_save = 1ll;
+  while (next_save <= n)
+  {
+    next_save *= 2;
+  }
+  return next_save;
+}
+
+/**
+ * @brief Writes the pixels and adds the statistics for one vector of pixels
+ *
+ * Used by the SIMD kernels after the iteration loop.
+ *
+ * @param[in]      n          Iteration count per lane
+ * @param[in]      interior   Bitmask of lanes that were found to be inside the set
+ * @param[in]      num_lanes  Number of lanes that are valid pixels
+ * @param[in]      max_iter   Maximum number of iterations per pixel
+ * @param[in,out]  pixels     Pointer to where to write the pixels, advanced by num_lanes
+ * @param[out]     stats      Statistics are added to this object
+ */
+template<typename T>
+inline void store_lanes(const T* n, int interior, int num_lanes, int max_iter,
+                        std::uint8_t** pixels, Stats* stats)
+{
+  for (auto lane = 0; lane < num_lanes; lane++)
+  {
+    const auto lane_n = static_cast<int>(n[lane]);
+    stats->iterations += lane_n;
+    if (interior & (1 << lane))
+    {
+      stats->iterations_skipped += max_iter - lane_n;
+      *(*pixels)++ = 0;
+    }
+    else
+    {
+      *(*pixels)++ = to_pixel(lane_n, max_iter);
+    }
+  }
+}
+
+// Safety margin for the interior test below, so that rounding errors in the
+// test can never classify a point outside of the set as inside. Points closer
+// than this to the boundary are iterated as usual.
+constexpr double INTERIOR_MARGIN = 1e-9;
+
+/**
+ * @brief Checks if a point is inside the main cardioid or the period-2 bulb
+ *
+ * Such points never escape, so they can be set to black without iterating.
+ *
+ * @param[in]  c_re  Real value of the point
+ * @param[in]  c_im  Imaginary value of the point
+ *
+ * @return true if the point is inside the main cardioid or the period-2 bulb
+ */
+inline bool in_cardioid_or_bulb(double c_re, double c_im)
+{
+  const auto y2 = c_im * c_im;
+
+  // Main cardioid: q * (q + (x - 1/4)) < y^2 / 4 where q = (x - 1/4)^2 + y^2
+  const auto xq = c_re - 0.25;
+  const auto q = xq * xq + y2;
+  if (q * (q + xq) + INTERIOR_MARGIN < 0.25 * y2)
+  {
+    return true;
+  }
+
+  // Period-2 bulb: (x + 1)^2 + y^2 < 1/16
+  const auto xb = c_re + 1.0;
+  return xb * xb + y2 + INTERIOR_MARGIN < 0.0625;
+}
+
+}
+
+}
+
+#endif  // MANDELBROT_KERNELS_H_
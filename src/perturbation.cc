@@ -0,0 +1,82 @@
+#include "perturbation.h"
+
+namespace Mandelbrot
+{
+
+namespace Perturbation
+{
+
+Reference::Reference(const FixedPoint& c_re, const FixedPoint& c_im, int max_iter)
+    : m_re(),
+      m_im()
+{
+  auto z_re = FixedPoint();
+  auto z_im = FixedPoint();
+  for (auto n = 0; n <= max_iter; n++)
+  {
+    const auto re = z_re.to_double();
+    const auto im = z_im.to_double();
+    m_re.push_back(re);
+    m_im.push_back(im);
+    if (!(re * re + im * im < 4.0))
+    {
+      break;
+    }
+
+    const auto z_re2 = z_re * z_re;
+    const auto z_im2 = z_im * z_im;
+    z_im = (z_re + z_re) * z_im + c_im;
+    z_re = z_re2 - z_im2 + c_re;
+  }
+}
+
+void row(const Reference& reference, const Kernels::Row& row, std::uint8_t* pixels, Stats* stats)
+{
+  const auto* ref_re = reference.re().data();
+  const auto* ref_im = reference.im().data();
+  const auto last = static_cast<int>(reference.re().size()) - 1;
+  const auto dc_im = row.c_im;
+
+  for (auto px = row.px_begin; px < row.px_end; px += row.px_step)
+  {
+    const auto dc_re = row.min_re + px * row.dx;
+    auto dz_re = 0.0;
+    auto dz_im = 0.0;
+    auto m = 0;  // Index in the reference orbit
+    auto n = 0;
+    while (n < row.max_iter)
+    {
+      const auto z_re = ref_re[m] + dz_re;
+      const auto z_im = ref_im[m] + dz_im;
+      const auto z_abs2 = z_re * z_re + z_im * z_im;
+      if (!(z_abs2 < 4.0))
+      {
+        break;
+      }
+
+      // Rebase, @see Mandelbrot::Perturbation
+      if (m == last || z_abs2 < dz_re * dz_re + dz_im * dz_im)
+      {
+        dz_re = z_re;
+        dz_im = z_im;
+        m = 0;
+      }
+
+      // dz = (2 * Z + dz) * dz + dc
+      const auto t_re = 2.0 * ref_re[m] + dz_re;
+      const auto t_im = 2.0 * ref_im[m] + dz_im;
+      const auto new_dz_re = t_re * dz_re - t_im * dz_im + dc_re;
+      dz_im = t_re * dz_im + t_im * dz_re + dc_im;
+      dz_re = new_dz_re;
+      m += 1;
+      n += 1;
+    }
+
+    stats->iterations += n;
+    *pixels++ = Kernels::to_pixel(n, row.max_iter);
+  }
+}
+
+}
+
+}
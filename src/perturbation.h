@@ -0,0 +1,78 @@
+#ifndef PERTURBATION_H_
+#define PERTURBATION_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "fixed_point.h"
+#include "mandelbrot.h"
+#include "mandelbrot_kernels.h"
+
+namespace Mandelbrot
+{
+
+/**
+ * @brief Deep zoom engine based on perturbation theory
+ *
+ * When the pixel spacing is too small for double precision, one reference
+ * orbit Z_n is computed with high precision for a point C near the image center.
+ * Every pixel c = C + dc is then iterated as a double precision delta from
+ * the reference orbit: z_n = Z_n + dz_n where
+ *
+ *   dz_n+1 = (2 * Z_n + dz_n) * dz_n + dc
+ *
+ * Whenever |z_n| < |dz_n|, or the reference orbit ends because the reference
+ * escaped, the delta would lose precision (a "glitch"). The pixel is then rebased
+ * onto the start of the reference orbit: dz = z and n continues from Z_0 = 0.
+ * This handles glitches without computing additional reference orbits.
+ */
+namespace Perturbation
+{
+
+/**
+ * @brief A reference orbit
+ */
+class Reference
+{
+ public:
+  /**
+   * @brief Computes the reference orbit for the point (c_re, c_im)
+   *
+   * The orbit is computed with the precision of c_re and c_im, and ends
+   * after max_iter iterations or when it escapes.
+   *
+   * @param[in]  c_re      Real value of the reference point
+   * @param[in]  c_im      Imaginary value of the reference point
+   * @param[in]  max_iter  Maximum number of iterations
+   */
+  Reference(const FixedPoint& c_re, const FixedPoint& c_im, int max_iter);
+
+  /**
+   * @brief The orbit Z_0, Z_1, ..., rounded to double precision
+   */
+  const std::vector<double>& re() const { return m_re; }
+  const std::vector<double>& im() const { return m_im; }
+
+ private:
+  std::vector<double> m_re;
+  std::vector<double> m_im;
+};
+
+/**
+ * @brief Computes a range of pixels in one image row
+ *
+ * Same as Kernels::RowKernel except that row.min_re and row.c_im are
+ * relative to the reference point.
+ *
+ * @param[in]   reference  The reference orbit
+ * @param[in]   row        The pixels to compute
+ * @param[out]  pixels     Pointer to where to write the pixels (8bpp)
+ * @param[out]  stats      Statistics are added to this object
+ */
+void row(const Reference& reference, const Kernels::Row& row, std::uint8_t* pixels, Stats* stats);
+
+}
+
+}
+
+#endif  // PERTURBATION_H_
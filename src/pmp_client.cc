@@ -10,6 +10,7 @@
 #include <unordered_map>
 
 #include "tcp_backend.h"
+#include "fixed_point.h"
 #include "protocol.h"
 #include "pgm.h"
 #include "logger.h"
@@ -23,6 +24,10 @@ static struct Arguments
   int image_height;
   int max_iter;
   int divisions;
+  std::uint32_t flags;
+  std::vector<double> center_re;
+  std::vector<double> center_im;
+  std::uint32_t deadline_ms;
 } arguments;
 
 // Queue of Requests, based on arguments and created in main()
@@ -31,15 +36,30 @@ static std::deque<Protocol::Request> request_queue;
 // The final image's pixels (8bpp)
 static std::vector<std::uint8_t> image_pixels;
 
+// Number of requests that were answered with partial pixels because of the deadline
+static int num_partial = 0;
+
 // Represents a session/connection to a server
 struct Session
 {
   std::unique_ptr<TcpBackend::Connection> connection;
   bool request_ongoing;
   Protocol::Request current_request;
-  std::vector<std::uint8_t> current_pixels;
+  std::vector<std::uint8_t> current_pixels;  // The sub-image, filled in as the pixels arrive
+  bool current_partial;  // True if some of the pixels are partial
+  int busy_responses;  // Number of consecutive busy responses
+  int current_pass;  // Pass of the pixels that are received, -1 before the first pixels
+  int current_step;  // Distance between the pixels of the pass
+  int next_x;  // Position in the sub-image of the next pixel of the pass
+  int next_y;
+  std::chrono::steady_clock::time_point time_sent;
 };
 
+// Delay before a request that the server was too busy to accept is sent again,
+// doubled for every consecutive busy response up to MAX_RETRY_DELAY
+static const auto RETRY_DELAY = std::chrono::milliseconds(100);
+static const auto MAX_RETRY_DELAY = std::chrono::milliseconds(3200);
+
 // All Sessions, mapped with an unique id
 static std::unordered_map<int, Session> sessions;
 
@@ -58,13 +78,18 @@ static void send_request(int session_id)
 {
   auto& session = sessions[session_id];
 
-  // Make sure to clear ongoing_pixels
-  session.request_ongoing = true;
-  session.current_pixels.clear();
-
   // Fetch and remove next request from queue
   session.current_request = request_queue.front();
   request_queue.pop_front();
+  session.busy_responses = 0;
+
+  // Make sure to clear ongoing_pixels
+  session.request_ongoing = true;
+  session.current_pixels.assign(static_cast<std::size_t>(session.current_request.image_width) *
+                                session.current_request.image_height, 0u);
+  session.current_partial = false;
+  session.current_pass = -1;
+  session.time_sent = std::chrono::steady_clock::now();
 
   LOG_INFO("Session %d sends request (%.2lf, %.2lf)..(%.2lf, %.2lf) (%d, %d) %d",
            session_id,
@@ -120,13 +145,137 @@ static void on_disconnected(int session_id)
   }
 }
 
+/**
+ * @brief Moves the position of the next pixel of the pass to the first pixel of
+ *        the pass at or after it, in the order the pixels are sent
+ *
+ * @see Protocol::Response for the pixels of each pass
+ *
+ * @param[in]  session  The session
+ */
+static void seek_pass_pixel(Session* session)
+{
+  const auto width = static_cast<int>(session->current_request.image_width);
+  const auto height = static_cast<int>(session->current_request.image_height);
+  while (session->next_y < height)
+  {
+    int x = 0;
+    int x_step = 1;
+    if (Protocol::get_pass_columns(session->next_y, session->current_pass, session->current_step, &x, &x_step))
+    {
+      session->next_x = std::max(session->next_x, x);
+      if (session->next_x < width)
+      {
+        return;
+      }
+    }
+    session->next_x = 0;
+    session->next_y += 1;
+  }
+}
+
+/**
+ * @brief Adds the next pixel of the pass to the sub-image
+ *
+ * The pixel is also copied to the pixels up to the next pixels of the pass to
+ * the right and below it, so the sub-image is complete, but coarse, after each pass.
+ *
+ * @param[in]  session  The session
+ * @param[in]  value    The pixel
+ */
+static void add_pass_pixel(Session* session, std::uint8_t value)
+{
+  const auto width = static_cast<int>(session->current_request.image_width);
+  const auto height = static_cast<int>(session->current_request.image_height);
+  if (session->next_y >= height)
+  {
+    LOG_ERROR("%s: more pixels than the sub-image has", __func__);
+    return;
+  }
+
+  const auto step = session->current_step;
+  const auto columns = std::min(step, width - session->next_x);
+  for (auto y = session->next_y; y < std::min(session->next_y + step, height); y++)
+  {
+    std::fill_n(session->current_pixels.begin() + static_cast<std::size_t>(y) * width + session->next_x,
+                columns,
+                value);
+  }
+
+  int x = 0;
+  int x_step = 1;
+  Protocol::get_pass_columns(session->next_y, session->current_pass, step, &x, &x_step);
+  session->next_x += x_step;
+  seek_pass_pixel(session);
+}
+
+/**
+ * @brief Copies the sub-image of a session to image_pixels, at the correct position
+ *
+ * @param[in]  session  The session
+ */
+static void copy_to_image(const Session& session)
+{
+  // TODO: Simplify this, if possible
+  const auto sub_c = (arguments.max_c - arguments.min_c) / static_cast<double>(arguments.divisions);
+  const auto dx = ((session.current_request.min_c - arguments.min_c) / sub_c.real()).real();
+  const auto dy = ((session.current_request.min_c - arguments.min_c) / sub_c.imag()).imag();
+  auto to = image_pixels.begin() +
+            (session.current_request.image_height * dy * arguments.image_width) +
+            (session.current_request.image_width * dx);
+  auto from = session.current_pixels.begin();
+  for (auto y = 0u; y < session.current_request.image_height; y++)
+  {
+    std::copy(from, from + session.current_request.image_width, to);
+    from += session.current_request.image_width;
+    to += arguments.image_width;
+  }
+}
+
+/**
+ * @brief Writes image_pixels to the image file
+ */
+static void write_image()
+{
+  static const auto filename = std::string("image.pgm");
+  LOG_INFO("Writing image to \"%s\"", filename.c_str());
+  PGM::write_pgm(filename, arguments.image_width, arguments.image_height, image_pixels.data());
+}
+
+/**
+ * @brief Called when all pixels of a pass of a session's request are received
+ *
+ * With progressive rendering the image is written after each pass, so that
+ * it can be viewed while the finer passes are received.
+ *
+ * @param[in]  session_id  Id of the session
+ */
+static void on_pass_received(int session_id)
+{
+  const auto& session = sessions[session_id];
+  if ((session.current_request.flags & Protocol::REQUEST_FLAG_PROGRESSIVE) == 0u)
+  {
+    return;
+  }
+
+  const auto elapsed = std::chrono::steady_clock::now() - session.time_sent;
+  LOG_INFO("Session %d: pass %d (step %d) received after %dms",
+           session_id,
+           session.current_pass,
+           session.current_step,
+           static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()));
+  copy_to_image(session);
+  write_image();
+}
+
 /**
  * @brief Callback called when a session has read a message
  *
  * The only message that is read is Response, so if we cannot deserialize
  * as a Response then abort.
  *
- * Otherwise add the pixels that we receive. If this is not the last message
+ * Otherwise add the pixels that we receive, at their positions in the pass
+ * they belong to, @see Protocol::Response. If this is not the last message
  * then we continue to read messages. If this is the last message we continue
  * to send next Request in the queue. If the queue is empty we are done
  * and can close the session.
@@ -153,8 +302,49 @@ static void on_read(int session_id, const std::uint8_t* buffer, int len)
             static_cast<int>(response.pixels.size()),
             (response.last_message ? "true" : "false"));
 
+  if (response.status == Protocol::RESPONSE_STATUS_BUSY)
+  {
+    // Wait and send the same request again, the other sessions are served meanwhile
+    const auto delay = std::min<std::chrono::milliseconds>(RETRY_DELAY * (1 << std::min(session.busy_responses, 5)),
+                                                           MAX_RETRY_DELAY);
+    session.busy_responses += 1;
+    LOG_INFO("Session %d: the server is busy, sending the request again in %dms",
+             session_id,
+             static_cast<int>(delay.count()));
+    TcpBackend::post_delayed(delay, [session_id]()
+    {
+      // The session may have disconnected meanwhile, its request is then back in the queue
+      const auto it = sessions.find(session_id);
+      if (it == sessions.end())
+      {
+        return;
+      }
+      auto& session = it->second;
+      const auto request = Protocol::serialize(session.current_request);
+      session.connection->write(request.data(), request.size());
+      session.connection->read();
+    });
+    return;
+  }
+
   // Add the pixels we received
-  session.current_pixels.insert(session.current_pixels.end(), response.pixels.begin(), response.pixels.end());
+  if (response.pass != session.current_pass || response.step != session.current_step)
+  {
+    if (session.current_pass >= 0)
+    {
+      on_pass_received(session_id);
+    }
+    session.current_pass = response.pass;
+    session.current_step = std::max<int>(1, response.step);
+    session.next_x = 0;
+    session.next_y = 0;
+    seek_pass_pixel(&session);
+  }
+  for (const auto pixel : response.pixels)
+  {
+    add_pass_pixel(&session, pixel);
+  }
+  session.current_partial = session.current_partial || response.partial;
 
   if (response.last_message == 0)
   {
@@ -163,23 +353,14 @@ static void on_read(int session_id, const std::uint8_t* buffer, int len)
     return;
   }
 
-  LOG_INFO("Session %d request completed", session_id);
+  on_pass_received(session_id);
+  LOG_INFO("Session %d request completed%s",
+           session_id,
+           session.current_partial ? " (partial, coarse rows where the deadline was reached)" : "");
+  num_partial += session.current_partial ? 1 : 0;
 
   // Add current_pixels to image_pixels, at the correct position
-  // TODO: Simplify this, if possible
-  const auto sub_c = (arguments.max_c - arguments.min_c) / static_cast<double>(arguments.divisions);
-  const auto dx = ((session.current_request.min_c - arguments.min_c) / sub_c.real()).real();
-  const auto dy = ((session.current_request.min_c - arguments.min_c) / sub_c.imag()).imag();
-  auto to = image_pixels.begin() +
-            (session.current_request.image_height * dy * arguments.image_width) +
-            (session.current_request.image_width * dx);
-  auto from = session.current_pixels.begin();
-  for (auto y = 0u; y < session.current_request.image_height; y++)
-  {
-    std::copy(from, from + session.current_request.image_width, to);
-    from += session.current_request.image_width;
-    to += arguments.image_width;
-  }
+  copy_to_image(session);
 
   // Current request is done
   session.request_ongoing = false;
@@ -277,6 +458,7 @@ static void on_connected(std::unique_ptr<TcpBackend::Connection>&& connection,
   auto& session = sessions[session_id];
   session.connection = std::move(connection);
   session.request_ongoing = false;
+  session.busy_responses = 0;
 
   // Create callbacks
   // These are just wrappers for on_read/on_write/on_error_connection
@@ -294,6 +476,19 @@ static void on_connected(std::unique_ptr<TcpBackend::Connection>&& connection,
   send_request(session_id);
 }
 
+/**
+ * @brief Print usage
+ *
+ * @param[in]  argv0  Name of the program
+ */
+static void print_usage(const char* argv0)
+{
+  fprintf(stderr,
+          "usage: %s [--mariani-silver] [--supersample] [--progressive] [--preview] [--center=RE,IM] [--deadline=MS] "
+          "min_c_re min_c_im max_c_re max_c_im max_n x y divisions list-of-servers\n",
+          argv0);
+}
+
 /**
  * @brief Main
  *
@@ -309,49 +504,118 @@ static void on_connected(std::unique_ptr<TcpBackend::Connection>&& connection,
  */
 int main(int argc, char* argv[])
 {
+  // Options are given as --name[=value] and may be mixed with the other arguments
+  std::vector<std::string> positional;
+  for (auto i = 1; i < argc; i++)
+  {
+    const auto arg = std::string(argv[i]);
+    if (arg.compare(0, 2, "--") != 0)
+    {
+      positional.push_back(arg);
+    }
+    else if (arg == "--mariani-silver")
+    {
+      arguments.flags |= Protocol::REQUEST_FLAG_MARIANI_SILVER;
+    }
+    else if (arg == "--supersample")
+    {
+      arguments.flags |= Protocol::REQUEST_FLAG_SUPERSAMPLING;
+    }
+    else if (arg == "--progressive")
+    {
+      arguments.flags |= Protocol::REQUEST_FLAG_PROGRESSIVE;
+    }
+    else if (arg == "--preview")
+    {
+      arguments.flags |= Protocol::REQUEST_FLAG_PREVIEW;
+    }
+    else if (arg.compare(0, 9, "--center=") == 0)
+    {
+      // The center is parsed with (much) more than double precision, so that
+      // deep zooms can be given with min_c and max_c relative to the center
+      static const auto center_frac_limbs = 64;
+      const auto value = arg.substr(9);
+      const auto sep = value.find(',');
+      FixedPoint center_re;
+      FixedPoint center_im;
+      if (sep == std::string::npos ||
+          !FixedPoint::from_string(value.substr(0, sep), center_frac_limbs, &center_re) ||
+          !FixedPoint::from_string(value.substr(sep + 1), center_frac_limbs, &center_im))
+      {
+        fprintf(stderr, "Invalid center: \"%s\"\n", value.c_str());
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      arguments.center_re = center_re.to_expansion();
+      arguments.center_im = center_im.to_expansion();
+    }
+    else if (arg.compare(0, 11, "--deadline=") == 0)
+    {
+      // Time budget per request, rows that the server has not computed by then are coarse
+      const auto value = arg.substr(11);
+      auto deadline_ms = 0;
+      try
+      {
+        std::size_t pos = 0;
+        deadline_ms = std::stoi(value, &pos);
+        deadline_ms = pos == value.size() ? deadline_ms : 0;
+      }
+      catch (const std::exception&)
+      {
+      }
+      if (deadline_ms <= 0)
+      {
+        fprintf(stderr, "Invalid deadline: \"%s\"\n", value.c_str());
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      arguments.deadline_ms = static_cast<std::uint32_t>(deadline_ms);
+    }
+    else
+    {
+      fprintf(stderr, "Unknown option: \"%s\"\n", arg.c_str());
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
   // Check and parse arguments
-  if (argc < 10)
+  if (positional.size() < 9u)
   {
-    fprintf(stderr,
-            "usage: %s min_c_re min_c_im max_c_re max_c_im max_n x y divisions list-of-servers\n",
-            argv[0]);
+    print_usage(argv[0]);
     return EXIT_FAILURE;
   }
 
   try
   {
-    const auto min_c_re = std::stod(argv[1]);
-    const auto min_c_im = std::stod(argv[2]);
-    const auto max_c_re = std::stod(argv[3]);
-    const auto max_c_im = std::stod(argv[4]);
+    const auto min_c_re = std::stod(positional[0]);
+    const auto min_c_im = std::stod(positional[1]);
+    const auto max_c_re = std::stod(positional[2]);
+    const auto max_c_im = std::stod(positional[3]);
     arguments.min_c        = std::complex<double>(min_c_re, min_c_im);
     arguments.max_c        = std::complex<double>(max_c_re, max_c_im);
-    arguments.max_iter     = std::stoi(argv[5]);
-    arguments.image_width  = std::stoi(argv[6]);
-    arguments.image_height = std::stoi(argv[7]);
-    arguments.divisions    = std::stoi(argv[8]);
+    arguments.max_iter     = std::stoi(positional[4]);
+    arguments.image_width  = std::stoi(positional[5]);
+    arguments.image_height = std::stoi(positional[6]);
+    arguments.divisions    = std::stoi(positional[7]);
   }
   catch (const std::exception& e)
   {
     fprintf(stderr, "exception: %s\n", e.what());
-    fprintf(stderr,
-            "usage: %s min_c_re min_c_im max_c_re max_c_im max_n x y divisions list-of-servers\n",
-            argv[0]);
+    print_usage(argv[0]);
     return EXIT_FAILURE;
   }
 
   std::vector<std::tuple<std::string, std::string>> servers;
-  for (auto i = 9; i < argc; i++)
+  for (auto i = 8u; i < positional.size(); i++)
   {
-    const auto arg = std::string(argv[i]);
+    const auto& arg = positional[i];
     const auto sep = arg.find_last_of(":");
     if (sep == 0u ||                 // no address part
         sep == std::string::npos ||  // no colon
         sep == arg.size() - 1)       // no port part
     {
-      fprintf(stderr,
-              "usage: %s min_c_re min_c_im max_c_re max_c_im max_n x y divisions list-of-servers\n",
-              argv[0]);
+      print_usage(argv[0]);
       return EXIT_FAILURE;
     }
 
@@ -377,6 +641,10 @@ int main(int argc, char* argv[])
       request.image_width  = sub_image_width;
       request.image_height = sub_image_height;
       request.max_iter     = arguments.max_iter;
+      request.flags        = arguments.flags;
+      request.center_re    = arguments.center_re;
+      request.center_im    = arguments.center_im;
+      request.deadline_ms  = arguments.deadline_ms;
       request_queue.push_back(request);
     }
   }
@@ -408,10 +676,15 @@ int main(int argc, char* argv[])
     exit(EXIT_FAILURE);
   }
 
+  if (num_partial > 0)
+  {
+    LOG_INFO("%d of %d requests are partial because of the deadline",
+             num_partial,
+             arguments.divisions * arguments.divisions);
+  }
+
   // Write image file
-  static const auto filename = std::string("image.pgm");
-  LOG_INFO("Writing image to \"%s\"", filename.c_str());
-  PGM::write_pgm(filename, arguments.image_width, arguments.image_height, image_pixels.data());
+  write_image();
 
   // Save timestamp at end and print execution time
   const auto time_end = std::chrono::steady_clock::now();
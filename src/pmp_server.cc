@@ -1,83 +1,1173 @@
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
 #include <csignal>
 #include <chrono>
+#include <cmath>
 #include <complex>
+#include <limits>
+#include <map>
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "tcp_backend.h"
 #include "protocol.h"
 #include "mandelbrot.h"
+#include "autotune.h"
+#include "worker_pool.h"
+#include "result_cache.h"
 #include "logger.h"
 
 // The server
 static std::unique_ptr<TcpBackend::Server> server;
 
+/**
+ * Represents the computation of a request
+ *
+ * A request is computed in bands of rows that are sent to the client as soon
+ * as they are computed, in order. With progressive rendering each pass has its
+ * own bands, which only have the pixels of that pass. Sessions that send an
+ * identical request while it is being computed are attached to the same
+ * Computation and are sent the same band buffers, unless they have a deadline.
+ * At most STREAM_WINDOW bands ahead of the slowest attached session are
+ * computed or waiting to be sent.
+ *
+ * At most max_active computations are active, i.e. have bands submitted to the
+ * worker pool, which interleaves the bands of different sessions so that each
+ * session gets a fair share of the workers. The others wait, and the one with
+ * the lowest estimated cost is admitted when a slot is free,
+ * @see admit_computations.
+ */
+struct Computation
+{
+  /**
+   * Admission state
+   */
+  enum class Admission
+  {
+    WAITING,  /**< Waiting for a free slot */
+    ACTIVE,   /**< Holds a slot, its bands are computed */
+    DONE,     /**< Holds no slot, nothing more to compute */
+  };
+
+  /**
+   * A band of rows
+   */
+  struct Band
+  {
+    std::shared_ptr<const std::vector<std::uint8_t>> buffer;  /**< Buffer with the pixels, null until
+                                                                   computed and after released */
+    std::size_t offset;                                       /**< Offset of the pixels in buffer */
+    std::size_t size;                                         /**< Number of pixels */
+    bool partial;                                             /**< True if computed from a coarse pass */
+    int y;                                                    /**< First image row */
+    int rows;                                                 /**< Number of image rows */
+    int pass;                                                 /**< Pass of progressive rendering */
+    int step;                                                 /**< Distance between the pixels of the
+                                                                   pass, @see Protocol::Response */
+  };
+
+  /**
+   * A previous image whose pixel grid lines up with this one
+   */
+  struct Reuse
+  {
+    ResultCache::Pixels pixels;  /**< The previous image, null if there is none */
+    int offset_x;                /**< Pixel (x, y) of this image is pixel */
+    int offset_y;                /**< (x + offset_x, y + offset_y) of the previous image */
+  };
+
+  /**
+   * A previous image of the same request with a lower max_iter
+   */
+  struct Resume
+  {
+    ResultCache::Pixels pixels;  /**< The previous image, null if there is none */
+    ResultCache::States states;  /**< The iteration state of its pixels, per band */
+  };
+
+  std::vector<std::uint8_t> key;                      /**< The serialized request */
+  std::shared_ptr<const Protocol::Request> request;   /**< The request */
+  int session_id;                                     /**< Id of the session that sent the request first */
+  int flow;                                           /**< Worker pool flow that the bands are submitted
+                                                           to, the id of a session that is attached */
+  int rows_per_band;                                  /**< Number of image rows per band, times the
+                                                           step of the pass with progressive rendering */
+  int next_band_to_compute;                           /**< Next band to submit to the worker pool */
+  int num_bands_computed;                             /**< Number of bands computed */
+  std::vector<Band> bands;                            /**< The bands */
+  std::shared_ptr<std::vector<std::uint8_t>> image;   /**< The whole image if it will be added to the
+                                                           result cache, the bands are then computed
+                                                           directly into it, otherwise null */
+  Reuse reuse;                                        /**< Pixels that don't need to be computed */
+  Resume resume;                                      /**< Pixels to continue iterating */
+  bool keep_states;                                   /**< True if the iteration state of the pixels
+                                                           is kept for the result cache */
+  std::vector<Mandelbrot::ResumeState> states;        /**< Iteration state per band, if kept */
+  std::vector<int> session_ids;                       /**< Sessions that are sent this computation */
+  std::shared_ptr<std::atomic<bool>> cancelled;       /**< Set when all sessions are gone */
+  std::shared_ptr<std::atomic<bool>> stop;            /**< Set when the computation is cancelled or its
+                                                           deadline has passed, the bands that are
+                                                           computed then stop early */
+  std::chrono::steady_clock::time_point deadline;     /**< Bands that are started, or not finished,
+                                                           after this are computed from a coarse
+                                                           pass, max() if the request has no deadline */
+  bool partial;                                       /**< True if a band was computed from a coarse
+                                                           pass, the image is then not cached */
+  bool progressive;                                   /**< True if the image is sent in passes from
+                                                           coarse to fine */
+  Mandelbrot::Stats stats;                            /**< Statistics for the request */
+  Admission admission;                                /**< Admission state */
+  double cost;                                        /**< Estimated cost, @see estimate_cost */
+  std::chrono::steady_clock::time_point time_begin;   /**< When the request was received */
+  std::chrono::steady_clock::time_point time_admitted;
+};
+
 /**
  * Represents a session
  */
 struct Session
 {
   std::unique_ptr<TcpBackend::Connection> connection;  /**< Pointer to Connection */
-  std::vector<std::uint8_t> pixels;                    /**< Array of pixels to be sent
-                                                            If Request not yet received or
-                                                            all Responses already sent it
-                                                            will be empty */
+  std::shared_ptr<Computation> computation;            /**< The computation that is being sent,
+                                                            null if there is none */
+  int next_band_to_send;                               /**< The band that is being sent or is
+                                                            the next to be sent */
+  std::size_t sent;                                    /**< Number of pixels sent of that band */
+  bool writing;                                        /**< True if a write is ongoing */
+  bool send_cancelled;                                 /**< True if the request was cancelled and the
+                                                            last Response is to be sent when the
+                                                            ongoing write is done */
 };
 
+// Maximum number of bands per computation that are computed or waiting to be sent
+static const auto STREAM_WINDOW = 4;
+
+// Samples per pixel in each direction with REQUEST_FLAG_SUPERSAMPLING
+static const auto SUPERSAMPLING = 4;
+
+// Pixels per sample in each direction of the coarse pass that is sent for the
+// rows that are not computed by the deadline of a request
+static const auto COARSE_STEP = 8;
+
+// Maximum number of iterations of the coarse pass, so that it is quick even
+// with a large max_iter. Samples that escape later are shown as inside the set
+static const auto COARSE_MAX_ITER = 1024u;
+
+// Distance between the pixels of the first pass of progressive rendering,
+// each following pass halves it, @see Protocol::REQUEST_FLAG_PROGRESSIVE
+static const auto PROGRESSIVE_STEP = 8;
+
 // Map session_id -> Session
 static std::unordered_map<int, Session> sessions;
 
+// Computations that identical requests can be attached to, map key -> Computation
+static std::map<std::vector<std::uint8_t>, std::shared_ptr<Computation>> computations;
+
+// Worker threads that compute the requests, created in main()
+static std::unique_ptr<WorkerPool> worker_pool;
+
+// Credit per turn of a session in the worker pool, in the unit of estimate_cost:
+// a band that fits in one Response message at max_iter 1024
+static const auto WORKER_POOL_QUANTUM = 32768.0 * 1024.0;
+
+// Computed images of recent requests, created in main()
+static std::unique_ptr<ResultCache> result_cache;
+
+// Keep the iteration state of pixels that did not escape in the result cache
+static bool keep_states = false;
+
+// Maximum number of active computations, set in main()
+static int max_active = 16;
+
+// Number of active computations
+static int num_active = 0;
+
+// Computations waiting to be admitted, at most max_waiting, set in main().
+// Further requests are answered with RESPONSE_STATUS_BUSY
+static std::vector<std::shared_ptr<Computation>> waiting_computations;
+static std::size_t max_waiting = 64;
+
+// The estimated cost of a waiting computation is halved for every AGING_PERIOD
+// it has waited, so that large requests are not starved by small ones
+static const auto AGING_PERIOD = std::chrono::seconds(1);
+
+/**
+ * @brief Logs the result cache counters
+ */
+static void log_cache_stats()
+{
+  LOG_INFO("Result cache: %zu entries, %zu/%zu bytes, hits: %llu, misses: %llu, evictions: %llu",
+           result_cache->num_entries(),
+           result_cache->size_bytes(),
+           result_cache->max_bytes(),
+           static_cast<unsigned long long>(result_cache->hits()),
+           static_cast<unsigned long long>(result_cache->misses()),
+           static_cast<unsigned long long>(result_cache->evictions()));
+}
+
+/**
+ * @brief Gets the compute options of a request
+ */
+static Mandelbrot::Options get_options(const Protocol::Request& request)
+{
+  Mandelbrot::Options options;
+  options.mariani_silver = (request.flags & Protocol::REQUEST_FLAG_MARIANI_SILVER) != 0;
+  options.supersampling = (request.flags & Protocol::REQUEST_FLAG_SUPERSAMPLING) ? SUPERSAMPLING : 1;
+  options.preview = (request.flags & Protocol::REQUEST_FLAG_PREVIEW) != 0;
+  return options;
+}
+
+/**
+ * @brief Estimates the cost of computing a request
+ *
+ * Pixels in the set take max_iter iterations, so this is an upper bound of the
+ * number of iterations.
+ */
+static double estimate_cost(const Protocol::Request& request)
+{
+  return static_cast<double>(request.image_width) * request.image_height * std::max(1u, request.max_iter);
+}
+
+/**
+ * @brief Gets the estimated cost of a waiting computation, reduced by how long it has waited
+ */
+static double aged_cost(const Computation& computation, std::chrono::steady_clock::time_point now)
+{
+  const auto waited = std::chrono::duration<double>(now - computation.time_begin) / AGING_PERIOD;
+  return computation.cost * std::exp2(-waited);
+}
+
+/**
+ * @brief Checks if the pixel grid of a previous request lines up with a new request
+ *
+ * This is the case when the new request is the previous one panned by a whole
+ * number of pixels: same image size, max_iter, flags and center, and every
+ * column and row where the images overlap has exactly the same coordinates,
+ * @see Mandelbrot::get_pixel_coordinate. Only used with Engine::DOUBLE, the
+ * extended precision engines compute relative to a point that moves with the
+ * view. Not used with Mariani-Silver, since its pixels depend on the tiles, or
+ * with supersampling, since its pixels depend on their neighbours.
+ *
+ * @param[in]   from      The previous request
+ * @param[in]   to        The new request
+ * @param[out]  offset_x  Pixel (x, y) of to is pixel (x + offset_x, y + offset_y) of from
+ * @param[out]  offset_y
+ *
+ * @return true if the grids line up and the images overlap, otherwise false
+ */
+static bool grid_offset(const Protocol::Request& from, const Protocol::Request& to, int* offset_x, int* offset_y)
+{
+  if (from.image_width != to.image_width ||
+      from.image_height != to.image_height ||
+      from.max_iter != to.max_iter ||
+      from.flags != to.flags ||
+      from.center_re != to.center_re ||
+      from.center_im != to.center_im ||
+      (to.flags & (Protocol::REQUEST_FLAG_MARIANI_SILVER | Protocol::REQUEST_FLAG_SUPERSAMPLING)) ||
+      to.image_width == 0u ||
+      to.image_height == 0u)
+  {
+    return false;
+  }
+
+  const auto width = static_cast<int>(to.image_width);
+  const auto height = static_cast<int>(to.image_height);
+  const auto options = get_options(to);
+  if (Mandelbrot::get_engine(from.center_re, from.center_im, from.min_c, from.max_c, width, height, from.max_iter,
+                             options) != Mandelbrot::Engine::DOUBLE ||
+      Mandelbrot::get_engine(to.center_re, to.center_im, to.min_c, to.max_c, width, height, to.max_iter,
+                             options) != Mandelbrot::Engine::DOUBLE)
+  {
+    return false;
+  }
+
+  // Find the whole number of pixels the view moved by, then check that the
+  // columns (or rows) that overlap have bitwise the same coordinates
+  const auto shift = [](const std::vector<double>& center,
+                        double from_min,
+                        double from_max,
+                        double to_min,
+                        double to_max,
+                        int size,
+                        int* offset)
+  {
+    const auto pixels = std::round((to_min - from_min) / ((to_max - to_min) / size));
+    if (!(std::fabs(pixels) < size))
+    {
+      return false;
+    }
+    const auto p = static_cast<int>(pixels);
+    for (auto i = std::max(0, -p); i < std::min(size, size - p); i++)
+    {
+      if (Mandelbrot::get_pixel_coordinate(center, to_min, to_max, size, i) !=
+          Mandelbrot::get_pixel_coordinate(center, from_min, from_max, size, i + p))
+      {
+        return false;
+      }
+    }
+    *offset = p;
+    return true;
+  };
+  return shift(to.center_re, from.min_c.real(), from.max_c.real(), to.min_c.real(), to.max_c.real(), width, offset_x) &&
+         shift(to.center_im, from.min_c.imag(), from.max_c.imag(), to.min_c.imag(), to.max_c.imag(), height, offset_y);
+}
+
+/**
+ * @brief Finds the image in the result cache that overlaps the most with a request
+ *
+ * @param[in]   request  The request
+ * @param[out]  reuse    The image and its offset, pixels is null if there is none
+ */
+static void find_reuse(const Protocol::Request& request, Computation::Reuse* reuse)
+{
+  auto best_overlap = 0ll;
+  *reuse = Computation::Reuse();
+  result_cache->for_each([&](const Protocol::Request& from, const ResultCache::Pixels& pixels, const ResultCache::States&)
+  {
+    int offset_x = 0;
+    int offset_y = 0;
+    if (!grid_offset(from, request, &offset_x, &offset_y))
+    {
+      return;
+    }
+
+    const auto overlap = static_cast<long long>(request.image_width - std::abs(offset_x)) *
+                         (request.image_height - std::abs(offset_y));
+    if (overlap > best_overlap)
+    {
+      best_overlap = overlap;
+      *reuse = { pixels, offset_x, offset_y };
+    }
+  });
+}
+
+/**
+ * @brief Finds the image in the result cache with the highest max_iter below the
+ *        request's max_iter, that is otherwise the same request and has a state
+ *
+ * @param[in]   request  The request
+ * @param[out]  resume   The image and its state, pixels is null if there is none
+ */
+static void find_resume(const Protocol::Request& request, Computation::Resume* resume)
+{
+  auto best_max_iter = 0u;
+  *resume = Computation::Resume();
+  result_cache->for_each([&](const Protocol::Request& from,
+                             const ResultCache::Pixels& pixels,
+                             const ResultCache::States& states)
+  {
+    if (!states || from.max_iter >= request.max_iter || from.max_iter <= best_max_iter)
+    {
+      return;
+    }
+
+    auto same = from;
+    same.max_iter = request.max_iter;
+    if (Protocol::serialize(same) == Protocol::serialize(request))
+    {
+      best_max_iter = from.max_iter;
+      *resume = { pixels, states };
+    }
+  });
+}
+
 /**
- * @brief Send (or continue to send) Response to given Session
+ * @brief Computes a rectangle of a request, copying the pixels that can be reused
+ *
+ * @param[in]   request  The request
+ * @param[in]   reuse    Pixels that can be reused
+ * @param[in]   rect     The rectangle to compute, only its lattice if it has steps
+ * @param[in]   cancel   Cancellation token, @see Mandelbrot::Options::cancel
+ * @param[out]  pixels   Pointer to where to write the rectangle, with a stride of the image width
+ * @param[out]  stats    Statistics are added to this object
+ */
+static void compute_rect(const Protocol::Request& request,
+                         const Computation::Reuse& reuse,
+                         const Mandelbrot::Rect& rect,
+                         const std::atomic<bool>* cancel,
+                         std::uint8_t* pixels,
+                         Mandelbrot::Stats* stats)
+{
+  auto options = get_options(request);
+  options.cancel = cancel;
+
+  const auto width = static_cast<int>(request.image_width);
+  const auto height = static_cast<int>(request.image_height);
+
+  // The first column and row of the lattice of rect from x and y on
+  const auto lattice_x = [&rect](int x)
+  {
+    return x <= rect.x ? rect.x : rect.x + (x - rect.x + rect.x_step - 1) / rect.x_step * rect.x_step;
+  };
+  const auto lattice_y = [&rect](int y)
+  {
+    return y <= rect.y ? rect.y : rect.y + (y - rect.y + rect.y_step - 1) / rect.y_step * rect.y_step;
+  };
+
+  const auto compute = [&](int x0, int y0, int x1, int y1)
+  {
+    x0 = lattice_x(x0);
+    y0 = lattice_y(y0);
+    if (x0 >= x1 || y0 >= y1)
+    {
+      return;
+    }
+    Mandelbrot::Stats rect_stats;
+    Mandelbrot::compute_into(request.center_re,
+                             request.center_im,
+                             request.min_c,
+                             request.max_c,
+                             width,
+                             height,
+                             request.max_iter,
+                             { x0, y0, x1 - x0, y1 - y0, rect.x_step, rect.y_step },
+                             pixels + static_cast<std::size_t>(y0 - rect.y) * width + (x0 - rect.x),
+                             width,
+                             options,
+                             &rect_stats);
+    *stats += rect_stats;
+  };
+  stats->engine = Mandelbrot::get_engine(request.center_re,
+                                         request.center_im,
+                                         request.min_c,
+                                         request.max_c,
+                                         width,
+                                         height,
+                                         request.max_iter,
+                                         options);
+
+  // The part of rect that is in the previous image
+  auto x0 = rect.x;
+  auto y0 = rect.y;
+  auto x1 = rect.x + rect.width;
+  auto y1 = rect.y + rect.height;
+  if (reuse.pixels)
+  {
+    x0 = std::max(x0, -reuse.offset_x);
+    y0 = std::max(y0, -reuse.offset_y);
+    x1 = std::min(x1, width - reuse.offset_x);
+    y1 = std::min(y1, height - reuse.offset_y);
+  }
+  if (!reuse.pixels || x0 >= x1 || y0 >= y1)
+  {
+    compute(rect.x, rect.y, rect.x + rect.width, rect.y + rect.height);
+    return;
+  }
+
+  for (auto y = lattice_y(y0); y < y1; y += rect.y_step)
+  {
+    const auto* from = reuse.pixels->data() + static_cast<std::size_t>(y + reuse.offset_y) * width;
+    auto* to = pixels + static_cast<std::size_t>(y - rect.y) * width;
+    if (rect.x_step == 1)
+    {
+      std::copy(from + (x0 + reuse.offset_x), from + (x1 + reuse.offset_x), to + (x0 - rect.x));
+      continue;
+    }
+    for (auto x = lattice_x(x0); x < x1; x += rect.x_step)
+    {
+      to[x - rect.x] = from[x + reuse.offset_x];
+    }
+  }
+
+  // Compute the newly exposed strips around it
+  compute(rect.x, rect.y, rect.x + rect.width, y0);
+  compute(rect.x, y1, rect.x + rect.width, rect.y + rect.height);
+  compute(rect.x, y0, x0, y1);
+  compute(x1, y0, rect.x + rect.width, y1);
+}
+
+/**
+ * @brief Computes rows of a request from a coarse pass, with one sample per
+ *        COARSE_STEP x COARSE_STEP pixels
+ *
+ * Used for the rows that are not computed by the deadline of the request. Each
+ * sample is the pixel in the top left corner of its block, without
+ * Mariani-Silver or supersampling, and iterated at most COARSE_MAX_ITER times.
+ * Samples that escape before that have their exact pixel value.
+ *
+ * @param[in]   request  The request
+ * @param[in]   y        The first row
+ * @param[in]   rows     Number of rows
+ * @param[out]  pixels   Pointer to where to write the rows, with a stride of the image width
+ * @param[out]  stats    Statistics are added to this object
+ */
+static void compute_coarse(const Protocol::Request& request,
+                           int y,
+                           int rows,
+                           std::uint8_t* pixels,
+                           Mandelbrot::Stats* stats)
+{
+  const auto width = static_cast<int>(request.image_width);
+  const auto height = static_cast<int>(request.image_height);
+  if (rows <= 0 || width <= 0)
+  {
+    return;
+  }
+
+  // Sample (i, j) of the coarse image is pixel (i * COARSE_STEP, j * COARSE_STEP)
+  const auto dx = (request.max_c.real() - request.min_c.real()) / width;
+  const auto dy = (request.max_c.imag() - request.min_c.imag()) / height;
+  const auto coarse_width = (width + COARSE_STEP - 1) / COARSE_STEP;
+  const auto coarse_height = (height + COARSE_STEP - 1) / COARSE_STEP;
+  const auto coarse_max_c = request.min_c + std::complex<double>(coarse_width * COARSE_STEP * dx,
+                                                                 coarse_height * COARSE_STEP * dy);
+  const auto first = y / COARSE_STEP;
+  const auto last = (y + rows - 1) / COARSE_STEP;
+  std::vector<std::uint8_t> samples(static_cast<std::size_t>(coarse_width) * (last - first + 1));
+  Mandelbrot::Stats coarse_stats;
+  Mandelbrot::compute_into(request.center_re,
+                           request.center_im,
+                           request.min_c,
+                           coarse_max_c,
+                           coarse_width,
+                           coarse_height,
+                           std::min(request.max_iter, COARSE_MAX_ITER),
+                           { 0, first, coarse_width, last - first + 1 },
+                           samples.data(),
+                           coarse_width,
+                           Mandelbrot::Options(),
+                           &coarse_stats);
+  *stats += coarse_stats;
+  stats->engine = coarse_stats.engine;
+
+  for (auto row = 0; row < rows; row++)
+  {
+    const auto* from = samples.data() + static_cast<std::size_t>((y + row) / COARSE_STEP - first) * coarse_width;
+    auto* to = pixels + static_cast<std::size_t>(row) * width;
+    for (auto x = 0; x < width; x++)
+    {
+      to[x] = from[x / COARSE_STEP];
+    }
+  }
+}
+
+/**
+ * @brief Gets the number of pixels of a band of a pass of progressive rendering
+ *
+ * @param[in]  width  Image width
+ * @param[in]  band   The band
+ */
+static std::size_t count_pass_pixels(int width, const Computation::Band& band)
+{
+  auto count = std::size_t(0);
+  for (auto y = band.y; y < band.y + band.rows; y++)
+  {
+    int x = 0;
+    int x_step = 1;
+    if (Protocol::get_pass_columns(y, band.pass, band.step, &x, &x_step) && x < width)
+    {
+      count += (width - x + x_step - 1) / x_step;
+    }
+  }
+  return count;
+}
+
+/**
+ * @brief Computes the pixels of a band of a pass of progressive rendering
+ *
+ * Only the pixels that are new in the pass are computed, the pixels of the
+ * previous passes are not computed again, @see Protocol::Response.
+ *
+ * @param[in]   request  The request
+ * @param[in]   reuse    Pixels that can be reused
+ * @param[in]   band     The band
+ * @param[in]   cancel   Cancellation token, @see Mandelbrot::Options::cancel
+ * @param[out]  pixels   Pointer to where to write the rows of the band, with a stride
+ *                       of the image width. Only the pixels of the pass are written
+ * @param[out]  stats    Statistics are added to this object
+ */
+static void compute_pass(const Protocol::Request& request,
+                         const Computation::Reuse& reuse,
+                         const Computation::Band& band,
+                         const std::atomic<bool>* cancel,
+                         std::uint8_t* pixels,
+                         Mandelbrot::Stats* stats)
+{
+  // Rows first_row, first_row + y_step, ... of the band, columns x, x + x_step, ...
+  const auto width = static_cast<int>(request.image_width);
+  const auto y_end = band.y + band.rows;
+  const auto lattice = [&](int first_row, int y_step, int x, int x_step)
+  {
+    const auto y = band.y + (first_row - band.y % y_step + y_step) % y_step;
+    if (x < width && y < y_end)
+    {
+      compute_rect(request,
+                   reuse,
+                   { x, y, width - x, y_end - y, x_step, y_step },
+                   cancel,
+                   pixels + static_cast<std::size_t>(y - band.y) * width + x,
+                   stats);
+    }
+  };
+
+  const auto step = band.step;
+  if (band.pass == 0)
+  {
+    lattice(0, step, 0, step);
+  }
+  else
+  {
+    lattice(step, 2 * step, 0, step);
+    lattice(0, 2 * step, step, 2 * step);
+  }
+}
+
+/**
+ * @brief Collects the pixels of a band of a pass of progressive rendering
+ *
+ * @param[in]  width   Image width
+ * @param[in]  band    The band
+ * @param[in]  pixels  Pointer to the rows of the band, with a stride of the image width
+ *
+ * @return The pixels of the pass, in the order they are sent
+ */
+static std::shared_ptr<std::vector<std::uint8_t>> collect_pass_pixels(int width,
+                                                                      const Computation::Band& band,
+                                                                      const std::uint8_t* pixels)
+{
+  auto collected = std::make_shared<std::vector<std::uint8_t>>();
+  collected->reserve(band.size);
+  for (auto y = band.y; y < band.y + band.rows; y++)
+  {
+    int x = 0;
+    int x_step = 1;
+    if (!Protocol::get_pass_columns(y, band.pass, band.step, &x, &x_step))
+    {
+      continue;
+    }
+    const auto* row = pixels + static_cast<std::size_t>(y - band.y) * width;
+    for (; x < width; x += x_step)
+    {
+      collected->push_back(row[x]);
+    }
+  }
+  return collected;
+}
+
+/**
+ * @brief Gets the rows of a band that can be copied from already computed rows
+ *
+ * Rows whose mirror image about the real axis is in a band that is already
+ * computed into the whole image have the same pixels as that row.
+ *
+ * @param[in]  computation  The computation, its whole image must be collected
+ * @param[in]  band         The band
+ *
+ * @return For each row of the band the row of the image to copy, or -1 if it
+ *         must be computed
+ */
+static std::vector<int> get_mirror_rows(const Computation& computation, int band)
+{
+  const auto& request = *computation.request;
+  const auto options = get_options(request);
+
+  const auto height = static_cast<int>(request.image_height);
+  const auto y = band * computation.rows_per_band;
+  const auto rows = std::max(0, std::min(computation.rows_per_band, height - y));
+  std::vector<int> mirror_rows(rows, -1);
+  for (auto i = 0; i < rows; i++)
+  {
+    const auto mirror = Mandelbrot::mirror_row(request.center_re,
+                                               request.center_im,
+                                               request.min_c,
+                                               request.max_c,
+                                               static_cast<int>(request.image_width),
+                                               height,
+                                               request.max_iter,
+                                               y + i,
+                                               options);
+    const auto& mirror_band = computation.bands[std::max(0, mirror) / computation.rows_per_band];
+    if (mirror >= 0 && mirror_band.buffer && !mirror_band.partial)
+    {
+      mirror_rows[i] = mirror;
+    }
+  }
+  return mirror_rows;
+}
+
+/**
+ * @brief Creates a Computation for a request, split into bands
+ *
+ * @param[in]  request     The request
+ * @param[in]  key         The serialized request
+ * @param[in]  session_id  Id of the session that sent the request
+ * @param[in]  cached      The image from the result cache, or null if it must be computed
+ * @param[in]  progressive True if the image is to be sent in passes from coarse to fine
+ */
+static std::shared_ptr<Computation> create_computation(const std::shared_ptr<const Protocol::Request>& request,
+                                                       const std::vector<std::uint8_t>& key,
+                                                       int session_id,
+                                                       const ResultCache::Pixels& cached,
+                                                       bool progressive)
+{
+  auto computation = std::make_shared<Computation>();
+  computation->key                  = key;
+  computation->request              = request;
+  computation->session_id           = session_id;
+  computation->flow                 = session_id;
+  computation->next_band_to_compute = 0;
+  computation->num_bands_computed   = 0;
+  computation->keep_states          = false;
+  computation->cancelled            = std::make_shared<std::atomic<bool>>(false);
+  computation->stop                 = std::make_shared<std::atomic<bool>>(false);
+  computation->deadline             = std::chrono::steady_clock::time_point::max();
+  computation->partial              = false;
+  computation->progressive          = false;
+  computation->admission            = cached ? Computation::Admission::DONE : Computation::Admission::WAITING;
+  computation->cost                 = estimate_cost(*request);
+  computation->time_begin           = std::chrono::steady_clock::now();
+  computation->time_admitted        = computation->time_begin;
+
+  // Bands of (at least one) row(s) that fit in one Response message, or whole
+  // rows of tiles with Mariani-Silver so that the pixels don't depend on the bands
+  // An empty image is sent as one empty band
+  const auto width = static_cast<std::size_t>(request->image_width);
+  const auto height = static_cast<int>(request->image_height);
+  auto rows_per_band = std::max(1, static_cast<int>((1u << 15) / std::max<std::size_t>(1, width)));
+  if (request->flags & Protocol::REQUEST_FLAG_MARIANI_SILVER)
+  {
+    const auto tile = Mandelbrot::MARIANI_SILVER_TILE_SIZE;
+    rows_per_band = (rows_per_band + tile - 1) / tile * tile;
+  }
+  computation->rows_per_band = rows_per_band;
+
+  // Collect the whole image for the result cache if it fits
+  if (!cached && result_cache->fits(width * request->image_height))
+  {
+    computation->image = std::make_shared<std::vector<std::uint8_t>>(width * request->image_height);
+  }
+  const auto whole_image = cached || computation->image;
+
+  // A cached image is sent at once, and with Mariani-Silver or supersampling
+  // the pixels depend on their neighbours, so they can't be computed in passes
+  computation->progressive = progressive &&
+                             !cached &&
+                             width > 0u &&
+                             height > 0 &&
+                             !(request->flags & (Protocol::REQUEST_FLAG_MARIANI_SILVER |
+                                                 Protocol::REQUEST_FLAG_SUPERSAMPLING));
+  if (computation->progressive)
+  {
+    // Bands of about the same number of pixels in each pass. The pixels of a
+    // band are collected into a buffer of its own
+    for (auto pass = 0, step = PROGRESSIVE_STEP; step >= 1; pass++, step /= 2)
+    {
+      for (auto y = 0; y < height; y += rows_per_band * step)
+      {
+        Computation::Band band;
+        band.offset  = 0u;
+        band.partial = false;
+        band.y       = y;
+        band.rows    = std::min(rows_per_band * step, height - y);
+        band.pass    = pass;
+        band.step    = step;
+        band.size    = count_pass_pixels(static_cast<int>(width), band);
+        if (band.size > 0u)
+        {
+          computation->bands.push_back(band);
+        }
+      }
+    }
+  }
+  else
+  {
+    const auto num_bands = std::max(1, (height + rows_per_band - 1) / rows_per_band);
+    computation->bands.resize(num_bands);
+    for (auto band = 0; band < num_bands; band++)
+    {
+      const auto y = band * rows_per_band;
+      const auto rows = std::max(0, std::min(rows_per_band, height - y));
+      computation->bands[band].offset = whole_image ? y * width : 0u;
+      computation->bands[band].size = rows * width;
+      computation->bands[band].partial = false;
+      computation->bands[band].y = y;
+      computation->bands[band].rows = rows;
+      computation->bands[band].pass = 0;
+      computation->bands[band].step = 1;
+    }
+  }
+  const auto num_bands = static_cast<int>(computation->bands.size());
+
+  if (cached)
+  {
+    for (auto& band : computation->bands)
+    {
+      band.buffer = cached;
+    }
+    computation->next_band_to_compute = num_bands;
+    computation->num_bands_computed   = num_bands;
+  }
+
+  return computation;
+}
+
+/**
+ * @brief Sends (or continues to send) the current band to given Session
  *
  * Takes as many pixels as possible (Response message has a max size)
- * from responses and sends it to the Session in a Response message.
+ * from the band and sends them to the Session in a Response message.
+ * Does nothing if a write is ongoing or if the band is not yet computed.
  *
  * @param[in]  session_id  Id of the session to which send Response
  */
 static void send_response(int session_id)
 {
-  // Get Session and verify that we have pixels to send
   auto& session = sessions.at(session_id);
-  if (session.pixels.empty())
+  if (session.writing || !session.computation)
   {
-    LOG_ERROR("%s: session_id=%d: no pixels to send", __func__, session_id);
+    return;
+  }
+
+  const auto& computation = *session.computation;
+  const auto& band = computation.bands[session.next_band_to_send];
+  if (!band.buffer)
+  {
+    // Not yet computed, on_band_computed will call us again
     return;
   }
 
   // Maximum size of byte array (pixels) in messages is 2^15 = 32768
-  // so we need to split the response into multiple messages if we have
+  // so we need to split a band into multiple messages if it has
   // more pixels than that
+  const auto size = std::min<std::size_t>(band.size - session.sent, 1u << 15);
+  const auto begin = band.buffer->begin() + band.offset + session.sent;
   Protocol::Response response;
-  if (session.pixels.size() <= (1u << 15))
+  response.pixels.assign(begin, begin + size);
+  response.status = Protocol::RESPONSE_STATUS_OK;
+  response.partial = band.partial;
+  response.pass = static_cast<std::uint8_t>(band.pass);
+  response.step = static_cast<std::uint8_t>(band.step);
+  session.sent += size;
+
+  // Send the Response
+  response.last_message = session.sent == band.size &&
+                          session.next_band_to_send == static_cast<int>(computation.bands.size()) - 1;
+  const auto buffer = Protocol::serialize(response);
+  session.writing = true;
+  session.connection->write(buffer.data(), buffer.size());
+}
+
+/**
+ * @brief Sends the last Response, without pixels, of a request that was not
+ *        accepted because the server is full or that was cancelled
+ *
+ * @param[in]  session_id  Id of the session to which send Response
+ * @param[in]  status      RESPONSE_STATUS_BUSY or RESPONSE_STATUS_CANCELLED
+ */
+static void send_status(int session_id, std::uint8_t status)
+{
+  auto& session = sessions.at(session_id);
+  Protocol::Response response;
+  response.last_message = true;
+  response.status = status;
+  response.partial = false;
+  response.pass = 0u;
+  response.step = 1u;
+  const auto buffer = Protocol::serialize(response);
+  session.writing = true;
+  session.connection->write(buffer.data(), buffer.size());
+}
+
+static void on_band_computed(const std::shared_ptr<Computation>& computation,
+                             int band,
+                             const std::shared_ptr<const std::vector<std::uint8_t>>& buffer,
+                             const Mandelbrot::Stats& stats,
+                             Mandelbrot::ResumeState&& state,
+                             bool partial);
+
+static void release_slot(const std::shared_ptr<Computation>& computation);
+
+/**
+ * @brief Releases sent bands and submits bands to the worker pool until the
+ *        stream window of the slowest attached session is full
+ *
+ * A computation without sessions is abandoned: no more bands are submitted,
+ * and the bands that are being computed stop early.
+ *
+ * @param[in]  computation  The computation
+ */
+static void update_computation(const std::shared_ptr<Computation>& computation)
+{
+  const auto num_bands = static_cast<int>(computation->bands.size());
+  auto min_band_to_send = num_bands;
+  for (const auto session_id : computation->session_ids)
+  {
+    min_band_to_send = std::min(min_band_to_send, sessions.at(session_id).next_band_to_send);
+  }
+
+  // Sessions can only be attached as long as the first band is kept, bands
+  // are kept while the whole image is collected for the result cache
+  const auto it = computations.find(computation->key);
+  const auto attachable = it != computations.end() && it->second == computation;
+  if (computation->session_ids.empty() || (!computation->image && min_band_to_send > 0))
+  {
+    if (attachable)
+    {
+      computations.erase(it);
+    }
+  }
+  if (computation->session_ids.empty())
+  {
+    computation->cancelled->store(true);
+    computation->stop->store(true);
+    if (computation->admission == Computation::Admission::WAITING)
+    {
+      waiting_computations.erase(std::find(waiting_computations.begin(), waiting_computations.end(), computation));
+      computation->admission = Computation::Admission::DONE;
+    }
+    release_slot(computation);
+    return;
+  }
+  if (!computation->image)
+  {
+    for (auto band = 0; band < min_band_to_send; band++)
+    {
+      computation->bands[band].buffer.reset();
+    }
+  }
+  if (computation->admission == Computation::Admission::WAITING)
+  {
+    return;
+  }
+
+  while (computation->next_band_to_compute < num_bands &&
+         computation->next_band_to_compute - min_band_to_send < STREAM_WINDOW)
   {
-    // We can send all pixels in this message
-    // Serialize and send the message
-    response.pixels = std::move(session.pixels);
-    response.last_message = true;
-    const auto buffer = Protocol::serialize(response);
-    session.connection->write(buffer.data(), buffer.size());
+    const auto band = computation->next_band_to_compute;
+    computation->next_band_to_compute += 1;
 
-    // Make sure that the Session's pixels vector is cleared
-    // (moving from it leaves it in an unspecified but defined state)
-    session.pixels.clear();
+    // The whole image is only written by the workers, band by band, so rows
+    // of bands that are computed can be read while this band is computed
+    auto mirror_rows = computation->image &&
+                       !(computation->keep_states || computation->resume.pixels || computation->progressive)
+                     ? get_mirror_rows(*computation, band)
+                     : std::vector<int>();
+
+    // Bands of the session's computation are interleaved with those of the other sessions
+    const auto cost = static_cast<double>(computation->bands[band].size) *
+                      std::max(1u, computation->request->max_iter);
+    worker_pool->submit(computation->flow,
+                        cost,
+                        [computation,
+                         request = computation->request,
+                         image = computation->image,
+                         reuse = computation->reuse,
+                         resume = computation->resume,
+                         keep_states = computation->keep_states,
+                         cancelled = computation->cancelled,
+                         stop = computation->stop,
+                         deadline = computation->deadline,
+                         progressive = computation->progressive,
+                         lattice = computation->bands[band],
+                         mirror_rows = std::move(mirror_rows),
+                         band]()
+    {
+      if (cancelled->load())
+      {
+        // Abandoned while waiting in the worker pool
+        TcpBackend::post([computation, band]()
+        {
+          on_band_computed(computation, band, nullptr, Mandelbrot::Stats(), Mandelbrot::ResumeState(), false);
+        });
+        return;
+      }
+
+      // Render directly into the whole image, or into a buffer for the band,
+      // that is then handed over to the network thread. The coarse pass writes
+      // every pixel of the rows, so with progressive rendering it must not be
+      // written into the whole image, where other passes are computed
+      const auto width = static_cast<int>(request->image_width);
+      const auto height = static_cast<int>(request->image_height);
+      const auto y = lattice.y;
+      const auto rows = lattice.rows;
+      auto partial = std::chrono::steady_clock::now() >= deadline;
+      const auto into_image = image && !(progressive && partial);
+      auto buffer = into_image ? image : std::make_shared<std::vector<std::uint8_t>>(static_cast<std::size_t>(width) * rows);
+      auto* pixels = into_image ? image->data() + static_cast<std::size_t>(y) * width : buffer->data();
+      auto stats = std::make_shared<Mandelbrot::Stats>();
+      auto state = std::make_shared<Mandelbrot::ResumeState>();
+      if (partial)
+      {
+        // Too late to compute the band, send a coarse pass of it instead
+        compute_coarse(*request, y, rows, pixels, stats.get());
+      }
+      else if (progressive)
+      {
+        compute_pass(*request, reuse, lattice, stop.get(), pixels, stats.get());
+      }
+      else
+      {
+        if (resume.pixels)
+        {
+          // Continue the pixels that did not escape in the previous image
+          const auto begin = resume.pixels->begin() + static_cast<std::size_t>(y) * width;
+          std::copy(begin, begin + static_cast<std::size_t>(rows) * width, pixels);
+          *state = (*resume.states)[band];
+        }
+        if (!(keep_states || resume.pixels) ||
+            !Mandelbrot::compute_resumable(request->center_re,
+                                           request->center_im,
+                                           request->min_c,
+                                           request->max_c,
+                                           width,
+                                           height,
+                                           request->max_iter,
+                                           { 0, y, width, rows },
+                                           pixels,
+                                           width,
+                                           state.get(),
+                                           stats.get(),
+                                           stop.get()))
+        {
+          *state = Mandelbrot::ResumeState();
+
+          // Copy the rows that mirror computed rows, compute the rows in between
+          auto y_begin = y;
+          for (auto i = 0; i <= rows; i++)
+          {
+            if (i < rows && (mirror_rows.empty() || mirror_rows[i] < 0))
+            {
+              continue;
+            }
+            compute_rect(*request,
+                         reuse,
+                         { 0, y_begin, width, y + i - y_begin },
+                         stop.get(),
+                         pixels + static_cast<std::size_t>(y_begin - y) * width,
+                         stats.get());
+            if (i < rows)
+            {
+              const auto from = image->begin() + static_cast<std::size_t>(mirror_rows[i]) * width;
+              std::copy(from, from + width, pixels + static_cast<std::size_t>(i) * width);
+            }
+            y_begin = y + i + 1;
+          }
+        }
+      }
+      if (!partial && stop->load() && !cancelled->load())
+      {
+        // The deadline passed while the band was computed, so some of its rows
+        // may be missing. Send a coarse pass of it instead
+        partial = true;
+        *state = Mandelbrot::ResumeState();
+        if (progressive && image)
+        {
+          buffer = std::make_shared<std::vector<std::uint8_t>>(static_cast<std::size_t>(width) * rows);
+          pixels = buffer->data();
+        }
+        compute_coarse(*request, y, rows, pixels, stats.get());
+      }
+      if (progressive)
+      {
+        buffer = collect_pass_pixels(width, lattice, pixels);
+      }
+
+      TcpBackend::post([computation, band, buffer, stats, state, partial]()
+      {
+        on_band_computed(computation, band, buffer, *stats, std::move(*state), partial);
+      });
+    });
   }
-  else
+}
+
+/**
+ * @brief Makes a computation active, it must have a free slot
+ *
+ * @param[in]  computation  The computation
+ */
+static void activate(const std::shared_ptr<Computation>& computation)
+{
+  computation->admission = Computation::Admission::ACTIVE;
+  computation->time_admitted = std::chrono::steady_clock::now();
+  num_active += 1;
+  update_computation(computation);
+}
+
+/**
+ * @brief Admits waiting computations while there are free slots
+ *
+ * The computation with the lowest estimated cost, reduced by how long it has
+ * waited, is admitted first: shortest expected job first, with aging.
+ */
+static void admit_computations()
+{
+  while (num_active < max_active && !waiting_computations.empty())
   {
-    // Move as many pixels as possible (2^15) from Session's pixels vector
-    // to Response's pixels vector
-    response.pixels.insert(response.pixels.end(),
-                           session.pixels.begin(),
-                           session.pixels.begin() + (1u << 15));
-    session.pixels.erase(session.pixels.begin(), session.pixels.begin() + (1u << 15));
+    const auto now = std::chrono::steady_clock::now();
+    const auto it = std::min_element(waiting_computations.begin(),
+                                     waiting_computations.end(),
+                                     [now](const std::shared_ptr<Computation>& a, const std::shared_ptr<Computation>& b)
+                                     {
+                                       return aged_cost(*a, now) < aged_cost(*b, now);
+                                     });
+    const auto computation = *it;
+    waiting_computations.erase(it);
+    LOG_INFO("The request from session %d was admitted after waiting %dms",
+             computation->session_id,
+             std::chrono::duration_cast<std::chrono::milliseconds>(now - computation->time_begin).count());
+    activate(computation);
+  }
+}
+
+/**
+ * @brief Frees the slot of an active computation when all its bands are computed,
+ *        or when it is abandoned and none of its bands are being computed
+ *
+ * @param[in]  computation  The computation
+ */
+static void release_slot(const std::shared_ptr<Computation>& computation)
+{
+  if (computation->admission == Computation::Admission::ACTIVE &&
+      (computation->num_bands_computed == static_cast<int>(computation->bands.size()) ||
+       (computation->session_ids.empty() && computation->num_bands_computed == computation->next_band_to_compute)))
+  {
+    computation->admission = Computation::Admission::DONE;
+    num_active -= 1;
+    admit_computations();
+  }
+}
 
-    // Send the Response
-    response.last_message = false;
-    const auto buffer = Protocol::serialize(response);
-    session.connection->write(buffer.data(), buffer.size());
+/**
+ * @brief Attaches a session to a computation, from its first band
+ *
+ * @param[in]  session_id   Id of the session
+ * @param[in]  computation  The computation
+ */
+static void attach(int session_id, const std::shared_ptr<Computation>& computation)
+{
+  auto& session = sessions.at(session_id);
+  session.computation       = computation;
+  session.next_band_to_send = 0;
+  session.sent              = 0;
+  computation->session_ids.push_back(session_id);
+}
+
+/**
+ * @brief Detaches a session from its computation, if any
+ *
+ * @param[in]  session_id   Id of the session
+ */
+static void detach(int session_id)
+{
+  auto& session = sessions.at(session_id);
+  const auto computation = std::move(session.computation);
+  session.computation.reset();
+  if (computation)
+  {
+    auto& ids = computation->session_ids;
+    ids.erase(std::remove(ids.begin(), ids.end(), session_id), ids.end());
+    if (computation->flow == session_id && !ids.empty())
+    {
+      // The bands are now scheduled as, and charged to, a session that is still attached
+      worker_pool->move_flow(session_id, ids.front());
+      computation->flow = ids.front();
+    }
+    update_computation(computation);
   }
 }
 
@@ -92,17 +1182,151 @@ static void send_response(int session_id)
 static void on_disconnected(int session_id)
 {
   LOG_INFO("Session %d disconnected", session_id);
+  detach(session_id);
   sessions.erase(session_id);
 }
 
+/**
+ * @brief Called in the network thread when a band has been computed
+ *
+ * The band is sent to the attached sessions that are waiting for it.
+ * If all sessions have disconnected or cancelled while the computation was
+ * ongoing the band may not have been computed, it is dropped.
+ *
+ * @param[in]  computation  The computation
+ * @param[in]  band         Index of the band
+ * @param[in]  buffer       Buffer with the computed pixels
+ * @param[in]  stats        Statistics from the computation
+ * @param[in]  state        Iteration state of the band, empty if not kept
+ * @param[in]  partial      True if the band was computed from a coarse pass
+ */
+static void on_band_computed(const std::shared_ptr<Computation>& computation,
+                             int band,
+                             const std::shared_ptr<const std::vector<std::uint8_t>>& buffer,
+                             const Mandelbrot::Stats& stats,
+                             Mandelbrot::ResumeState&& state,
+                             bool partial)
+{
+  if (computation->cancelled->load())
+  {
+    // Log when the last submitted band is done
+    computation->num_bands_computed += 1;
+    if (computation->num_bands_computed == computation->next_band_to_compute)
+    {
+      LOG_INFO("All sessions disconnected or cancelled before the request from session %d was computed",
+               computation->session_id);
+    }
+    release_slot(computation);
+    return;
+  }
+
+  computation->bands[band].buffer = buffer;
+  computation->bands[band].partial = partial;
+  computation->partial = computation->partial || partial;
+  if (computation->keep_states)
+  {
+    computation->states[band] = std::move(state);
+  }
+  computation->stats += stats;
+  computation->stats.engine = stats.engine;
+  computation->num_bands_computed += 1;
+  if (computation->num_bands_computed == static_cast<int>(computation->bands.size()))
+  {
+    const auto time_end = std::chrono::steady_clock::now();
+    LOG_INFO("The request from session %d took %dms (%ds) to compute (engine: %s, sessions: %zu%s)",
+             computation->session_id,
+             std::chrono::duration_cast<std::chrono::milliseconds>(time_end - computation->time_admitted).count(),
+             std::chrono::duration_cast<std::chrono::seconds>(time_end - computation->time_admitted).count(),
+             Mandelbrot::engine_to_str(computation->stats.engine),
+             computation->session_ids.size(),
+             computation->partial ? ", partial" : "");
+    const auto num_pixels = static_cast<double>(computation->request->image_width) * computation->request->image_height;
+    LOG_INFO("Pixels computed: %llu (%.1f%%), supersampled: %llu, iterations computed: %llu, skipped (interior): %llu",
+             static_cast<unsigned long long>(computation->stats.pixels_computed),
+             num_pixels > 0.0 ? 100.0 * computation->stats.pixels_computed / num_pixels : 100.0,
+             static_cast<unsigned long long>(computation->stats.pixels_supersampled),
+             static_cast<unsigned long long>(computation->stats.iterations),
+             static_cast<unsigned long long>(computation->stats.iterations_skipped));
+
+    // Later identical requests are served from the result cache instead
+    const auto it = computations.find(computation->key);
+    if (it != computations.end() && it->second == computation)
+    {
+      computations.erase(it);
+    }
+
+    // A partial image is not cached, so that the request can be sent again to refine it
+    if (computation->image && !computation->partial)
+    {
+      // The states are only useful if every band has one
+      ResultCache::States states;
+      if (computation->keep_states &&
+          std::all_of(computation->states.begin(),
+                      computation->states.end(),
+                      [](const Mandelbrot::ResumeState& state) { return state.max_iter > 0; }))
+      {
+        states = std::make_shared<const std::vector<Mandelbrot::ResumeState>>(std::move(computation->states));
+      }
+      computation->states.clear();
+      result_cache->put(*computation->request, computation->image, std::move(states));
+      log_cache_stats();
+    }
+  }
+  release_slot(computation);
+
+  for (const auto session_id : computation->session_ids)
+  {
+    send_response(session_id);
+  }
+}
+
+/**
+ * @brief Called when a session has read a Cancel message
+ *
+ * The session is detached from its computation, which is cancelled if no other
+ * session is attached to it, and its last Response is sent with status
+ * RESPONSE_STATUS_CANCELLED. Ignored if the session has no ongoing request, or
+ * if its last Response is already being sent.
+ *
+ * @param[in]  session_id  Id of the session that has read a Cancel message
+ */
+static void on_cancel(int session_id)
+{
+  auto& session = sessions.at(session_id);
+  const auto& computation = session.computation;
+  if (!computation ||
+      (session.writing &&
+       session.next_band_to_send == static_cast<int>(computation->bands.size()) - 1 &&
+       session.sent == computation->bands.back().size))
+  {
+    LOG_DEBUG("%s: session_id=%d: no ongoing request, ignored", __func__, session_id);
+    return;
+  }
+
+  LOG_INFO("Session %d cancelled its request", session_id);
+  detach(session_id);
+  if (session.writing)
+  {
+    session.send_cancelled = true;
+    return;
+  }
+  send_status(session_id, Protocol::RESPONSE_STATUS_CANCELLED);
+}
+
 /**
  * @brief Callback called when a session has read a message
  *
- * The only message that is read is Request, so if we cannot deserialize
- * as a Request then we close the session.
+ * The messages that are read are Request and Cancel, @see on_cancel. If we
+ * cannot deserialize the message, or if a Request is received while one is
+ * ongoing, we close the session. The session keeps reading while the response
+ * is sent.
  *
- * The Mandelbrot pixels are computated and added to session's pixels vector
- * and we then start sending a response to the session.
+ * The request is served from the result cache, attached to an ongoing
+ * computation of an identical request or computed in bands by the worker pool,
+ * so that the network thread can continue to serve other sessions,
+ * @see on_band_computed. A request that must be computed waits for a free slot,
+ * @see admit_computations, or is answered with RESPONSE_STATUS_BUSY if too
+ * many requests are waiting already.
  *
  * @param[in]  session_id  Id of the session that has read a message
  * @param[in]  buffer      Message data
@@ -111,9 +1335,18 @@ static void on_disconnected(int session_id)
 static void on_read(int session_id, const std::uint8_t* buffer, int len)
 {
   auto& session = sessions.at(session_id);
+  const auto data = std::vector<std::uint8_t>(buffer, buffer + len);
+
+  Protocol::Cancel cancel;
+  if (Protocol::deserialize(data, &cancel))
+  {
+    on_cancel(session_id);
+    session.connection->read();
+    return;
+  }
 
-  Protocol::Request request;
-  if (!Protocol::deserialize(std::vector<std::uint8_t>(buffer, buffer + len), &request))
+  auto request = std::make_shared<Protocol::Request>();
+  if (!Protocol::deserialize(data, request.get()))
   {
     LOG_ERROR("%s: session_id=%d: could not deseralize Request message, closing session",
               __func__,
@@ -122,40 +1355,145 @@ static void on_read(int session_id, const std::uint8_t* buffer, int len)
     return;
   }
 
-  LOG_INFO("Received request from session %d: (%.2lf, %.2lf)..(%.2lf, %.2lf) (%d, %d) %d",
-           session_id,
-           request.min_c.real(),
-           request.min_c.imag(),
-           request.max_c.real(),
-           request.max_c.imag(),
-           request.image_width,
-           request.image_height,
-           request.max_iter);
-
-  const auto time_begin = std::chrono::steady_clock::now();
-  const auto pixels = Mandelbrot::compute(request.min_c,
-                                          request.max_c,
-                                          request.image_width,
-                                          request.image_height,
-                                          request.max_iter);
-  const auto time_end = std::chrono::steady_clock::now();
-
-  LOG_INFO("The request from session %d took %dms (%ds) to compute",
+  if (session.computation || session.writing)
+  {
+    LOG_ERROR("%s: session_id=%d: received a Request while a request is ongoing, closing session",
+              __func__,
+              session_id);
+    session.connection->close();
+    return;
+  }
+
+  // Continue to read while the response is sent, to notice a Cancel message or a disconnect
+  session.connection->read();
+
+  LOG_INFO("Received request from session %d: (%.2lf, %.2lf)..(%.2lf, %.2lf) (%d, %d) %d flags=0x%x deadline=%dms",
            session_id,
-           std::chrono::duration_cast<std::chrono::milliseconds>(time_end - time_begin).count(),
-           std::chrono::duration_cast<std::chrono::seconds>(time_end - time_begin).count());
+           request->min_c.real(),
+           request->min_c.imag(),
+           request->max_c.real(),
+           request->max_c.imag(),
+           request->image_width,
+           request->image_height,
+           request->max_iter,
+           request->flags,
+           request->deadline_ms);
 
-  // Add (move) the pixels to the session object and start sending a response
-  session.pixels = std::move(pixels);
+  // Only requests with the same passes share a computation, and requests with
+  // a deadline never do: it counts from when each request is received, so an
+  // attached request would only get what is left of the first one's budget.
+  // The pixels don't depend on them otherwise, so they are not part of the
+  // request that is looked up in and added to the result cache
+  const auto key = Protocol::serialize(*request);
+  const auto deadline_ms = request->deadline_ms;
+  const auto progressive = (request->flags & Protocol::REQUEST_FLAG_PROGRESSIVE) != 0;
+  request->deadline_ms = 0u;
+  request->flags &= ~Protocol::REQUEST_FLAG_PROGRESSIVE;
+  std::shared_ptr<Computation> computation;
+  auto created = false;
+  const auto it = deadline_ms > 0u ? computations.end() : computations.find(key);
+  if (it != computations.end())
+  {
+    computation = it->second;
+    LOG_INFO("The request from session %d is attached to the identical request from session %d",
+             session_id,
+             computation->session_id);
+  }
+  else if (const auto cached = result_cache->get(*request))
+  {
+    computation = create_computation(request, key, session_id, cached, progressive);
+    LOG_INFO("The request from session %d was found in the result cache", session_id);
+    log_cache_stats();
+  }
+  else if (num_active >= max_active && waiting_computations.size() >= max_waiting)
+  {
+    LOG_INFO("The request from session %d was rejected, %zu requests are waiting",
+             session_id,
+             waiting_computations.size());
+    send_status(session_id, Protocol::RESPONSE_STATUS_BUSY);
+    return;
+  }
+  else
+  {
+    computation = create_computation(request, key, session_id, nullptr, progressive);
+    created = true;
+    if (deadline_ms == 0u)
+    {
+      computations[key] = computation;
+    }
+    else
+    {
+      // The bands that are being computed when the deadline passes are stopped
+      computation->deadline = computation->time_begin + std::chrono::milliseconds(deadline_ms);
+      TcpBackend::post_delayed(std::chrono::milliseconds(deadline_ms), [stop = computation->stop]()
+      {
+        stop->store(true);
+      });
+    }
+
+    // Only continue the pixels that did not escape with a lower max_iter, or only
+    // compute the newly exposed pixels of a panned image
+    const auto iterates_pixels = !(request->flags & (Protocol::REQUEST_FLAG_MARIANI_SILVER |
+                                                     Protocol::REQUEST_FLAG_SUPERSAMPLING));
+    if (computation->image && keep_states && iterates_pixels && !computation->progressive)
+    {
+      find_resume(*request, &computation->resume);
+    }
+    if (computation->resume.pixels)
+    {
+      LOG_INFO("The request from session %d continues a previous request with a lower max_iter",
+               session_id);
+    }
+    else
+    {
+      find_reuse(*request, &computation->reuse);
+      if (computation->reuse.pixels)
+      {
+        LOG_INFO("The request from session %d reuses pixels of a previous request (offset %d, %d)",
+                 session_id,
+                 computation->reuse.offset_x,
+                 computation->reuse.offset_y);
+      }
+    }
+
+    // Panned images have no state for the reused pixels, Mariani-Silver fills
+    // in pixels without iterating them and supersampled pixels have many samples.
+    // With progressive rendering the bands are not rows of the image, and the
+    // state is always computed in double precision, which previews do not need
+    computation->keep_states = computation->image &&
+                               keep_states &&
+                               !computation->reuse.pixels &&
+                               iterates_pixels &&
+                               !computation->progressive &&
+                               !(request->flags & Protocol::REQUEST_FLAG_PREVIEW);
+    computation->states.resize(computation->keep_states ? computation->bands.size() : 0u);
+  }
+
+  attach(session_id, computation);
+  if (created)
+  {
+    if (num_active < max_active)
+    {
+      activate(computation);
+    }
+    else
+    {
+      waiting_computations.push_back(computation);
+      LOG_INFO("The request from session %d is waiting for a free slot (%zu waiting)",
+               session_id,
+               waiting_computations.size());
+    }
+  }
+  update_computation(computation);
   send_response(session_id);
 }
 
 /**
  * @brief Callback called when a session has written a message
  *
- * If the session has more pixels to send we do that, otherwise
- * we re-start the read procedure to see if the client has more
- * requests.
+ * If the current band has more pixels we send them, otherwise we continue
+ * with the next band. When all bands are sent the session is detached, and
+ * the client may send its next request.
  *
  * @param[in]  session_id  Id of the session that has written a message
  */
@@ -163,21 +1501,44 @@ static void on_write(int session_id)
 {
   LOG_DEBUG("%s: session_id=%d", __func__, session_id);
 
-  // Check if there are more pixels to send
   auto& session = sessions.at(session_id);
-  if (!session.pixels.empty())
+  session.writing = false;
+
+  // Without a computation the last Response was a status, or the request was
+  // cancelled during this write and the last Response is still to be sent
+  const auto computation = session.computation;
+  if (!computation)
+  {
+    if (session.send_cancelled)
+    {
+      session.send_cancelled = false;
+      send_status(session_id, Protocol::RESPONSE_STATUS_CANCELLED);
+    }
+    return;
+  }
+
+  // Check if there are more pixels to send in the current band
+  if (session.sent < computation->bands[session.next_band_to_send].size)
   {
     send_response(session_id);
+    return;
   }
-  else
+
+  session.next_band_to_send += 1;
+  session.sent = 0;
+  if (session.next_band_to_send == static_cast<int>(computation->bands.size()))
   {
     LOG_INFO("Response successfully sent to session %d", session_id);
-
-    // Restart read procedure to see if the client has more requests
-    session.connection->read();
+    detach(session_id);
+    return;
   }
+
+  // A band has been sent, so there may be room for another one
+  update_computation(computation);
+  send_response(session_id);
 }
 
+
 /**
  * @brief Callback called when an error occurs in a session
  *
@@ -212,6 +1573,8 @@ static void on_accept(std::unique_ptr<TcpBackend::Connection>&& connection)
   // Create Session
   auto& session = sessions[session_id];
   session.connection = std::move(connection);
+  session.writing = false;
+  session.send_cancelled = false;
 
   // Set callbacks
   const auto disconnected  = [session_id]()                                    { on_disconnected(session_id);      };
@@ -227,6 +1590,259 @@ static void on_accept(std::unique_ptr<TcpBackend::Connection>&& connection)
   server->accept();
 }
 
+/**
+ * @brief Parses an integer option value
+ *
+ * @param[in]   str    The string to parse
+ * @param[out]  value  Pointer to where to store the value
+ *
+ * @return true if the whole string is a valid integer, otherwise false
+ */
+static bool parse_int(const std::string& str, int* value)
+{
+  try
+  {
+    std::size_t pos = 0;
+    *value = std::stoi(str, &pos);
+    return pos == str.size();
+  }
+  catch (const std::exception&)
+  {
+    return false;
+  }
+}
+
+/**
+ * @brief Checks the compute kernels and engines on a set of reference views
+ *
+ * 1. Every supported kernel must produce exactly the same pixels as the
+ *    scalar kernel, both in double and in single precision.
+ * 2. Engine::AUTO must produce exactly the same pixels as Engine::DOUBLE on
+ *    every view. With Options::preview, for every view where it selects
+ *    Engine::FLOAT, the single precision pixels may differ from the double
+ *    precision pixels in at most 0.01% of the pixels, @see Mandelbrot::compute.
+ * 3. Continuing the pixels that did not escape with half the max_iter, with
+ *    every supported kernel, must give exactly the same pixels as computing
+ *    in double precision directly, @see Mandelbrot::compute_resumable.
+ *
+ * @return true if all checks passed, otherwise false
+ */
+static bool run_self_test()
+{
+  static const struct
+  {
+    std::complex<double> min_c;
+    std::complex<double> max_c;
+    int size;
+    int max_iter;
+  } views[] =
+  {
+    { { -2.0,  -2.0  }, { 2.0,   2.0  },   64,   64 },
+    { { -2.0,  -2.0  }, { 2.0,   2.0  },  256,   64 },
+    { { -2.0,  -2.0  }, { 2.0,   2.0  }, 1024,   64 },
+    { { -2.0,  -1.5  }, { 1.0,   1.5  },  256,   32 },
+    { { -2.0,  -1.5  }, { 1.0,   1.5  },  768,   64 },
+    { { -2.0,  -2.0  }, { 2.0,   2.0  },  512,  256 },
+    { { -0.8,   0.0  }, { -0.7,  0.1  },  512, 1024 },
+    { { -0.75,  0.1  }, { -0.74, 0.11 },  256,  256 },
+  };
+  static const auto max_preview_mismatch = 0.0001;
+
+  const auto kernel = Mandelbrot::get_kernel();
+  auto passed = true;
+  for (const auto& view : views)
+  {
+    const auto compute = [&view](Mandelbrot::Kernel kernel,
+                                 Mandelbrot::Engine engine,
+                                 Mandelbrot::Stats* stats,
+                                 bool preview = false)
+    {
+      Mandelbrot::set_kernel(kernel);
+      Mandelbrot::Options options;
+      options.engine = engine;
+      options.preview = preview;
+      return Mandelbrot::compute(view.min_c, view.max_c, view.size, view.size, view.max_iter, options, stats);
+    };
+
+    // Every kernel must be bit-identical to the scalar kernel
+    for (const auto engine : { Mandelbrot::Engine::FLOAT, Mandelbrot::Engine::DOUBLE })
+    {
+      const auto scalar_pixels = compute(Mandelbrot::Kernel::SCALAR, engine, nullptr);
+      for (const auto other : { Mandelbrot::Kernel::SSE2, Mandelbrot::Kernel::AVX2, Mandelbrot::Kernel::AVX512 })
+      {
+        if (Mandelbrot::is_supported(other) && compute(other, engine, nullptr) != scalar_pixels)
+        {
+          LOG_ERROR("Kernel %s (%s) differs from the scalar kernel",
+                    Mandelbrot::kernel_to_str(other),
+                    Mandelbrot::engine_to_str(engine));
+          passed = false;
+        }
+      }
+    }
+
+    // Resuming must be bit-identical to computing directly
+    const auto double_pixels_scalar = compute(Mandelbrot::Kernel::SCALAR, Mandelbrot::Engine::DOUBLE, nullptr);
+    for (const auto other : { Mandelbrot::Kernel::SCALAR, Mandelbrot::Kernel::AVX2, Mandelbrot::Kernel::AVX512 })
+    {
+      if (!Mandelbrot::is_supported(other))
+      {
+        continue;
+      }
+
+      Mandelbrot::set_kernel(other);
+      std::vector<std::uint8_t> pixels(static_cast<std::size_t>(view.size) * view.size);
+      Mandelbrot::ResumeState state;
+      for (const auto max_iter : { view.max_iter / 2, view.max_iter })
+      {
+        Mandelbrot::compute_resumable({},
+                                      {},
+                                      view.min_c,
+                                      view.max_c,
+                                      view.size,
+                                      view.size,
+                                      max_iter,
+                                      { 0, 0, view.size, view.size },
+                                      pixels.data(),
+                                      view.size,
+                                      &state);
+      }
+      if (pixels != double_pixels_scalar)
+      {
+        LOG_ERROR("Kernel %s (resumed) differs from the scalar kernel", Mandelbrot::kernel_to_str(other));
+        passed = false;
+      }
+    }
+
+    // The automatic engine must not change any pixel, previews only a few
+    Mandelbrot::Stats stats;
+    const auto auto_pixels = compute(kernel, Mandelbrot::Engine::AUTO, nullptr);
+    compute(kernel, Mandelbrot::Engine::AUTO, &stats, true);
+    const auto float_pixels = compute(kernel, Mandelbrot::Engine::FLOAT, nullptr);
+    const auto double_pixels = compute(kernel, Mandelbrot::Engine::DOUBLE, nullptr);
+    auto num_mismatches = 0;
+    for (auto i = 0u; i < float_pixels.size(); i++)
+    {
+      num_mismatches += float_pixels[i] != double_pixels[i] ? 1 : 0;
+    }
+    const auto mismatch = static_cast<double>(num_mismatches) / float_pixels.size();
+    const auto ok = auto_pixels == double_pixels &&
+                    (stats.engine != Mandelbrot::Engine::FLOAT || mismatch <= max_preview_mismatch);
+    LOG_INFO("(%.2lf, %.2lf)..(%.2lf, %.2lf) (%d, %d) %d: preview engine: %s, float vs double: %d pixels (%.4f%%) differ%s",
+             view.min_c.real(),
+             view.min_c.imag(),
+             view.max_c.real(),
+             view.max_c.imag(),
+             view.size,
+             view.size,
+             view.max_iter,
+             Mandelbrot::engine_to_str(stats.engine),
+             num_mismatches,
+             100.0 * mismatch,
+             ok ? "" : " FAILED");
+    passed = passed && ok;
+  }
+
+  Mandelbrot::set_kernel(kernel);
+  LOG_INFO("Self-test %s", passed ? "passed" : "failed");
+  return passed;
+}
+
+/**
+ * @brief Compares the specialized and the generic kernels on a set of reference views
+ *
+ * Each view is computed with the current kernel and number of threads, once
+ * with the kernel variant selected for it and once with the generic variant,
+ * @see Mandelbrot::set_specialized_kernels. The best time of a few runs is
+ * logged for both, and the pixels must be the same.
+ *
+ * @return true if all views gave the same pixels, otherwise false
+ */
+static bool run_benchmark()
+{
+  static const struct
+  {
+    const char* name;
+    std::complex<double> min_c;
+    std::complex<double> max_c;
+    int size;
+    int max_iter;
+  } views[] =
+  {
+    { "full",     { -2.0,  -1.5  }, { 1.0,   1.5  }, 800,  100 },
+    { "full",     { -2.0,  -1.5  }, { 1.0,   1.5  }, 800,  256 },
+    { "full",     { -2.0,  -1.5  }, { 1.0,   1.5  }, 800, 1000 },
+    { "boundary", { -0.8,   0.0  }, { -0.7,  0.1  }, 600,  128 },
+    { "boundary", { -0.8,   0.0  }, { -0.7,  0.1  }, 600, 1024 },
+    { "seahorse", { -0.76,  0.09 }, { -0.74, 0.11 }, 600, 5000 },
+    { "outside",  { 0.6,    0.6  }, { 1.0,   1.0  }, 800, 1000 },
+  };
+  static const auto num_runs = 5;
+
+  LOG_INFO("Benchmark, kernel: %s, threads: %d",
+           Mandelbrot::kernel_to_str(Mandelbrot::get_kernel()),
+           Mandelbrot::get_num_threads());
+  const auto specialized = Mandelbrot::get_specialized_kernels();
+  auto passed = true;
+  for (const auto& view : views)
+  {
+    std::vector<std::uint8_t> pixels[2];
+    long long best_us[2];
+    for (auto variant = 0; variant < 2; variant++)
+    {
+      // 0: generic, 1: specialized
+      Mandelbrot::set_specialized_kernels(variant == 1);
+      Mandelbrot::Options options;
+      options.engine = Mandelbrot::Engine::DOUBLE;
+      best_us[variant] = std::numeric_limits<long long>::max();
+      for (auto run = 0; run < num_runs; run++)
+      {
+        const auto start = std::chrono::steady_clock::now();
+        pixels[variant] = Mandelbrot::compute(view.min_c, view.max_c, view.size, view.size, view.max_iter, options);
+        const auto end = std::chrono::steady_clock::now();
+        best_us[variant] = std::min(best_us[variant],
+                                    static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()));
+      }
+    }
+
+    const auto same = pixels[0] == pixels[1];
+    LOG_INFO("%-8s (%d, %d) %4d: generic: %lld us, specialized: %lld us (%+.1f%%)%s",
+             view.name,
+             view.size,
+             view.size,
+             view.max_iter,
+             best_us[0],
+             best_us[1],
+             100.0 * (best_us[1] - best_us[0]) / std::max(1ll, best_us[0]),
+             same ? "" : " DIFFERENT PIXELS");
+    passed = passed && same;
+  }
+
+  Mandelbrot::set_specialized_kernels(specialized);
+  return passed;
+}
+
+/**
+ * @brief Print usage
+ *
+ * @param[in]  argv0  Name of the program
+ */
+static void print_usage(const char* argv0)
+{
+  fprintf(stderr,
+          "usage: %s [--kernel=auto|scalar|sse2|avx2|avx512] [--threads=N] [--jobs=N] [--max-active=N] [--queue-size=N] [--cache-size=N] [--keep-state] PORT\n"
+          "       %s [--kernel=...] [--threads=N] --self-test\n"
+          "       %s [--kernel=...] [--threads=N] --benchmark\n"
+          "       %s --autotune\n"
+          "\n"
+          "Settings found by --autotune are saved to --tune-file=PATH (default: %s)\n"
+          "and loaded on startup, --kernel and --threads override them.\n",
+          argv0,
+          argv0,
+          argv0,
+          argv0,
+          Autotune::DEFAULT_PATH);
+}
+
 /**
  * @brief Main
  *
@@ -241,21 +1857,184 @@ static void on_accept(std::unique_ptr<TcpBackend::Connection>&& connection)
  */
 int main(int argc, char* argv[])
 {
-  if (argc != 2)
+  // Options are given as --name=value and may be mixed with the PORT argument
+  std::vector<std::string> positional;
+  auto num_jobs = 4;
+  auto queue_size = 64;
+  auto cache_size_mib = 64;
+  auto self_test = false;
+  auto benchmark = false;
+  auto autotune = false;
+  std::string tune_path = Autotune::DEFAULT_PATH;
+  auto kernel = Mandelbrot::Kernel::AUTO;
+  auto kernel_given = false;
+  auto num_threads = 0;
+  for (auto i = 1; i < argc; i++)
   {
-    fprintf(stderr, "usage: %s PORT\n", argv[0]);
+    const auto arg = std::string(argv[i]);
+    if (arg.compare(0, 2, "--") != 0)
+    {
+      positional.push_back(arg);
+      continue;
+    }
+
+    const auto sep = arg.find('=');
+    const auto name = arg.substr(2, sep == std::string::npos ? std::string::npos : sep - 2);
+    const auto value = sep == std::string::npos ? std::string() : arg.substr(sep + 1);
+    if (name == "kernel")
+    {
+      if (!Mandelbrot::kernel_from_str(value, &kernel))
+      {
+        fprintf(stderr, "Invalid kernel: \"%s\"\n", value.c_str());
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      if (!Mandelbrot::is_supported(kernel))
+      {
+        fprintf(stderr, "Kernel \"%s\" is not supported by this CPU\n", value.c_str());
+        return EXIT_FAILURE;
+      }
+      kernel_given = true;
+    }
+    else if (name == "threads")
+    {
+      if (!parse_int(value, &num_threads) || num_threads <= 0)
+      {
+        fprintf(stderr, "Invalid number of threads: \"%s\"\n", value.c_str());
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (name == "jobs")
+    {
+      if (!parse_int(value, &num_jobs) || num_jobs <= 0)
+      {
+        fprintf(stderr, "Invalid number of jobs: \"%s\"\n", value.c_str());
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (name == "max-active")
+    {
+      if (!parse_int(value, &max_active) || max_active <= 0)
+      {
+        fprintf(stderr, "Invalid number of active requests: \"%s\"\n", value.c_str());
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (name == "queue-size")
+    {
+      if (!parse_int(value, &queue_size) || queue_size < 0)
+      {
+        fprintf(stderr, "Invalid queue size: \"%s\"\n", value.c_str());
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (name == "cache-size")
+    {
+      if (!parse_int(value, &cache_size_mib) || cache_size_mib < 0)
+      {
+        fprintf(stderr, "Invalid cache size: \"%s\"\n", value.c_str());
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (name == "keep-state" && sep == std::string::npos)
+    {
+      keep_states = true;
+    }
+    else if (name == "self-test" && sep == std::string::npos)
+    {
+      self_test = true;
+    }
+    else if (name == "benchmark" && sep == std::string::npos)
+    {
+      benchmark = true;
+    }
+    else if (name == "autotune" && sep == std::string::npos)
+    {
+      autotune = true;
+    }
+    else if (name == "tune-file" && !value.empty())
+    {
+      tune_path = value;
+    }
+    else
+    {
+      fprintf(stderr, "Unknown option: \"%s\"\n", arg.c_str());
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // --self-test, --benchmark and --autotune run instead of the server, one at a time
+  const auto num_modes = (self_test ? 1 : 0) + (benchmark ? 1 : 0) + (autotune ? 1 : 0);
+  if (num_modes > 1 || (num_modes == 1 && !positional.empty()))
+  {
+    fprintf(stderr, "--self-test, --benchmark and --autotune can not be combined with each other or with PORT\n");
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (autotune)
+  {
+    const auto settings = Autotune::run();
+    LOG_INFO("Fastest settings, kernel: %s, specialized kernels: %s, threads: %d, band height: %d",
+             Mandelbrot::kernel_to_str(settings.kernel),
+             settings.specialized_kernels ? "yes" : "no",
+             settings.num_threads,
+             settings.band_height);
+    if (!Autotune::save(tune_path, settings))
+    {
+      return EXIT_FAILURE;
+    }
+    LOG_INFO("Saved tuned settings to %s", tune_path.c_str());
+    return EXIT_SUCCESS;
+  }
+
+  // Tuned settings are applied first so that --kernel and --threads override them
+  auto settings = Autotune::current();
+  if (Autotune::load(tune_path, &settings))
+  {
+    Autotune::apply(settings);
+    LOG_INFO("Loaded tuned settings from %s", tune_path.c_str());
+  }
+  if (kernel_given)
+  {
+    Mandelbrot::set_kernel(kernel);
+  }
+  if (num_threads > 0)
+  {
+    Mandelbrot::set_num_threads(num_threads);
+  }
+
+  if (self_test)
+  {
+    return run_self_test() ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (benchmark)
+  {
+    return run_benchmark() ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (positional.size() != 1u)
+  {
+    print_usage(argv[0]);
     return EXIT_FAILURE;
   }
 
   int port = 0;
   try
   {
-    port = std::stoi(argv[1]);
+    port = std::stoi(positional[0]);
   }
   catch (const std::exception& e)
   {
     fprintf(stderr, "exception: %s\n", e.what());
-    fprintf(stderr, "usage: %s PORT\n", argv[0]);
+    print_usage(argv[0]);
     return EXIT_FAILURE;
   }
 
@@ -266,6 +2045,18 @@ int main(int argc, char* argv[])
     return EXIT_FAILURE;
   }
 
+  LOG_INFO("Using Mandelbrot kernel: %s, threads: %d, jobs: %d, max active: %d, queue size: %d, cache size: %d MiB",
+           Mandelbrot::kernel_to_str(Mandelbrot::get_kernel()),
+           Mandelbrot::get_num_threads(),
+           num_jobs,
+           max_active,
+           queue_size,
+           cache_size_mib);
+
+  // Create the worker threads that compute requests and the result cache
+  worker_pool = std::make_unique<WorkerPool>(num_jobs, WORKER_POOL_QUANTUM);
+  max_waiting = static_cast<std::size_t>(queue_size);
+  result_cache = std::make_unique<ResultCache>(static_cast<std::size_t>(cache_size_mib) << 20);
   LOG_INFO("Listening on port: %d", port);
 
   // Create and start TCP server
@@ -291,7 +2082,9 @@ int main(int argc, char* argv[])
 
   // Explicitly delete static stuff here so that we can control
   // the order
+  worker_pool.reset();
   sessions.clear();
+  result_cache.reset();
   server.reset();
 
   return EXIT_SUCCESS;
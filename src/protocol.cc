@@ -83,6 +83,27 @@ namespace
     buffer->insert(buffer->end(), val.begin(), val.end());
   }
 
+  template<>
+  void add(std::vector<std::uint8_t>* buffer, const std::vector<double>& val)
+  {
+    // Array of doubles is encoded as:
+    // 1 byte:    number of doubles
+    // n*8 bytes: doubles
+    if (val.size() > 255u)
+    {
+      LOG_ERROR("Trying to add double array with size: %d (maximum size is %d)",
+                static_cast<int>(val.size()),
+                255);
+      exit(EXIT_FAILURE);
+    }
+
+    add<std::uint8_t>(buffer, val.size());
+    for (const auto& value : val)
+    {
+      add(buffer, value);
+    }
+  }
+
   // Helpers for getting values from a byte buffer
 
   template<typename T>
@@ -158,20 +179,52 @@ namespace
     *pos += num_bytes;
     return true;
   }
+
+  template<>
+  bool get(const std::vector<std::uint8_t>& data, int* pos, std::vector<double>* val)
+  {
+    std::uint8_t num_doubles;
+    if (!get(data, pos, &num_doubles)) return false;
+    val->resize(num_doubles);
+    for (auto& value : *val)
+    {
+      if (!get(data, pos, &value)) return false;
+    }
+    return true;
+  }
 }
 
 namespace Protocol
 {
 
+bool get_pass_columns(int y, int pass, int step, int* x, int* x_step)
+{
+  if (y % step != 0)
+  {
+    return false;
+  }
+
+  // The rows of the previous pass already have every other pixel
+  const auto refined = pass > 0 && y % (2 * step) == 0;
+  *x = refined ? step : 0;
+  *x_step = refined ? 2 * step : step;
+  return true;
+}
+
 template<>
 std::vector<std::uint8_t> serialize(const Request& request)
 {
   std::vector<std::uint8_t> buffer;
+  add(&buffer, MESSAGE_TYPE_REQUEST);
   add(&buffer, request.min_c);
   add(&buffer, request.max_c);
   add(&buffer, request.image_width);
   add(&buffer, request.image_height);
   add(&buffer, request.max_iter);
+  add(&buffer, request.flags);
+  add(&buffer, request.center_re);
+  add(&buffer, request.center_im);
+  add(&buffer, request.deadline_ms);
   return buffer;
 }
 
@@ -179,11 +232,36 @@ template<>
 bool deserialize(const std::vector<std::uint8_t>& data, Request* request)
 {
   auto pos = 0;
+  std::uint8_t type;
+  if (!get(data, &pos, &type))                  return false;
+  if (type != MESSAGE_TYPE_REQUEST)             return false;
   if (!get(data, &pos, &request->min_c))        return false;
   if (!get(data, &pos, &request->max_c))        return false;
   if (!get(data, &pos, &request->image_width))  return false;
   if (!get(data, &pos, &request->image_height)) return false;
   if (!get(data, &pos, &request->max_iter))     return false;
+  if (!get(data, &pos, &request->flags))        return false;
+  if (!get(data, &pos, &request->center_re))    return false;
+  if (!get(data, &pos, &request->center_im))    return false;
+  if (!get(data, &pos, &request->deadline_ms))  return false;
+  return true;
+}
+
+template<>
+std::vector<std::uint8_t> serialize(const Cancel&)
+{
+  std::vector<std::uint8_t> buffer;
+  add(&buffer, MESSAGE_TYPE_CANCEL);
+  return buffer;
+}
+
+template<>
+bool deserialize(const std::vector<std::uint8_t>& data, Cancel*)
+{
+  auto pos = 0;
+  std::uint8_t type;
+  if (!get(data, &pos, &type))      return false;
+  if (type != MESSAGE_TYPE_CANCEL)  return false;
   return true;
 }
 
@@ -193,6 +271,10 @@ std::vector<std::uint8_t> serialize(const Response& response)
   std::vector<std::uint8_t> buffer;
   add(&buffer, response.pixels);
   add(&buffer, response.last_message);
+  add(&buffer, response.status);
+  add(&buffer, response.partial);
+  add(&buffer, response.pass);
+  add(&buffer, response.step);
   return buffer;
 }
 
@@ -202,6 +284,10 @@ bool deserialize(const std::vector<std::uint8_t>& data, Response* response)
   auto pos = 0;
   if (!get(data, &pos, &response->pixels))       return false;
   if (!get(data, &pos, &response->last_message)) return false;
+  if (!get(data, &pos, &response->status))       return false;
+  if (!get(data, &pos, &response->partial))      return false;
+  if (!get(data, &pos, &response->pass))         return false;
+  if (!get(data, &pos, &response->step))         return false;
   return true;
 }
 
@@ -8,6 +8,38 @@
 namespace Protocol
 {
 
+/**
+ * @brief Request flags, @see Request::flags
+ */
+constexpr std::uint32_t REQUEST_FLAG_MARIANI_SILVER = 1u << 0;  /**< Use Mariani-Silver
+                                                                     rectangle subdivision */
+constexpr std::uint32_t REQUEST_FLAG_SUPERSAMPLING  = 1u << 1;  /**< Anti-aliasing: pixels at
+                                                                     the boundary of the set are
+                                                                     the average of 4x4 samples */
+constexpr std::uint32_t REQUEST_FLAG_PROGRESSIVE    = 1u << 2;  /**< Progressive rendering: the
+                                                                     image is sent in passes from
+                                                                     coarse to fine, @see Response */
+constexpr std::uint32_t REQUEST_FLAG_PREVIEW        = 1u << 3;  /**< Preview: wide, shallow views
+                                                                     are computed in single
+                                                                     precision, faster but a few
+                                                                     pixels may differ */
+
+/**
+ * @brief Types of the messages that a client sends, the first byte of the message
+ */
+constexpr std::uint8_t MESSAGE_TYPE_REQUEST = 0u;  /**< Request */
+constexpr std::uint8_t MESSAGE_TYPE_CANCEL  = 1u;  /**< Cancel */
+
+/**
+ * @brief Response statuses, @see Response::status
+ */
+constexpr std::uint8_t RESPONSE_STATUS_OK   = 0u;  /**< The pixels of the request */
+constexpr std::uint8_t RESPONSE_STATUS_BUSY = 1u;  /**< The server is full and did not accept the
+                                                        request, it may be sent again later. The
+                                                        message has no pixels and is the last one */
+constexpr std::uint8_t RESPONSE_STATUS_CANCELLED = 2u;  /**< The request was cancelled, the message has
+                                                             no pixels and is the last one */
+
 /**
  * @brief Represents a Request message
  */
@@ -19,10 +51,50 @@ struct Request
   std::uint32_t image_height;  /**< Image height in pixels */
   std::uint32_t max_iter;      /**< Maximum number of iterations
                                     per sample (image pixel) */
+  std::uint32_t flags;         /**< Bitwise OR of REQUEST_FLAG_* */
+  std::vector<double> center_re;  /**< Real value of the center, as a floating
+                                       point expansion (doubles whose exact sum
+                                       is the value). min_c and max_c are
+                                       relative to the center.
+                                       May be empty, maximum 255 doubles */
+  std::vector<double> center_im;  /**< Imaginary value of the center,
+                                       @see center_re */
+  std::uint32_t deadline_ms;      /**< Time budget in milliseconds from when the
+                                       server receives the request, 0 for none.
+                                       Rows that are not computed by then are
+                                       taken from a coarse pass instead,
+                                       @see Response::partial */
+};
+
+/**
+ * @brief Represents a Cancel message
+ *
+ * Abandons the ongoing request of the connection, e.g. a viewport that is no
+ * longer shown, without closing the connection. The client must still read
+ * Response messages until the last one: either the request completed before
+ * the Cancel message was handled, or the last message has status
+ * RESPONSE_STATUS_CANCELLED. Ignored if there is no ongoing request.
+ */
+struct Cancel
+{
 };
 
 /**
  * @brief Represents a Response message
+ *
+ * The pixels of a request are sent in one or more passes, in order. Pass 0
+ * has every step-th pixel of every step-th row of the image. Each following
+ * pass halves the step and has the pixels of its lattice that are not in the
+ * lattice of the previous pass: every step-th pixel of the rows in between
+ * the rows of the previous pass, and the pixels in between the pixels of the
+ * previous pass in its rows. The pixels of a pass are sent row by row, and a
+ * pass may span several messages. The last pass has step 1, so every pixel is
+ * sent exactly once.
+ *
+ * Without REQUEST_FLAG_PROGRESSIVE, and with REQUEST_FLAG_MARIANI_SILVER or
+ * REQUEST_FLAG_SUPERSAMPLING, there is a single pass with step 1: the pixels
+ * of the image row by row. The server may also use fewer passes with
+ * REQUEST_FLAG_PROGRESSIVE, e.g. when the image is already computed.
  */
 struct Response
 {
@@ -32,8 +104,29 @@ struct Response
                                           @see protocol.cc */
   bool last_message;                 /**< True if this is the last
                                           response message */
+  std::uint8_t status;               /**< One of RESPONSE_STATUS_* */
+  bool partial;                      /**< True if the pixels are from a coarse pass
+                                          because the deadline of the request was
+                                          reached, the request can be sent again
+                                          without a deadline to refine them */
+  std::uint8_t pass;                 /**< The pass that the pixels belong to */
+  std::uint8_t step;                 /**< Distance in pixels between the pixels
+                                          of the lattice of the pass */
 };
 
+/**
+ * @brief Gets the pixels of a pass in an image row, @see Response
+ *
+ * @param[in]   y       The image row
+ * @param[in]   pass    The pass, Response::pass
+ * @param[in]   step    Distance between the pixels of the pass, Response::step
+ * @param[out]  x       First column of the pass in the row
+ * @param[out]  x_step  Distance between the columns of the pass in the row
+ *
+ * @return false if the row has no pixels in the pass
+ */
+bool get_pass_columns(int y, int pass, int step, int* x, int* x_step);
+
 /**
  * @brief Serialize a message
  *
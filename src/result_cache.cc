@@ -0,0 +1,106 @@
+#include "result_cache.h"
+
+std::size_t ResultCache::KeyHash::operator()(const Key& key) const
+{
+  // FNV-1a
+  std::uint64_t hash = 14695981039346656037ull;
+  for (const auto byte : key)
+  {
+    hash = (hash ^ byte) * 1099511628211ull;
+  }
+  return static_cast<std::size_t>(hash);
+}
+
+ResultCache::ResultCache(std::size_t max_bytes)
+    : m_entries(),
+      m_index(),
+      m_max_bytes(max_bytes),
+      m_size_bytes(0),
+      m_hits(0),
+      m_misses(0),
+      m_evictions(0)
+{
+}
+
+ResultCache::Pixels ResultCache::get(const Protocol::Request& request)
+{
+  const auto it = m_index.find(Protocol::serialize(request));
+  if (it == m_index.end())
+  {
+    m_misses += 1;
+    return nullptr;
+  }
+
+  m_hits += 1;
+  m_entries.splice(m_entries.begin(), m_entries, it->second);
+  return it->second->pixels;
+}
+
+void ResultCache::put(const Protocol::Request& request, Pixels pixels, States states)
+{
+  if (!pixels)
+  {
+    return;
+  }
+
+  if (!fits(pixels->size()))
+  {
+    return;
+  }
+
+  // The states are only an optimization, keep the pixels without them if
+  // they do not fit together
+  auto size_bytes = pixels->size();
+  if (states)
+  {
+    auto states_bytes = std::size_t(0);
+    for (const auto& state : *states)
+    {
+      states_bytes += state.size_bytes();
+    }
+    if (fits(size_bytes + states_bytes))
+    {
+      size_bytes += states_bytes;
+    }
+    else
+    {
+      states = nullptr;
+    }
+  }
+
+  auto key = Protocol::serialize(request);
+  const auto it = m_index.find(key);
+  if (it != m_index.end())
+  {
+    // Replace, e.g. when two sessions computed the same request
+    m_size_bytes -= it->second->size_bytes;
+    m_entries.erase(it->second);
+    m_index.erase(it);
+  }
+
+  evict_until(m_max_bytes - size_bytes);
+
+  m_size_bytes += size_bytes;
+  m_entries.push_front({ key, request, std::move(pixels), std::move(states), size_bytes });
+  m_index.emplace(std::move(key), m_entries.begin());
+}
+
+void ResultCache::for_each(const std::function<void(const Protocol::Request&, const Pixels&, const States&)>& func) const
+{
+  for (const auto& entry : m_entries)
+  {
+    func(entry.request, entry.pixels, entry.states);
+  }
+}
+
+void ResultCache::evict_until(std::size_t max_bytes)
+{
+  while (m_size_bytes > max_bytes && !m_entries.empty())
+  {
+    const auto& entry = m_entries.back();
+    m_size_bytes -= entry.size_bytes;
+    m_index.erase(entry.key);
+    m_entries.pop_back();
+    m_evictions += 1;
+  }
+}
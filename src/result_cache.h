@@ -0,0 +1,117 @@
+#ifndef RESULT_CACHE_H_
+#define RESULT_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "mandelbrot.h"
+#include "protocol.h"
+
+/**
+ * @brief A memory bounded LRU cache of computed images
+ *
+ * Used by the server to answer repeated requests without computing them again.
+ * The key is the whole Request, so only exactly equal requests hit. An entry
+ * may also have the iteration state of the pixels that did not escape, so that
+ * they can be continued for a higher max_iter, @see Mandelbrot::compute_resumable.
+ * The cache is not thread safe, the server only uses it from the network thread.
+ */
+class ResultCache
+{
+ public:
+  using Pixels = std::shared_ptr<const std::vector<std::uint8_t>>;
+  using States = std::shared_ptr<const std::vector<Mandelbrot::ResumeState>>;
+
+  /**
+   * @brief Creates an empty cache
+   *
+   * @param[in]  max_bytes  Memory budget for the cached pixels and states, 0 disables the cache
+   */
+  explicit ResultCache(std::size_t max_bytes);
+
+  ResultCache(const ResultCache&) = delete;
+  ResultCache& operator=(const ResultCache&) = delete;
+
+  /**
+   * @brief Looks up the pixels for a request
+   *
+   * Counts a hit or a miss, and on a hit the entry becomes the most recently used.
+   *
+   * @param[in]  request  The request
+   *
+   * @return The pixels, or null if the request is not in the cache
+   */
+  Pixels get(const Protocol::Request& request);
+
+  /**
+   * @brief Adds the pixels for a request
+   *
+   * Least recently used entries are evicted until the entry fits in the budget.
+   * If the pixels and the states together are larger than the whole budget
+   * only the pixels are added, and pixels larger than the whole budget are
+   * not added.
+   *
+   * @param[in]  request  The request
+   * @param[in]  pixels   The computed pixels of the request
+   * @param[in]  states   Optional iteration state of the pixels, per band
+   */
+  void put(const Protocol::Request& request, Pixels pixels, States states = nullptr);
+
+  /**
+   * @brief Calls a function for every entry, most recently used first
+   *
+   * Does not count as hits or misses and does not change the LRU order.
+   * Used to find images that can be partially reused for a request.
+   *
+   * @param[in]  func  Function called with the request, pixels and states of each entry
+   */
+  void for_each(const std::function<void(const Protocol::Request&, const Pixels&, const States&)>& func) const;
+
+  /**
+   * @brief Checks if pixels of the given size can be added at all
+   */
+  bool fits(std::size_t bytes) const { return bytes <= m_max_bytes; }
+
+  std::size_t max_bytes() const { return m_max_bytes; }
+  std::size_t size_bytes() const { return m_size_bytes; }
+  std::size_t num_entries() const { return m_entries.size(); }
+  std::uint64_t hits() const { return m_hits; }
+  std::uint64_t misses() const { return m_misses; }
+  std::uint64_t evictions() const { return m_evictions; }
+
+ private:
+  // The key is the serialized Request, which contains every field
+  using Key = std::vector<std::uint8_t>;
+
+  struct KeyHash
+  {
+    std::size_t operator()(const Key& key) const;
+  };
+
+  struct Entry
+  {
+    Key key;
+    Protocol::Request request;
+    Pixels pixels;
+    States states;
+    std::size_t size_bytes;
+  };
+
+  void evict_until(std::size_t max_bytes);
+
+  // Entries in LRU order, most recently used first
+  std::list<Entry> m_entries;
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> m_index;
+  std::size_t m_max_bytes;
+  std::size_t m_size_bytes;
+  std::uint64_t m_hits;
+  std::uint64_t m_misses;
+  std::uint64_t m_evictions;
+};
+
+#endif  // RESULT_CACHE_H_
@@ -1,6 +1,7 @@
 #ifndef TCP_BACKEND_H_
 #define TCP_BACKEND_H_
 
+#include <chrono>
 #include <cstdint>
 #include <functional>
 #include <memory>
@@ -120,6 +121,29 @@ void run();
  */
 void stop();
 
+/**
+ * @brief Post a function to the TCP backend
+ *
+ * The function will be called in the context of run(), just like the callbacks.
+ * This is the only function that may be called from another thread than the one
+ * calling run(), and is used to hand over results from worker threads.
+ *
+ * @param[in]  function  The function to call
+ */
+void post(const std::function<void(void)>& function);
+
+/**
+ * @brief Post a function to the TCP backend, to be called after a delay
+ *
+ * Like post(), but the function is called when the delay has passed, without
+ * blocking other connections meanwhile. Must be called from the thread
+ * calling run(), e.g. from a callback.
+ *
+ * @param[in]  delay     The delay
+ * @param[in]  function  The function to call
+ */
+void post_delayed(std::chrono::milliseconds delay, const std::function<void(void)>& function);
+
 /**
  * @brief Represents a connection
  *
@@ -0,0 +1,154 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(int num_threads)
+    : m_queues(),
+      m_threads(),
+      m_num_queued(0),
+      m_mutex(),
+      m_wakeup(),
+      m_stopping(false)
+{
+  for (auto i = 0; i < num_threads; i++)
+  {
+    m_queues.push_back(std::make_unique<Queue>());
+  }
+
+  for (auto i = 0; i < num_threads; i++)
+  {
+    m_threads.emplace_back([this, i]() { worker_loop(i); });
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stopping = true;
+  }
+  m_wakeup.notify_all();
+
+  for (auto& thread : m_threads)
+  {
+    thread.join();
+  }
+}
+
+void ThreadPool::parallel_for(int num_tasks, const std::function<void(int)>& fn)
+{
+  if (num_tasks <= 0)
+  {
+    return;
+  }
+
+  Batch batch;
+  batch.fn = &fn;
+  batch.remaining = num_tasks;
+
+  // Give each worker a contiguous range of tasks, neighbouring tasks
+  // (e.g. image rows) then stay on the same worker unless stolen
+  const auto num_queues = static_cast<int>(m_queues.size());
+  for (auto q = 0; q < num_queues; q++)
+  {
+    const auto begin = static_cast<int>(static_cast<long long>(num_tasks) * q / num_queues);
+    const auto end = static_cast<int>(static_cast<long long>(num_tasks) * (q + 1) / num_queues);
+    std::lock_guard<std::mutex> lock(m_queues[q]->mutex);
+    for (auto i = begin; i < end; i++)
+    {
+      m_queues[q]->tasks.push_back(Task{ &batch, i });
+    }
+  }
+
+  // Wake up workers. Taking the lock makes sure that a worker that is about
+  // to sleep either sees the new tasks or gets the notification.
+  m_num_queued += num_tasks;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+  }
+  m_wakeup.notify_all();
+
+  // Help out while waiting, the calling thread steals like any other worker
+  Task task;
+  while (batch.remaining > 0 && steal(-1, &task))
+  {
+    run(task);
+  }
+
+  // The remaining tasks are being executed by workers, wait for them
+  std::unique_lock<std::mutex> lock(batch.mutex);
+  batch.done.wait(lock, [&batch]() { return batch.remaining == 0; });
+}
+
+bool ThreadPool::pop(int queue_index, Task* task)
+{
+  auto& queue = *m_queues[queue_index];
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.tasks.empty())
+  {
+    return false;
+  }
+
+  *task = queue.tasks.front();
+  queue.tasks.pop_front();
+  m_num_queued -= 1;
+  return true;
+}
+
+bool ThreadPool::steal(int thief_index, Task* task)
+{
+  // Start with the queue after the thief's own queue so that thieves
+  // spread out over the victims
+  const auto num_queues = static_cast<int>(m_queues.size());
+  for (auto i = 1; i <= num_queues; i++)
+  {
+    const auto victim = (thief_index + i + num_queues) % num_queues;
+    if (victim == thief_index)
+    {
+      continue;
+    }
+
+    auto& queue = *m_queues[victim];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty())
+    {
+      *task = queue.tasks.back();
+      queue.tasks.pop_back();
+      m_num_queued -= 1;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::run(const Task& task)
+{
+  auto* batch = task.batch;
+  (*batch->fn)(task.index);
+
+  // Note: the batch may be deleted as soon as remaining is 0 and the
+  //       waiting thread has been woken up, so lock before decrementing
+  std::lock_guard<std::mutex> lock(batch->mutex);
+  if (--batch->remaining == 0)
+  {
+    batch->done.notify_all();
+  }
+}
+
+void ThreadPool::worker_loop(int worker_index)
+{
+  while (true)
+  {
+    Task task;
+    if (pop(worker_index, &task) || steal(worker_index, &task))
+    {
+      run(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_wakeup.wait(lock, [this]() { return m_stopping || m_num_queued > 0; });
+    if (m_stopping)
+    {
+      return;
+    }
+  }
+}
@@ -0,0 +1,94 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief A work-stealing thread pool
+ *
+ * Each worker thread has its own task queue. A worker takes tasks from the
+ * front of its own queue and, when that queue is empty, steals tasks from the
+ * back of the other workers' queues. This keeps all workers busy even when the
+ * cost of the tasks varies a lot, e.g. Mandelbrot tiles inside and outside the set.
+ */
+class ThreadPool
+{
+ public:
+  /**
+   * @brief Creates the pool and starts the worker threads
+   *
+   * @param[in]  num_threads  Number of worker threads, must be at least 1
+   */
+  explicit ThreadPool(int num_threads);
+
+  /**
+   * @brief Stops and joins the worker threads
+   *
+   * No parallel_for() call may be ongoing.
+   */
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /**
+   * @brief Gets the number of worker threads
+   */
+  int num_threads() const { return static_cast<int>(m_threads.size()); }
+
+  /**
+   * @brief Runs fn(0), fn(1), ..., fn(num_tasks - 1) on the pool
+   *
+   * Returns when all tasks have finished. The calling thread executes tasks
+   * as well while it waits. May be called from several threads at once.
+   *
+   * @param[in]  num_tasks  Number of tasks
+   * @param[in]  fn         The task function, called with the task index
+   */
+  void parallel_for(int num_tasks, const std::function<void(int)>& fn);
+
+ private:
+  // Tasks from one parallel_for() call
+  struct Batch
+  {
+    const std::function<void(int)>* fn;
+    std::atomic<int> remaining;
+    std::mutex mutex;
+    std::condition_variable done;
+  };
+
+  struct Task
+  {
+    Batch* batch;
+    int index;
+  };
+
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  bool pop(int queue_index, Task* task);
+  bool steal(int thief_index, Task* task);
+  void run(const Task& task);
+  void worker_loop(int worker_index);
+
+  std::vector<std::unique_ptr<Queue>> m_queues;
+  std::vector<std::thread> m_threads;
+
+  // Used to let idle workers sleep until there are tasks
+  std::atomic<int> m_num_queued;
+  std::mutex m_mutex;
+  std::condition_variable m_wakeup;
+  bool m_stopping;
+};
+
+#endif  // THREAD_POOL_H_
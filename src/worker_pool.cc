@@ -0,0 +1,141 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+
+WorkerPool::WorkerPool(int num_workers, double quantum)
+    : m_threads(),
+      m_flows(),
+      m_turns(),
+      m_credited(false),
+      m_quantum(quantum),
+      m_mutex(),
+      m_wakeup(),
+      m_stopping(false)
+{
+  for (auto i = 0; i < num_workers; i++)
+  {
+    m_threads.emplace_back([this]() { worker_loop(); });
+  }
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stopping = true;
+    m_flows.clear();
+    m_turns.clear();
+  }
+  m_wakeup.notify_all();
+
+  for (auto& thread : m_threads)
+  {
+    thread.join();
+  }
+}
+
+void WorkerPool::submit(int flow, double cost, Job&& job)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto& jobs = m_flows[flow].jobs;
+    if (jobs.empty())
+    {
+      // The flow is idle, it gets a turn after the flows that have jobs
+      m_turns.push_back(flow);
+    }
+    jobs.emplace_back(cost, std::move(job));
+  }
+  m_wakeup.notify_one();
+}
+
+void WorkerPool::move_flow(int from, int to)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  const auto it = m_flows.find(from);
+  if (from == to || it == m_flows.end())
+  {
+    return;
+  }
+
+  auto moved = std::move(it->second);
+  m_flows.erase(it);
+  const auto turn = std::find(m_turns.begin(), m_turns.end(), from);
+  auto& flow = m_flows[to];
+  if (flow.jobs.empty())
+  {
+    *turn = to;
+    flow.deficit = moved.deficit;
+  }
+  else
+  {
+    if (turn == m_turns.begin())
+    {
+      // The turn goes to the next flow
+      m_credited = false;
+    }
+    m_turns.erase(turn);
+  }
+  for (auto& job : moved.jobs)
+  {
+    flow.jobs.push_back(std::move(job));
+  }
+}
+
+WorkerPool::Job WorkerPool::next_job()
+{
+  while (true)
+  {
+    const auto id = m_turns.front();
+    auto& flow = m_flows.at(id);
+    if (!m_credited)
+    {
+      flow.deficit += m_quantum;
+      m_credited = true;
+    }
+    if (m_turns.size() == 1u)
+    {
+      // No other flow to wait for, skip the turns it would take to cover the job
+      flow.deficit = std::max(flow.deficit, flow.jobs.front().first);
+    }
+
+    if (flow.jobs.front().first <= flow.deficit)
+    {
+      auto job = std::move(flow.jobs.front().second);
+      flow.deficit -= flow.jobs.front().first;
+      flow.jobs.pop_front();
+      if (flow.jobs.empty())
+      {
+        // An idle flow does not keep its credit
+        m_flows.erase(id);
+        m_turns.pop_front();
+        m_credited = false;
+      }
+      return job;
+    }
+
+    // The credit left does not cover the next job, the next flow has the turn
+    m_turns.pop_front();
+    m_turns.push_back(id);
+    m_credited = false;
+  }
+}
+
+void WorkerPool::worker_loop()
+{
+  while (true)
+  {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wakeup.wait(lock, [this]() { return m_stopping || !m_turns.empty(); });
+      if (m_stopping)
+      {
+        return;
+      }
+      job = next_job();
+    }
+
+    job();
+  }
+}
@@ -0,0 +1,96 @@
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief A pool of worker threads that run jobs of several flows with fair shares
+ *
+ * Used by the server to run computations outside of the network thread, a flow
+ * per session and a job per band of rows. Jobs of a flow run in submission
+ * order. Flows take turns with deficit round robin: each turn a flow is given
+ * a quantum of credit, and runs jobs as long as their estimated cost is
+ * covered by its credit. A flow with a large job therefore waits a few turns,
+ * while the other flows run their jobs, so a small request is not stuck behind
+ * a large one. Jobs hand their results back to the network thread with
+ * TcpBackend::post().
+ */
+class WorkerPool
+{
+ public:
+  using Job = std::function<void(void)>;
+
+  /**
+   * @brief Creates the pool and starts the worker threads
+   *
+   * @param[in]  num_workers  Number of worker threads, i.e. the number of
+   *                          jobs that can run at the same time
+   * @param[in]  quantum      Credit given to a flow per turn, in the unit of
+   *                          the job costs
+   */
+  WorkerPool(int num_workers, double quantum);
+
+  /**
+   * @brief Waits for running jobs to finish and joins the worker threads
+   *
+   * Jobs that have not yet started are discarded.
+   */
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  /**
+   * @brief Adds a job to the queue of a flow
+   *
+   * @param[in]  flow  Id of the flow
+   * @param[in]  cost  Estimated cost of the job
+   * @param[in]  job   The job to run on a worker thread
+   */
+  void submit(int flow, double cost, Job&& job);
+
+  /**
+   * @brief Moves the jobs of a flow to the end of the queue of another flow
+   *
+   * Used when the owner of a flow is gone but its jobs are still wanted. If
+   * the other flow has no jobs it takes over the turn and credit of the flow.
+   *
+   * @param[in]  from  Id of the flow whose jobs are moved
+   * @param[in]  to    Id of the flow to move them to
+   */
+  void move_flow(int from, int to);
+
+  /**
+   * @brief Gets the number of worker threads
+   */
+  int num_workers() const { return static_cast<int>(m_threads.size()); }
+
+ private:
+  struct Flow
+  {
+    std::deque<std::pair<double, Job>> jobs;  // Estimated cost and job
+    double deficit = 0.0;                     // Credit left in this turn
+  };
+
+  void worker_loop();
+
+  // Takes the next job to run, there must be one
+  Job next_job();
+
+  std::vector<std::thread> m_threads;
+  std::unordered_map<int, Flow> m_flows;  // Flows with jobs
+  std::deque<int> m_turns;                // Flows with jobs, the first one has the turn
+  bool m_credited;                        // True if the first flow has been given its quantum
+  double m_quantum;
+  std::mutex m_mutex;
+  std::condition_variable m_wakeup;
+  bool m_stopping;
+};
+
+#endif  // WORKER_POOL_H_